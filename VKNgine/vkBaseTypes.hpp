@@ -25,6 +25,11 @@ struct QueueFamilyIndices
   int _graphicsFamily = -1;
   int _presentFamily = -1;
 
+  //Cola de transferencia: familia dedicada si existe, si no una segunda
+  //cola de la familia gráfica (o la propia cola gráfica como último recurso)
+  int _transferFamily = -1;
+  uint32_t _transferQueueIndex = 0;
+
   bool isComplete ( )
   {
     return _graphicsFamily >= 0 && _presentFamily >= 0;
@@ -104,9 +109,314 @@ namespace std
   };
 }
 
-struct UniformBufferObject
+//Lote de subidas a GPU: copias y barreras grabadas en un único command
+//buffer de la cola de transferencia. Las barreras que necesitan etapas
+//gráficas (adquisición de ownership, depth...) van en un segundo command
+//buffer que se ejecuta en la cola gráfica cuando termina la copia.
+struct UploadBatch
+{
+  enum State
+  {
+    RECORDING,
+    TRANSFER_PENDING,
+    GRAPHICS_PENDING,
+    RELEASED
+  };
+
+  VkCommandBuffer _commandBuffer = VK_NULL_HANDLE;
+  VkCommandBuffer _graphicsCommandBuffer = VK_NULL_HANDLE;
+
+  //Ticket de la copia (timeline de transferencia, o el gráfico si se
+  //comparte cola) y ticket final en el timeline gráfico
+  GpuTicket _transferTicket = 0;
+  GpuTicket _ticket = 0;
+
+  //Familias distintas: hace falta release/acquire de ownership
+  bool _ownershipTransfer = false;
+  bool _separateQueue = false;
+
+  //Staging buffers que deben vivir hasta que termine la copia
+  std::vector < VkBuffer > _stagingBuffers;
+  std::vector < VkDeviceMemory > _stagingBuffersMemory;
+
+  //Entregas a la cola gráfica acumuladas; se graban todas juntas al
+  //cerrar el lote (un vkCmdPipelineBarrier por command buffer)
+  std::vector < std::pair < VkImage, ImageUsage > > _imageHandOffs;
+  std::vector < VkBufferMemoryBarrier > _bufferHandOffs;
+  VkPipelineStageFlags _handOffStages = 0;
+
+  State _state = RELEASED;
+
+  //Se invoca cuando el lote se retira tras completarse en la GPU
+  std::function < void ( ) > _onComplete;
+};
+
+//Datos por instancia (segundo stream de vértices, VK_VERTEX_INPUT_RATE_INSTANCE)
+struct InstanceData
 {
   glm::mat4 _model;
+  glm::vec4 _color;
+
+  static VkVertexInputBindingDescription getBindingDescription ( )
+  {
+    VkVertexInputBindingDescription bindingDescription = {};
+    bindingDescription.binding = 1;
+    bindingDescription.stride = sizeof ( InstanceData );
+    bindingDescription.inputRate = VK_VERTEX_INPUT_RATE_INSTANCE;
+
+    return bindingDescription;
+  }
+
+  static std::array < VkVertexInputAttributeDescription,
+    5 > getAttributeDescriptions ( )
+  {
+    std::array < VkVertexInputAttributeDescription, 5 >
+      attributeDescriptions = {};
+
+    //Matriz de modelo: un atributo por columna (locations 3 a 6)
+    for ( uint32_t i = 0; i < 4; i++ )
+    {
+      attributeDescriptions[i].binding = 1;
+      attributeDescriptions[i].location = 3 + i;
+      attributeDescriptions[i].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+      attributeDescriptions[i].offset = static_cast<uint32_t>(
+        offsetof( InstanceData, _model ) + i*sizeof ( glm::vec4 ));
+    }
+
+    //Color
+    attributeDescriptions[4].binding = 1;
+    attributeDescriptions[4].location = 7;
+    attributeDescriptions[4].format = VK_FORMAT_R32G32B32A32_SFLOAT;
+    attributeDescriptions[4].offset = offsetof( InstanceData, _color );
+
+    return attributeDescriptions;
+  }
+};
+
+//Datos por frame
+struct UniformBufferObject
+{
   glm::mat4 _view;
   glm::mat4 _proj;
 };
+
+//Datos por draw (push constants, layout std430 del vertex shader)
+struct ObjectPushConstants
+{
+  glm::mat4 _model;
+  uint32_t _objectIndex;
+};
+
+//Datos por draw en el storage buffer del camino indirecto. Mismo stride que
+//el struct std430 del vertex shader (alineado a 16)
+struct ObjectGpuData
+{
+  glm::mat4 _model;
+  uint32_t _objectIndex;
+  uint32_t _padding[3];
+};
+
+//Cómo se emiten los draws del frame
+enum DrawPath
+{
+  DRAW_DIRECT,    //Un vkCmdDrawIndexed con push constants por objeto
+  DRAW_INDIRECT,  //Comandos en buffer: una sola llamada indirecta
+  DRAW_GPU_CULLED //Comandos generados por el compute de culling
+};
+
+//Parámetros del compute de culling (layout std140 de cull.comp)
+struct CullParams
+{
+  //Planos del frustum (normal hacia dentro, normalizados)
+  glm::vec4 _frustumPlanes[6];
+  //ViewProj con la que se generó la pirámide HiZ
+  glm::mat4 _hiZViewProj;
+  //Esfera envolvente del mallado en espacio de modelo (centro y radio)
+  glm::vec4 _meshBounds;
+  uint32_t _objectCount;
+  uint32_t _indexCount;
+  uint32_t _occlusion;
+  uint32_t _hiZLevels;
+  glm::vec2 _hiZSize;
+  glm::vec2 _padding;
+};
+
+//Política de presentación, se puede cambiar en ejecución
+enum PresentPolicy
+{
+  PRESENT_VSYNC,        //FIFO
+  PRESENT_LOW_LATENCY,  //MAILBOX (si no, IMMEDIATE o FIFO)
+  PRESENT_UNCAPPED,     //IMMEDIATE (si no, MAILBOX o FIFO)
+  PRESENT_FRAME_CAP     //Sin vsync y con limitador de frames
+};
+
+//Tiempos de frame y latencia entrada -> presentación, en ms
+struct FrameTimingStats
+{
+  double _frameTimeMs = 0.0;
+  double _latencyMs = 0.0;
+  double _averageLatencyMs = 0.0;
+  double _maxLatencyMs = 0.0;
+  uint64_t _frameCount = 0;
+
+  //Timestamps GPU: llegan con _framesInFlight frames de retraso
+  double _gpuFrameTimeMs = 0.0;
+  uint64_t _gpuFrameCount = 0;
+
+  //Cola de draws del último frame enviado (camino directo)
+  uint32_t _drawCalls = 0;
+  uint32_t _stateBinds = 0;
+  uint32_t _elidedBinds = 0;
+
+  //Command buffers reenviados sin regrabar y grabados, acumulados
+  uint64_t _commandBufferHits = 0;
+  uint64_t _commandBufferRecords = 0;
+};
+
+typedef std::function < void ( const FrameTimingStats& ) > FrameStatsCallback;
+
+//Cámara guionizada: matriz de vista en función del tiempo de simulación
+typedef std::function < glm::mat4 ( double time ) > CameraPath;
+
+//Instancias del mallado: se rellenan en el hilo principal cada frame
+typedef std::function < void ( double time,
+                               std::vector < InstanceData >& instances ) >
+  InstanceUpdater;
+
+//Swapchain sustituida y sus semáforos de presentación. Que el timeline
+//llegue al último envío no dice que el motor de presentación haya
+//terminado de esperar esos semáforos ni soltado las imágenes: se espera
+//además a que la nueva swapchain haya presentado tantas veces como
+//imágenes tenía la vieja
+struct RetiredSwapChain
+{
+  uint32_t _presentsLeft = 0;
+  std::function < void ( ) > _destroy;
+};
+
+//Primario grabado para una imagen. Se reenvía tal cual mientras no cambie
+//la huella de su lista de draws
+struct RecordedCommandBuffer
+{
+  VkCommandBuffer _commandBuffer = VK_NULL_HANDLE;
+  uint64_t _fingerprint = 0;
+  bool _valid = false;
+
+  //Ejecuta los secundarios del frame: deja de valer al regrabarlos
+  bool _usesSecondaries = false;
+
+  RenderQueueStats _queueStats;
+
+  //Scopes del profiler de la grabación, para restaurarlos al reenviarlo
+  std::vector < GpuScope > _profilerScopes;
+};
+
+//Recursos propios de cada frame en vuelo
+struct FrameData
+{
+  //Imagen adquirida y preparada para renderizarse
+  VkSemaphore _imageAvailableSemaphore = VK_NULL_HANDLE;
+
+  //Último envío de este frame: hay que esperarlo antes de reutilizarlo
+  GpuTicket _ticket = 0;
+
+  //Pool del frame con sus primarios (se reservan al usarse; uno por imagen
+  //solo con reutilización de command buffers) y el elegido para el envío
+  //actual
+  VkCommandPool _commandPool = VK_NULL_HANDLE;
+  std::vector < RecordedCommandBuffer > _recorded;
+  VkCommandBuffer _commandBuffer = VK_NULL_HANDLE;
+
+  //Grabación en paralelo: un pool y un secundario por worker (un pool
+  //solo se usa desde un hilo)
+  std::vector < VkCommandPool > _workerPools;
+  std::vector < VkCommandBuffer > _secondaryBuffers;
+};
+
+//Estado inmutable de un frame: lo rellena el hilo principal y lo consume
+//el de render
+struct FrameSnapshot
+{
+  //Cámara
+  glm::mat4 _view;
+  float _fovY = 0.0f;
+  float _nearPlane = 0.0f;
+  float _farPlane = 0.0f;
+
+  //Lista de draws: una transformación por objeto
+  std::vector < ObjectPushConstants > _objects;
+
+  //Copias instanciadas del mallado: un solo draw para todas
+  std::vector < InstanceData > _instances;
+
+  //Tiempo de simulación en segundos
+  double _time = 0.0;
+
+  //Momento en que se leyó la entrada (para la latencia)
+  std::chrono::steady_clock::time_point _inputTime;
+  uint64_t _sequence = 0;
+};
+
+//Resultado de una lectura GPU -> CPU. _data solo es válido durante el
+//callback; las imágenes se entregan con filas compactas (_rowPitch)
+struct ReadbackResult
+{
+  const void* _data = nullptr;
+  VkDeviceSize _size = 0;
+
+  uint32_t _width = 0;
+  uint32_t _height = 0;
+  uint32_t _rowPitch = 0;
+  VkFormat _format = VK_FORMAT_UNDEFINED;
+};
+
+typedef std::function < void ( const ReadbackResult& ) > ReadbackCallback;
+
+//Hueco del anillo de lecturas: buffer host-cached mapeado de forma
+//persistente que se reutiliza entre peticiones
+struct ReadbackSlot
+{
+  enum State
+  {
+    FREE,
+    RECORDED,
+    PENDING
+  };
+
+  VkBuffer _buffer = VK_NULL_HANDLE;
+  VkDeviceMemory _memory = VK_NULL_HANDLE;
+  void* _mapped = nullptr;
+  VkDeviceSize _capacity = 0;
+  //Sin coherencia hay que invalidar antes de leer
+  bool _coherent = false;
+
+  VkCommandBuffer _commandBuffer = VK_NULL_HANDLE;
+  GpuTicket _ticket = 0;
+  State _state = FREE;
+
+  ReadbackResult _result;
+  ReadbackCallback _callback;
+};
+
+//Bytes por texel de los formatos de color que se pueden leer
+inline uint32_t formatTexelSize ( VkFormat format )
+{
+  switch ( format )
+  {
+    case VK_FORMAT_R8G8B8A8_UNORM:
+    case VK_FORMAT_R8G8B8A8_SRGB:
+    case VK_FORMAT_B8G8R8A8_UNORM:
+    case VK_FORMAT_B8G8R8A8_SRGB:
+    case VK_FORMAT_R32_UINT:
+    case VK_FORMAT_R32_SFLOAT:
+      return 4;
+    case VK_FORMAT_R16G16B16A16_SFLOAT:
+    case VK_FORMAT_R32G32_SFLOAT:
+      return 8;
+    case VK_FORMAT_R32G32B32A32_SFLOAT:
+      return 16;
+    default:
+      throw std::runtime_error ( "unsupported readback format!" );
+  }
+}
+
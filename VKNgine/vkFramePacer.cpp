@@ -0,0 +1,80 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkFramePacer.h"
+
+#include <thread>
+
+//Último tramo que se hace en espera activa
+static const std::chrono::microseconds SPIN_THRESHOLD ( 1500 );
+
+void FramePacer::setTargetFrameTime ( double seconds )
+{
+  _target = seconds > 0.0
+    ? std::chrono::duration_cast < Clock::duration > (
+        std::chrono::duration < double > ( seconds ))
+    : Clock::duration::zero ( );
+  reset ( );
+}
+
+double FramePacer::targetFrameTime ( ) const
+{
+  return std::chrono::duration < double > ( _target ).count ( );
+}
+
+void FramePacer::wait ( )
+{
+  if ( _target == Clock::duration::zero ( ))
+    return;
+
+  Clock::time_point now = Clock::now ( );
+  if ( !_started )
+  {
+    _started = true;
+    _nextFrame = now + _target;
+    return;
+  }
+
+  if ( _nextFrame > now )
+  {
+    if ( _nextFrame - now > SPIN_THRESHOLD )
+    {
+      std::this_thread::sleep_for ( _nextFrame - now - SPIN_THRESHOLD );
+    }
+
+    while ( Clock::now ( ) < _nextFrame )
+    {
+    }
+  }
+
+  //Si vamos más de un frame tarde no se intenta recuperar el retraso
+  now = Clock::now ( );
+  _nextFrame += _target;
+  if ( _nextFrame < now )
+  {
+    _nextFrame = now + _target;
+  }
+}
+
+void FramePacer::reset ( )
+{
+  _started = false;
+}
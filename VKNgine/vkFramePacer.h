@@ -0,0 +1,50 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKFRAMEPACER_H
+#define VKFRAMEPACER_H
+
+#include <chrono>
+
+//Limitador de frames: duerme hasta cerca del objetivo y termina con
+//espera activa, porque la precisión del sleep del sistema no basta
+class FramePacer
+{
+  public:
+    //0 = sin límite
+    void setTargetFrameTime ( double seconds );
+
+    double targetFrameTime ( ) const;
+
+    //Bloquea hasta el inicio del siguiente frame
+    void wait ( );
+
+    void reset ( );
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    Clock::duration _target = Clock::duration::zero ( );
+    Clock::time_point _nextFrame;
+    bool _started = false;
+};
+
+#endif //VKFRAMEPACER_H
@@ -0,0 +1,576 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkFrustumCuller.h"
+#include "vkWorkerPool.h"
+
+#include <algorithm>
+#include <cmath>
+
+//GCC y Clang (también clang-cl) compilan cada función con su target; MSVC
+//admite los intrínsecos AVX2 sin /arch y solo hay que detectar la CPU
+#if defined ( __GNUC__ ) && ( defined ( __x86_64__ ) || defined ( __i386__ ))
+#define VKNGINE_CULL_SIMD 1
+#include <immintrin.h>
+#elif defined ( _MSC_VER ) && ( defined ( _M_X64 ) || defined ( _M_IX86 ))
+#define VKNGINE_CULL_SIMD 1
+#include <immintrin.h>
+#include <intrin.h>
+#endif
+
+#if defined ( __GNUC__ ) || defined ( __clang__ )
+#define VKNGINE_CULL_TARGET( isa ) __attribute__ (( target ( isa )))
+#else
+#define VKNGINE_CULL_TARGET( isa )
+#endif
+
+//Por debajo de esto no compensa repartir entre workers
+static const size_t MIN_OBJECTS_PER_WORKER = 16384;
+
+enum SimdLevel
+{
+  SIMD_SCALAR,
+  SIMD_SSE,
+  SIMD_AVX2
+};
+
+//_xgetbv en clang-cl necesita el target xsave
+#if defined ( VKNGINE_CULL_SIMD ) && defined ( _MSC_VER )
+VKNGINE_CULL_TARGET ( "xsave" )
+#endif
+static SimdLevel detectSimdLevel ( )
+{
+#if defined ( VKNGINE_CULL_SIMD ) && defined ( _MSC_VER )
+#ifdef __AVX2__
+  //Compilado con /arch:AVX2: la CPU lo tiene seguro
+  return SIMD_AVX2;
+#else
+  int info[4];
+  __cpuid ( info, 0 );
+  int maxLeaf = info[0];
+
+  __cpuid ( info, 1 );
+  bool sse2 = ( info[3] & ( 1 << 26 )) != 0;
+  bool osxsave = ( info[2] & ( 1 << 27 )) != 0;
+  bool avx = ( info[2] & ( 1 << 28 )) != 0;
+
+  //AVX2 necesita además que el SO guarde los registros YMM
+  if ( maxLeaf >= 7 && osxsave && avx
+       && ( _xgetbv ( 0 ) & 0x6 ) == 0x6 )
+  {
+    __cpuidex ( info, 7, 0 );
+    if (( info[1] & ( 1 << 5 )) != 0 )
+    {
+      return SIMD_AVX2;
+    }
+  }
+  if ( sse2 )
+  {
+    return SIMD_SSE;
+  }
+#endif
+#elif defined ( VKNGINE_CULL_SIMD )
+  __builtin_cpu_init ( );
+  if ( __builtin_cpu_supports ( "avx2" ))
+  {
+    return SIMD_AVX2;
+  }
+  if ( __builtin_cpu_supports ( "sse2" ))
+  {
+    return SIMD_SSE;
+  }
+#endif
+  return SIMD_SCALAR;
+}
+
+static const SimdLevel SIMD_LEVEL = detectSimdLevel ( );
+
+//Versiones escalares: CPUs sin SIMD y las colas de los bloques. La
+//escritura es incondicional para no saltar en cada objeto
+static size_t cullSpheresScalar ( const float planes[6][4],
+                                  const float* x,
+                                  const float* y,
+                                  const float* z,
+                                  const float* radius,
+                                  size_t begin,
+                                  size_t end,
+                                  uint32_t* out )
+{
+  size_t count = 0;
+  for ( size_t i = begin; i < end; i++ )
+  {
+    bool inside = true;
+    for ( int p = 0; p < 6; p++ )
+    {
+      float distance = planes[p][0] * x[i] + planes[p][1] * y[i]
+        + planes[p][2] * z[i] + planes[p][3];
+      inside = inside && distance > -radius[i];
+    }
+    out[count] = static_cast<uint32_t>(i);
+    count += inside ? 1 : 0;
+  }
+  return count;
+}
+
+static size_t cullBoxesScalar ( const float planes[6][4],
+                                const float absPlanes[6][3],
+                                const float* x,
+                                const float* y,
+                                const float* z,
+                                const float* extentX,
+                                const float* extentY,
+                                const float* extentZ,
+                                size_t begin,
+                                size_t end,
+                                uint32_t* out )
+{
+  size_t count = 0;
+  for ( size_t i = begin; i < end; i++ )
+  {
+    bool inside = true;
+    for ( int p = 0; p < 6; p++ )
+    {
+      float distance = planes[p][0] * x[i] + planes[p][1] * y[i]
+        + planes[p][2] * z[i] + planes[p][3];
+      float radius = absPlanes[p][0] * extentX[i]
+        + absPlanes[p][1] * extentY[i] + absPlanes[p][2] * extentZ[i];
+      inside = inside && distance > -radius;
+    }
+    out[count] = static_cast<uint32_t>(i);
+    count += inside ? 1 : 0;
+  }
+  return count;
+}
+
+#ifdef VKNGINE_CULL_SIMD
+
+//Índices de los bits activos de la máscara de un bloque
+static inline size_t emitMask ( int mask, size_t base, uint32_t* out )
+{
+  size_t count = 0;
+  while ( mask != 0 )
+  {
+#ifdef _MSC_VER
+    unsigned long bit;
+    _BitScanForward ( &bit, static_cast<unsigned long>(mask) );
+    out[count++] = static_cast<uint32_t>(base + bit);
+#else
+    out[count++] = static_cast<uint32_t>(base + __builtin_ctz ( mask ));
+#endif
+    mask &= mask - 1;
+  }
+  return count;
+}
+
+VKNGINE_CULL_TARGET ( "avx2" )
+static size_t cullSpheresAvx2 ( const float planes[6][4],
+                                const float* x,
+                                const float* y,
+                                const float* z,
+                                const float* radius,
+                                size_t begin,
+                                size_t end,
+                                uint32_t* out )
+{
+  __m256 planeX[6], planeY[6], planeZ[6], planeW[6];
+  for ( int p = 0; p < 6; p++ )
+  {
+    planeX[p] = _mm256_set1_ps ( planes[p][0] );
+    planeY[p] = _mm256_set1_ps ( planes[p][1] );
+    planeZ[p] = _mm256_set1_ps ( planes[p][2] );
+    planeW[p] = _mm256_set1_ps ( planes[p][3] );
+  }
+
+  size_t count = 0;
+  size_t i = begin;
+  for ( ; i + 8 <= end; i += 8 )
+  {
+    __m256 centerX = _mm256_loadu_ps ( x + i );
+    __m256 centerY = _mm256_loadu_ps ( y + i );
+    __m256 centerZ = _mm256_loadu_ps ( z + i );
+    __m256 negRadius = _mm256_sub_ps ( _mm256_setzero_ps ( ),
+                                       _mm256_loadu_ps ( radius + i ));
+
+    __m256 inside = _mm256_castsi256_ps ( _mm256_set1_epi32 ( -1 ));
+    for ( int p = 0; p < 6; p++ )
+    {
+      __m256 distance =
+        _mm256_add_ps ( _mm256_add_ps ( _mm256_mul_ps ( planeX[p], centerX ),
+                                        _mm256_mul_ps ( planeY[p], centerY )),
+                        _mm256_add_ps ( _mm256_mul_ps ( planeZ[p], centerZ ),
+                                        planeW[p] ));
+      inside = _mm256_and_ps ( inside,
+                               _mm256_cmp_ps ( distance,
+                                               negRadius,
+                                               _CMP_GT_OQ ));
+    }
+    count += emitMask ( _mm256_movemask_ps ( inside ), i, out + count );
+  }
+
+  return count + cullSpheresScalar ( planes, x, y, z, radius, i, end,
+                                     out + count );
+}
+
+VKNGINE_CULL_TARGET ( "avx2" )
+static size_t cullBoxesAvx2 ( const float planes[6][4],
+                              const float absPlanes[6][3],
+                              const float* x,
+                              const float* y,
+                              const float* z,
+                              const float* extentX,
+                              const float* extentY,
+                              const float* extentZ,
+                              size_t begin,
+                              size_t end,
+                              uint32_t* out )
+{
+  size_t count = 0;
+  size_t i = begin;
+  for ( ; i + 8 <= end; i += 8 )
+  {
+    __m256 centerX = _mm256_loadu_ps ( x + i );
+    __m256 centerY = _mm256_loadu_ps ( y + i );
+    __m256 centerZ = _mm256_loadu_ps ( z + i );
+    __m256 halfX = _mm256_loadu_ps ( extentX + i );
+    __m256 halfY = _mm256_loadu_ps ( extentY + i );
+    __m256 halfZ = _mm256_loadu_ps ( extentZ + i );
+
+    __m256 inside = _mm256_castsi256_ps ( _mm256_set1_epi32 ( -1 ));
+    for ( int p = 0; p < 6; p++ )
+    {
+      __m256 distance =
+        _mm256_add_ps (
+          _mm256_add_ps ( _mm256_mul_ps ( _mm256_set1_ps ( planes[p][0] ), centerX ),
+                          _mm256_mul_ps ( _mm256_set1_ps ( planes[p][1] ), centerY )),
+          _mm256_add_ps ( _mm256_mul_ps ( _mm256_set1_ps ( planes[p][2] ), centerZ ),
+                          _mm256_set1_ps ( planes[p][3] )));
+      __m256 negRadius =
+        _mm256_sub_ps (
+          _mm256_setzero_ps ( ),
+          _mm256_add_ps (
+            _mm256_add_ps ( _mm256_mul_ps ( _mm256_set1_ps ( absPlanes[p][0] ), halfX ),
+                            _mm256_mul_ps ( _mm256_set1_ps ( absPlanes[p][1] ), halfY )),
+            _mm256_mul_ps ( _mm256_set1_ps ( absPlanes[p][2] ), halfZ )));
+      inside = _mm256_and_ps ( inside,
+                               _mm256_cmp_ps ( distance,
+                                               negRadius,
+                                               _CMP_GT_OQ ));
+    }
+    count += emitMask ( _mm256_movemask_ps ( inside ), i, out + count );
+  }
+
+  return count + cullBoxesScalar ( planes, absPlanes, x, y, z,
+                                   extentX, extentY, extentZ, i, end,
+                                   out + count );
+}
+
+VKNGINE_CULL_TARGET ( "sse2" )
+static size_t cullSpheresSse ( const float planes[6][4],
+                               const float* x,
+                               const float* y,
+                               const float* z,
+                               const float* radius,
+                               size_t begin,
+                               size_t end,
+                               uint32_t* out )
+{
+  size_t count = 0;
+  size_t i = begin;
+  for ( ; i + 4 <= end; i += 4 )
+  {
+    __m128 centerX = _mm_loadu_ps ( x + i );
+    __m128 centerY = _mm_loadu_ps ( y + i );
+    __m128 centerZ = _mm_loadu_ps ( z + i );
+    __m128 negRadius = _mm_sub_ps ( _mm_setzero_ps ( ),
+                                    _mm_loadu_ps ( radius + i ));
+
+    __m128 inside = _mm_castsi128_ps ( _mm_set1_epi32 ( -1 ));
+    for ( int p = 0; p < 6; p++ )
+    {
+      __m128 distance =
+        _mm_add_ps ( _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( planes[p][0] ), centerX ),
+                                  _mm_mul_ps ( _mm_set1_ps ( planes[p][1] ), centerY )),
+                     _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( planes[p][2] ), centerZ ),
+                                  _mm_set1_ps ( planes[p][3] )));
+      inside = _mm_and_ps ( inside, _mm_cmpgt_ps ( distance, negRadius ));
+    }
+    count += emitMask ( _mm_movemask_ps ( inside ), i, out + count );
+  }
+
+  return count + cullSpheresScalar ( planes, x, y, z, radius, i, end,
+                                     out + count );
+}
+
+VKNGINE_CULL_TARGET ( "sse2" )
+static size_t cullBoxesSse ( const float planes[6][4],
+                             const float absPlanes[6][3],
+                             const float* x,
+                             const float* y,
+                             const float* z,
+                             const float* extentX,
+                             const float* extentY,
+                             const float* extentZ,
+                             size_t begin,
+                             size_t end,
+                             uint32_t* out )
+{
+  size_t count = 0;
+  size_t i = begin;
+  for ( ; i + 4 <= end; i += 4 )
+  {
+    __m128 centerX = _mm_loadu_ps ( x + i );
+    __m128 centerY = _mm_loadu_ps ( y + i );
+    __m128 centerZ = _mm_loadu_ps ( z + i );
+    __m128 halfX = _mm_loadu_ps ( extentX + i );
+    __m128 halfY = _mm_loadu_ps ( extentY + i );
+    __m128 halfZ = _mm_loadu_ps ( extentZ + i );
+
+    __m128 inside = _mm_castsi128_ps ( _mm_set1_epi32 ( -1 ));
+    for ( int p = 0; p < 6; p++ )
+    {
+      __m128 distance =
+        _mm_add_ps ( _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( planes[p][0] ), centerX ),
+                                  _mm_mul_ps ( _mm_set1_ps ( planes[p][1] ), centerY )),
+                     _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( planes[p][2] ), centerZ ),
+                                  _mm_set1_ps ( planes[p][3] )));
+      __m128 negRadius =
+        _mm_sub_ps ( _mm_setzero_ps ( ),
+                     _mm_add_ps ( _mm_add_ps ( _mm_mul_ps ( _mm_set1_ps ( absPlanes[p][0] ), halfX ),
+                                               _mm_mul_ps ( _mm_set1_ps ( absPlanes[p][1] ), halfY )),
+                                  _mm_mul_ps ( _mm_set1_ps ( absPlanes[p][2] ), halfZ )));
+      inside = _mm_and_ps ( inside, _mm_cmpgt_ps ( distance, negRadius ));
+    }
+    count += emitMask ( _mm_movemask_ps ( inside ), i, out + count );
+  }
+
+  return count + cullBoxesScalar ( planes, absPlanes, x, y, z,
+                                   extentX, extentY, extentZ, i, end,
+                                   out + count );
+}
+
+#endif //VKNGINE_CULL_SIMD
+
+void FrustumCuller::resize ( size_t count )
+{
+  _centerX.resize ( count );
+  _centerY.resize ( count );
+  _centerZ.resize ( count );
+  _radius.resize ( count );
+
+  _boxX.resize ( count );
+  _boxY.resize ( count );
+  _boxZ.resize ( count );
+  _extentX.resize ( count );
+  _extentY.resize ( count );
+  _extentZ.resize ( count );
+}
+
+size_t FrustumCuller::size ( ) const
+{
+  return _centerX.size ( );
+}
+
+void FrustumCuller::setSphere ( size_t index,
+                                float x,
+                                float y,
+                                float z,
+                                float radius )
+{
+  _centerX[index] = x;
+  _centerY[index] = y;
+  _centerZ[index] = z;
+  _radius[index] = radius;
+}
+
+void FrustumCuller::setBox ( size_t index,
+                             const float* min,
+                             const float* max )
+{
+  _boxX[index] = ( min[0] + max[0] ) * 0.5f;
+  _boxY[index] = ( min[1] + max[1] ) * 0.5f;
+  _boxZ[index] = ( min[2] + max[2] ) * 0.5f;
+  _extentX[index] = ( max[0] - min[0] ) * 0.5f;
+  _extentY[index] = ( max[1] - min[1] ) * 0.5f;
+  _extentZ[index] = ( max[2] - min[2] ) * 0.5f;
+}
+
+//Planos a partir de las filas de la matriz (Gribb-Hartmann)
+void FrustumCuller::setFrustum ( const float* viewProj )
+{
+  float rows[4][4];
+  for ( int row = 0; row < 4; row++ )
+  {
+    for ( int column = 0; column < 4; column++ )
+    {
+      rows[row][column] = viewProj[column * 4 + row];
+    }
+  }
+
+  for ( int i = 0; i < 4; i++ )
+  {
+    _planes[0][i] = rows[3][i] + rows[0][i];
+    _planes[1][i] = rows[3][i] - rows[0][i];
+    _planes[2][i] = rows[3][i] + rows[1][i];
+    _planes[3][i] = rows[3][i] - rows[1][i];
+    _planes[4][i] = rows[2][i];
+    _planes[5][i] = rows[3][i] - rows[2][i];
+  }
+
+  for ( int p = 0; p < 6; p++ )
+  {
+    float length = std::sqrt ( _planes[p][0] * _planes[p][0]
+                                 + _planes[p][1] * _planes[p][1]
+                                 + _planes[p][2] * _planes[p][2] );
+    for ( int i = 0; i < 4; i++ )
+    {
+      _planes[p][i] /= length;
+    }
+    for ( int i = 0; i < 3; i++ )
+    {
+      _absPlanes[p][i] = std::fabs ( _planes[p][i] );
+    }
+  }
+}
+
+size_t FrustumCuller::cullRange ( CullVolume volume,
+                                  size_t begin,
+                                  size_t end,
+                                  uint32_t* out ) const
+{
+#ifdef VKNGINE_CULL_SIMD
+  SimdLevel level = _forceScalar ? SIMD_SCALAR : SIMD_LEVEL;
+#endif
+
+  if ( volume == CULL_SPHERES )
+  {
+#ifdef VKNGINE_CULL_SIMD
+    if ( level == SIMD_AVX2 )
+    {
+      return cullSpheresAvx2 ( _planes, _centerX.data ( ), _centerY.data ( ),
+                               _centerZ.data ( ), _radius.data ( ),
+                               begin, end, out );
+    }
+    if ( level == SIMD_SSE )
+    {
+      return cullSpheresSse ( _planes, _centerX.data ( ), _centerY.data ( ),
+                              _centerZ.data ( ), _radius.data ( ),
+                              begin, end, out );
+    }
+#endif
+    return cullSpheresScalar ( _planes, _centerX.data ( ), _centerY.data ( ),
+                               _centerZ.data ( ), _radius.data ( ),
+                               begin, end, out );
+  }
+
+#ifdef VKNGINE_CULL_SIMD
+  if ( level == SIMD_AVX2 )
+  {
+    return cullBoxesAvx2 ( _planes, _absPlanes, _boxX.data ( ), _boxY.data ( ),
+                           _boxZ.data ( ), _extentX.data ( ), _extentY.data ( ),
+                           _extentZ.data ( ), begin, end, out );
+  }
+  if ( level == SIMD_SSE )
+  {
+    return cullBoxesSse ( _planes, _absPlanes, _boxX.data ( ), _boxY.data ( ),
+                          _boxZ.data ( ), _extentX.data ( ), _extentY.data ( ),
+                          _extentZ.data ( ), begin, end, out );
+  }
+#endif
+  return cullBoxesScalar ( _planes, _absPlanes, _boxX.data ( ), _boxY.data ( ),
+                           _boxZ.data ( ), _extentX.data ( ), _extentY.data ( ),
+                           _extentZ.data ( ), begin, end, out );
+}
+
+//Cada worker escribe sus visibles en su propio tramo de la lista y luego
+//se juntan en orden de tramo
+const std::vector < uint32_t >& FrustumCuller::cull ( CullVolume volume,
+                                                      WorkerPool* workers )
+{
+  size_t count = size ( );
+  if ( _scratch.size ( ) < count )
+  {
+    _scratch.resize ( count );
+  }
+
+  _visible.clear ( );
+  if ( workers == nullptr || count < 2 * MIN_OBJECTS_PER_WORKER )
+  {
+    size_t written = cullRange ( volume, 0, count, _scratch.data ( ));
+    _visible.assign ( _scratch.begin ( ), _scratch.begin ( ) + written );
+    return _visible;
+  }
+
+  std::vector < size_t > begins ( workers->workerCount ( ), 0 );
+  std::vector < size_t > written ( workers->workerCount ( ), 0 );
+  workers->parallelFor ( count,
+                         MIN_OBJECTS_PER_WORKER,
+    [&] ( size_t begin, size_t end, uint32_t worker )
+    {
+      begins[worker] = begin;
+      written[worker] = cullRange ( volume,
+                                    begin,
+                                    end,
+                                    _scratch.data ( ) + begin );
+    } );
+
+  std::vector < uint32_t > order ( begins.size ( ));
+  for ( uint32_t i = 0; i < order.size ( ); i++ )
+  {
+    order[i] = i;
+  }
+  std::sort ( order.begin ( ),
+              order.end ( ),
+              [&] ( uint32_t a, uint32_t b )
+              {
+                return begins[a] < begins[b];
+              } );
+
+  for ( uint32_t worker : order )
+  {
+    _visible.insert ( _visible.end ( ),
+                      _scratch.begin ( ) + begins[worker],
+                      _scratch.begin ( ) + begins[worker] + written[worker] );
+  }
+  return _visible;
+}
+
+const std::vector < uint32_t >& FrustumCuller::visible ( ) const
+{
+  return _visible;
+}
+
+void FrustumCuller::setForceScalar ( bool scalar )
+{
+  _forceScalar = scalar;
+}
+
+const char* FrustumCuller::simdPath ( )
+{
+  switch ( SIMD_LEVEL )
+  {
+    case SIMD_AVX2:
+      return "avx2";
+    case SIMD_SSE:
+      return "sse";
+    default:
+      return "scalar";
+  }
+}
@@ -0,0 +1,107 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKFRUSTUMCULLER_H
+#define VKFRUSTUMCULLER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+//Volumen con el que se prueba cada objeto
+enum CullVolume
+{
+  CULL_SPHERES,   //Centro y radio: 16 bytes por objeto
+  CULL_BOXES      //AABB (centro y semiejes): más ajustado, 24 bytes
+};
+
+//Culling de frustum en CPU sobre volúmenes en estructura de arrays. Prueba
+//ocho objetos a la vez con AVX2 (cuatro con SSE si no hay AVX2) y reparte
+//el trabajo por tramos entre los workers. El resultado es la lista compacta
+//de índices visibles, en orden creciente
+class FrustumCuller
+{
+  public:
+    void resize ( size_t count );
+
+    size_t size ( ) const;
+
+    //Se pueden rellenar desde varios hilos con índices distintos
+    void setSphere ( size_t index,
+                     float x,
+                     float y,
+                     float z,
+                     float radius );
+
+    void setBox ( size_t index, const float* min, const float* max );
+
+    //viewProj column-major (como glm) con profundidad en [0, 1]
+    void setFrustum ( const float* viewProj );
+
+    //Sin workers se hace todo en el hilo que llama
+    const std::vector < uint32_t >& cull ( CullVolume volume,
+                                           WorkerPool* workers = nullptr );
+
+    const std::vector < uint32_t >& visible ( ) const;
+
+    //Nivel SIMD elegido en ejecución
+    static const char* simdPath ( );
+
+    //Solo para medir: prueba con la versión escalar aunque haya SIMD
+    void setForceScalar ( bool scalar );
+
+  private:
+    //Prueba [begin, end) y escribe los visibles a partir de out. Devuelve
+    //cuántos ha escrito
+    size_t cullRange ( CullVolume volume,
+                       size_t begin,
+                       size_t end,
+                       uint32_t* out ) const;
+
+    //Esferas
+    std::vector < float > _centerX;
+    std::vector < float > _centerY;
+    std::vector < float > _centerZ;
+    std::vector < float > _radius;
+
+    //AABBs
+    std::vector < float > _boxX;
+    std::vector < float > _boxY;
+    std::vector < float > _boxZ;
+    std::vector < float > _extentX;
+    std::vector < float > _extentY;
+    std::vector < float > _extentZ;
+
+    //Planos (normal hacia dentro, normalizados) y sus normales en valor
+    //absoluto para el radio proyectado de las AABBs
+    float _planes[6][4] = {};
+    float _absPlanes[6][3] = {};
+
+    bool _forceScalar = false;
+
+    //Salida por tramos antes de compactar
+    std::vector < uint32_t > _scratch;
+    std::vector < uint32_t > _visible;
+};
+
+#endif //VKFRUSTUMCULLER_H
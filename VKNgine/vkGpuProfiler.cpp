@@ -0,0 +1,302 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkGpuProfiler.h"
+
+#include <stdexcept>
+
+//Los resultados se escriben en el orden de los bits
+static const VkQueryPipelineStatisticFlags STATISTICS_FLAGS =
+  VK_QUERY_PIPELINE_STATISTIC_VERTEX_SHADER_INVOCATIONS_BIT
+  | VK_QUERY_PIPELINE_STATISTIC_GEOMETRY_SHADER_INVOCATIONS_BIT
+  | VK_QUERY_PIPELINE_STATISTIC_CLIPPING_PRIMITIVES_BIT;
+
+void GpuProfiler::init ( VkPhysicalDevice physicalDevice,
+                         VkDevice device,
+                         uint32_t queueFamily,
+                         uint32_t frameCount,
+                         bool pipelineStatistics,
+                         uint32_t maxScopes )
+{
+  _device = device;
+  _maxScopes = maxScopes;
+  _statistics = pipelineStatistics;
+
+  uint32_t queueFamilyCount = 0;
+  vkGetPhysicalDeviceQueueFamilyProperties ( physicalDevice,
+                                             &queueFamilyCount,
+                                             nullptr );
+  std::vector < VkQueueFamilyProperties > queueFamilies ( queueFamilyCount );
+  vkGetPhysicalDeviceQueueFamilyProperties ( physicalDevice,
+                                             &queueFamilyCount,
+                                             queueFamilies.data ( ));
+
+  //Cola sin timestamps: el profiler queda desactivado
+  uint32_t validBits = queueFamilies[queueFamily].timestampValidBits;
+  if ( validBits == 0 )
+  {
+    return;
+  }
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties ( physicalDevice, &properties );
+  _timestampPeriod = properties.limits.timestampPeriod;
+  _timestampMask = validBits >= 64 ? ~0ull : ( 1ull << validBits ) - 1;
+
+  VkQueryPoolCreateInfo timestampInfo = {};
+  timestampInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  timestampInfo.queryType = VK_QUERY_TYPE_TIMESTAMP;
+  timestampInfo.queryCount = 2 * maxScopes;
+
+  VkQueryPoolCreateInfo statisticsInfo = {};
+  statisticsInfo.sType = VK_STRUCTURE_TYPE_QUERY_POOL_CREATE_INFO;
+  statisticsInfo.queryType = VK_QUERY_TYPE_PIPELINE_STATISTICS;
+  statisticsInfo.queryCount = maxScopes;
+  statisticsInfo.pipelineStatistics = STATISTICS_FLAGS;
+
+  _frames.resize ( frameCount );
+  for ( auto& frame : _frames )
+  {
+    if ( vkCreateQueryPool ( _device,
+                             &timestampInfo,
+                             nullptr,
+                             &frame._timestampPool ) != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to create timestamp query pool!" );
+    }
+
+    if ( _statistics
+      && vkCreateQueryPool ( _device,
+                             &statisticsInfo,
+                             nullptr,
+                             &frame._statisticsPool ) != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to create statistics query pool!" );
+    }
+  }
+}
+
+void GpuProfiler::destroy ( )
+{
+  for ( auto& frame : _frames )
+  {
+    vkDestroyQueryPool ( _device, frame._timestampPool, nullptr );
+    vkDestroyQueryPool ( _device, frame._statisticsPool, nullptr );
+  }
+  _frames.clear ( );
+  _recording = nullptr;
+
+  std::lock_guard < std::mutex > lock ( _resultsMutex );
+  _results.clear ( );
+}
+
+bool GpuProfiler::isEnabled ( ) const
+{
+  return !_frames.empty ( );
+}
+
+bool GpuProfiler::hasStatistics ( ) const
+{
+  return isEnabled ( ) && _statistics;
+}
+
+VkQueryPipelineStatisticFlags GpuProfiler::statisticsFlags ( ) const
+{
+  return hasStatistics ( ) ? STATISTICS_FLAGS : 0;
+}
+
+void GpuProfiler::beginFrame ( VkCommandBuffer commandBuffer,
+                               uint32_t frameIndex )
+{
+  if ( !isEnabled ( ))
+  {
+    return;
+  }
+
+  _recording = &_frames[frameIndex];
+  _recording->_scopes.clear ( );
+  _recording->_pending = true;
+  _openScopes = 0;
+  _statisticsActive = false;
+
+  vkCmdResetQueryPool ( commandBuffer,
+                        _recording->_timestampPool,
+                        0,
+                        2 * _maxScopes );
+  if ( _statistics )
+  {
+    vkCmdResetQueryPool ( commandBuffer,
+                          _recording->_statisticsPool,
+                          0,
+                          _maxScopes );
+  }
+}
+
+const std::vector < GpuScope >& GpuProfiler::frameScopes ( uint32_t frameIndex ) const
+{
+  static const std::vector < GpuScope > noScopes;
+  if ( !isEnabled ( ))
+  {
+    return noScopes;
+  }
+
+  return _frames[frameIndex]._scopes;
+}
+
+void GpuProfiler::resubmitFrame ( uint32_t frameIndex,
+                                  const std::vector < GpuScope >& scopes )
+{
+  if ( !isEnabled ( ))
+  {
+    return;
+  }
+
+  _recording = nullptr;
+  _frames[frameIndex]._scopes = scopes;
+  _frames[frameIndex]._pending = true;
+}
+
+uint32_t GpuProfiler::beginScope ( VkCommandBuffer commandBuffer,
+                                   const char* name,
+                                   bool statistics,
+                                   VkPipelineStageFlagBits stage )
+{
+  if ( !_recording || _recording->_scopes.size ( ) >= _maxScopes )
+  {
+    return NO_SCOPE;
+  }
+
+  uint32_t index = static_cast<uint32_t>(_recording->_scopes.size ( ));
+
+  GpuScope scope;
+  scope._name = name;
+  scope._depth = _openScopes++;
+  scope._statistics = statistics && _statistics && !_statisticsActive;
+  _recording->_scopes.push_back ( scope );
+
+  vkCmdWriteTimestamp ( commandBuffer,
+                        stage,
+                        _recording->_timestampPool,
+                        2 * index );
+
+  if ( scope._statistics )
+  {
+    _statisticsActive = true;
+    vkCmdBeginQuery ( commandBuffer, _recording->_statisticsPool, index, 0 );
+  }
+
+  return index;
+}
+
+void GpuProfiler::endScope ( VkCommandBuffer commandBuffer,
+                             uint32_t scope,
+                             VkPipelineStageFlagBits stage )
+{
+  if ( !_recording || scope == NO_SCOPE )
+  {
+    return;
+  }
+
+  if ( _recording->_scopes[scope]._statistics )
+  {
+    vkCmdEndQuery ( commandBuffer, _recording->_statisticsPool, scope );
+    _statisticsActive = false;
+  }
+
+  vkCmdWriteTimestamp ( commandBuffer,
+                        stage,
+                        _recording->_timestampPool,
+                        2 * scope + 1 );
+  _openScopes--;
+}
+
+bool GpuProfiler::collect ( uint32_t frameIndex )
+{
+  if ( !isEnabled ( ) || !_frames[frameIndex]._pending )
+  {
+    return false;
+  }
+
+  FrameQueries& frame = _frames[frameIndex];
+  frame._pending = false;
+
+  uint32_t count = static_cast<uint32_t>(frame._scopes.size ( ));
+  if ( count == 0 )
+  {
+    return false;
+  }
+
+  //Sin WAIT_BIT: el llamante ya ha esperado el envío del frame
+  std::vector < uint64_t > timestamps ( 2 * count );
+  if ( vkGetQueryPoolResults ( _device,
+                               frame._timestampPool,
+                               0,
+                               2 * count,
+                               timestamps.size ( ) * sizeof ( uint64_t ),
+                               timestamps.data ( ),
+                               sizeof ( uint64_t ),
+                               VK_QUERY_RESULT_64_BIT ) != VK_SUCCESS )
+  {
+    return false;
+  }
+
+  std::vector < GpuScopeResult > results ( count );
+  for ( uint32_t i = 0; i < count; i++ )
+  {
+    const GpuScope& scope = frame._scopes[i];
+    GpuScopeResult& result = results[i];
+    result._name = scope._name;
+    result._depth = scope._depth;
+
+    uint64_t ticks = ( timestamps[2 * i + 1] - timestamps[2 * i] )
+      & _timestampMask;
+    result._timeMs = ticks * _timestampPeriod * 1e-6;
+
+    //Solo se consultan las que se iniciaron: las demás nunca estarían
+    //disponibles
+    uint64_t statistics[3];
+    if ( scope._statistics
+      && vkGetQueryPoolResults ( _device,
+                                 frame._statisticsPool,
+                                 i,
+                                 1,
+                                 sizeof ( statistics ),
+                                 statistics,
+                                 sizeof ( statistics ),
+                                 VK_QUERY_RESULT_64_BIT ) == VK_SUCCESS )
+    {
+      result._hasStatistics = true;
+      result._vertexInvocations = statistics[0];
+      result._geometryInvocations = statistics[1];
+      result._clippingPrimitives = statistics[2];
+    }
+  }
+
+  std::lock_guard < std::mutex > lock ( _resultsMutex );
+  _results.swap ( results );
+  return true;
+}
+
+std::vector < GpuScopeResult > GpuProfiler::results ( ) const
+{
+  std::lock_guard < std::mutex > lock ( _resultsMutex );
+  return _results;
+}
@@ -0,0 +1,143 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKGPUPROFILER_H
+#define VKGPUPROFILER_H
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+//Resultado de un scope con nombre. Los tiempos en milisegundos
+struct GpuScopeResult
+{
+  std::string _name;
+  //Anidamiento (0: scope raíz)
+  uint32_t _depth = 0;
+  double _timeMs = 0.0;
+
+  //Solo si hay estadísticas de pipeline y el scope las pudo recoger
+  bool _hasStatistics = false;
+  uint64_t _vertexInvocations = 0;
+  uint64_t _geometryInvocations = 0;
+  uint64_t _clippingPrimitives = 0;
+};
+
+//Scope tal y como se grabó (consultas 2*i y 2*i+1 del hueco)
+struct GpuScope
+{
+  std::string _name;
+  uint32_t _depth = 0;
+  bool _statistics = false;
+};
+
+//Profiler GPU con query pools: un juego de consultas por frame en vuelo.
+//Los resultados se leen al reutilizar el hueco, cuando la GPU ya ha
+//terminado, así que llegan con unos frames de retraso y nunca bloquean
+class GpuProfiler
+{
+  public:
+    static const uint32_t NO_SCOPE = 0xFFFFFFFF;
+
+    //pipelineStatistics requiere la feature pipelineStatisticsQuery
+    void init ( VkPhysicalDevice physicalDevice,
+                VkDevice device,
+                uint32_t queueFamily,
+                uint32_t frameCount,
+                bool pipelineStatistics,
+                uint32_t maxScopes = 64 );
+
+    void destroy ( );
+
+    //false si la cola no admite timestamps
+    bool isEnabled ( ) const;
+
+    bool hasStatistics ( ) const;
+
+    //Para heredar las consultas en command buffers secundarios (0 si no
+    //hay estadísticas)
+    VkQueryPipelineStatisticFlags statisticsFlags ( ) const;
+
+    //Al principio del primer command buffer del frame (fuera de un render
+    //pass): reinicia las consultas del hueco
+    void beginFrame ( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+
+    //Scopes de la última grabación del hueco. Se guardan con el command
+    //buffer si se va a reenviar: el hueco se puede volver a grabar con
+    //otro command buffer (otra imagen de la swapchain) entre medias
+    const std::vector < GpuScope >& frameScopes ( uint32_t frameIndex ) const;
+
+    //Se reenvía sin regrabar un command buffer del hueco: sus consultas
+    //son las de su grabación y sus scopes los que se guardaron con él
+    void resubmitFrame ( uint32_t frameIndex,
+                         const std::vector < GpuScope >& scopes );
+
+    //Los scopes se pueden anidar y repartir entre command buffers del
+    //mismo frame. Las estadísticas solo se recogen si se piden y no hay
+    //otro scope con estadísticas abierto; un scope abierto dentro de un
+    //render pass se debe cerrar en el mismo subpass. Devuelve NO_SCOPE si
+    //no quedan consultas libres
+    uint32_t beginScope ( VkCommandBuffer commandBuffer,
+                          const char *name,
+                          bool statistics = false,
+                          VkPipelineStageFlagBits stage =
+                            VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT );
+
+    void endScope ( VkCommandBuffer commandBuffer,
+                    uint32_t scope,
+                    VkPipelineStageFlagBits stage =
+                      VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT );
+
+    //Después de esperar el último envío del hueco. true si hay resultados
+    //nuevos
+    bool collect ( uint32_t frameIndex );
+
+    //Último frame completo (copia; cualquier hilo)
+    std::vector < GpuScopeResult > results ( ) const;
+
+  private:
+    struct FrameQueries
+    {
+      VkQueryPool _timestampPool = VK_NULL_HANDLE;
+      VkQueryPool _statisticsPool = VK_NULL_HANDLE;
+      std::vector < GpuScope > _scopes;
+      bool _pending = false;
+    };
+
+    VkDevice _device = VK_NULL_HANDLE;
+    uint32_t _maxScopes = 0;
+    double _timestampPeriod = 0.0;
+    uint64_t _timestampMask = 0;
+    bool _statistics = false;
+
+    std::vector < FrameQueries > _frames;
+    //Frame que se está grabando
+    FrameQueries *_recording = nullptr;
+    uint32_t _openScopes = 0;
+    bool _statisticsActive = false;
+
+    std::vector < GpuScopeResult > _results;
+    mutable std::mutex _resultsMutex;
+};
+
+#endif //VKGPUPROFILER_H
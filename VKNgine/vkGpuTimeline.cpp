@@ -0,0 +1,210 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkGpuTimeline.h"
+
+#include <limits>
+#include <stdexcept>
+
+void GpuSubmission::waitBinary ( VkSemaphore semaphore,
+                                 VkPipelineStageFlags stage )
+{
+  _waitSemaphores.push_back ( semaphore );
+  _waitValues.push_back ( 0 );
+  _waitStages.push_back ( stage );
+}
+
+void GpuSubmission::waitTicket ( const GpuTimeline& timeline,
+                                 GpuTicket ticket,
+                                 VkPipelineStageFlags stage )
+{
+  _waitSemaphores.push_back ( timeline.semaphore ( ));
+  _waitValues.push_back ( ticket );
+  _waitStages.push_back ( stage );
+}
+
+void GpuTimeline::init ( VkDevice device, VkQueue queue )
+{
+  _device = device;
+  _queue = queue;
+
+  VkSemaphoreTypeCreateInfo typeInfo = {};
+  typeInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_TYPE_CREATE_INFO;
+  typeInfo.semaphoreType = VK_SEMAPHORE_TYPE_TIMELINE;
+  typeInfo.initialValue = 0;
+
+  VkSemaphoreCreateInfo semaphoreInfo = {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+  semaphoreInfo.pNext = &typeInfo;
+
+  if ( vkCreateSemaphore ( _device, &semaphoreInfo, nullptr, &_semaphore )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create timeline semaphore!" );
+  }
+
+  _lastSubmitted = 0;
+  _completed = 0;
+}
+
+void GpuTimeline::destroy ( )
+{
+  if ( _semaphore == VK_NULL_HANDLE )
+    return;
+
+  waitIdle ( );
+  collectGarbage ( );
+
+  vkDestroySemaphore ( _device, _semaphore, nullptr );
+  _semaphore = VK_NULL_HANDLE;
+}
+
+GpuTicket GpuTimeline::submit ( const GpuSubmission& submission )
+{
+  std::lock_guard < std::mutex > lock ( _queueMutex );
+
+  GpuTicket ticket = _lastSubmitted + 1;
+
+  //Los binarios ignoran su valor, pero el array tiene que cubrirlos
+  std::vector < VkSemaphore > signalSemaphores ( submission._signalSemaphores );
+  signalSemaphores.push_back ( _semaphore );
+  std::vector < uint64_t > signalValues ( signalSemaphores.size ( ), 0 );
+  signalValues.back ( ) = ticket;
+
+  VkTimelineSemaphoreSubmitInfo timelineInfo = {};
+  timelineInfo.sType = VK_STRUCTURE_TYPE_TIMELINE_SEMAPHORE_SUBMIT_INFO;
+  timelineInfo.waitSemaphoreValueCount =
+    static_cast<uint32_t>(submission._waitValues.size ( ));
+  timelineInfo.pWaitSemaphoreValues = submission._waitValues.data ( );
+  timelineInfo.signalSemaphoreValueCount =
+    static_cast<uint32_t>(signalValues.size ( ));
+  timelineInfo.pSignalSemaphoreValues = signalValues.data ( );
+
+  VkSubmitInfo submitInfo = {};
+  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+  submitInfo.pNext = &timelineInfo;
+  submitInfo.waitSemaphoreCount =
+    static_cast<uint32_t>(submission._waitSemaphores.size ( ));
+  submitInfo.pWaitSemaphores = submission._waitSemaphores.data ( );
+  submitInfo.pWaitDstStageMask = submission._waitStages.data ( );
+  submitInfo.commandBufferCount =
+    static_cast<uint32_t>(submission._commandBuffers.size ( ));
+  submitInfo.pCommandBuffers = submission._commandBuffers.data ( );
+  submitInfo.signalSemaphoreCount =
+    static_cast<uint32_t>(signalSemaphores.size ( ));
+  submitInfo.pSignalSemaphores = signalSemaphores.data ( );
+
+  if ( vkQueueSubmit ( _queue, 1, &submitInfo, VK_NULL_HANDLE ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to submit to queue!" );
+  }
+
+  _lastSubmitted = ticket;
+  return ticket;
+}
+
+bool GpuTimeline::isComplete ( GpuTicket ticket )
+{
+  if ( ticket <= _completed )
+    return true;
+
+  uint64_t value = 0;
+  vkGetSemaphoreCounterValue ( _device, _semaphore, &value );
+  advanceCompleted ( value );
+
+  return ticket <= value;
+}
+
+void GpuTimeline::wait ( GpuTicket ticket )
+{
+  if ( isComplete ( ticket ))
+    return;
+
+  VkSemaphoreWaitInfo waitInfo = {};
+  waitInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_WAIT_INFO;
+  waitInfo.semaphoreCount = 1;
+  waitInfo.pSemaphores = &_semaphore;
+  waitInfo.pValues = &ticket;
+
+  if ( vkWaitSemaphores ( _device,
+                          &waitInfo,
+                          std::numeric_limits < uint64_t >::max ( ))
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to wait for gpu ticket!" );
+  }
+
+  advanceCompleted ( ticket );
+}
+
+//Puede haber avanzado más, pero basta con no retroceder
+void GpuTimeline::advanceCompleted ( uint64_t value )
+{
+  uint64_t completed = _completed;
+  while ( completed < value
+    && !_completed.compare_exchange_weak ( completed, value ))
+  {
+  }
+}
+
+void GpuTimeline::waitIdle ( )
+{
+  wait ( _lastSubmitted );
+}
+
+GpuTicket GpuTimeline::lastSubmitted ( ) const
+{
+  return _lastSubmitted;
+}
+
+//El recurso se destruye cuando la GPU completa el ticket dado
+void GpuTimeline::deferDestroy ( GpuTicket ticket,
+                                 std::function < void ( ) > destroyFn )
+{
+  std::lock_guard < std::mutex > lock ( _garbageMutex );
+  _garbage.emplace_back ( ticket, std::move ( destroyFn ));
+}
+
+void GpuTimeline::collectGarbage ( )
+{
+  std::lock_guard < std::mutex > lock ( _garbageMutex );
+
+  while ( !_garbage.empty ( ) && isComplete ( _garbage.front ( ).first ))
+  {
+    _garbage.front ( ).second ( );
+    _garbage.pop_front ( );
+  }
+}
+
+VkSemaphore GpuTimeline::semaphore ( ) const
+{
+  return _semaphore;
+}
+
+VkQueue GpuTimeline::queue ( ) const
+{
+  return _queue;
+}
+
+std::mutex& GpuTimeline::queueMutex ( )
+{
+  return _queueMutex;
+}
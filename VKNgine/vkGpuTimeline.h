@@ -0,0 +1,107 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKGPUTIMELINE_H
+#define VKGPUTIMELINE_H
+
+#include <atomic>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+//Ticket de trabajo GPU: valor del timeline semaphore que se señaliza al
+//terminar un envío. Crece de forma monótona en cada cola.
+typedef uint64_t GpuTicket;
+
+class GpuTimeline;
+
+//Descripción de un envío: command buffers y esperas/señales adicionales.
+//El timeline añade siempre su propio semáforo a las señales.
+struct GpuSubmission
+{
+  std::vector < VkCommandBuffer > _commandBuffers;
+
+  std::vector < VkSemaphore > _waitSemaphores;
+  std::vector < uint64_t > _waitValues;
+  std::vector < VkPipelineStageFlags > _waitStages;
+
+  //Semáforos binarios (p.ej. para la presentación)
+  std::vector < VkSemaphore > _signalSemaphores;
+
+  void waitBinary ( VkSemaphore semaphore, VkPipelineStageFlags stage );
+
+  void waitTicket ( const GpuTimeline &timeline,
+                    GpuTicket ticket,
+                    VkPipelineStageFlags stage );
+};
+
+//Timeline de una cola (VK_KHR_timeline_semaphore, core en 1.2). Todos los
+//envíos a la cola pasan por aquí, devuelven un ticket y la CPU puede
+//esperar o consultar cualquier ticket. También gestiona la destrucción
+//diferida de recursos hasta que la GPU deja de usarlos.
+class GpuTimeline
+{
+  public:
+    void init ( VkDevice device, VkQueue queue );
+
+    void destroy ( );
+
+    GpuTicket submit ( const GpuSubmission &submission );
+
+    bool isComplete ( GpuTicket ticket );
+
+    void wait ( GpuTicket ticket );
+
+    void waitIdle ( );
+
+    GpuTicket lastSubmitted ( ) const;
+
+    void deferDestroy ( GpuTicket ticket, std::function < void ( ) > destroyFn );
+
+    void collectGarbage ( );
+
+    VkSemaphore semaphore ( ) const;
+
+    VkQueue queue ( ) const;
+
+    //Acceso externo a la cola (p.ej. vkQueuePresentKHR sobre la misma cola)
+    std::mutex &queueMutex ( );
+
+  private:
+    //_completed solo avanza, aunque lo actualicen varios hilos
+    void advanceCompleted ( uint64_t value );
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VkQueue _queue = VK_NULL_HANDLE;
+    VkSemaphore _semaphore = VK_NULL_HANDLE;
+
+    std::mutex _queueMutex;
+    std::atomic < uint64_t > _lastSubmitted { 0 };
+    std::atomic < uint64_t > _completed { 0 };
+
+    std::mutex _garbageMutex;
+    std::deque < std::pair < GpuTicket, std::function < void ( ) > > > _garbage;
+};
+
+#endif //VKGPUTIMELINE_H
@@ -0,0 +1,77 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKHASH_H
+#define VKHASH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+//Hashes internos de 64 bits para huellas y tablas. No son estables entre
+//versiones: no guardar en disco (salvo hashFnv1a)
+
+//Mezcla de 64 bits
+static inline uint64_t hashCombine ( uint64_t hash, uint64_t value )
+{
+  hash ^= value;
+  hash *= 0xff51afd7ed558ccdull;
+  return hash ^ ( hash >> 33 );
+}
+
+static inline uint64_t hashBytes ( uint64_t hash, const void* data, size_t size )
+{
+  const char* bytes = static_cast<const char*>(data);
+  for ( ; size >= sizeof ( uint64_t ); size -= sizeof ( uint64_t ))
+  {
+    uint64_t word;
+    std::memcpy ( &word, bytes, sizeof ( word ));
+    hash = hashCombine ( hash, word );
+    bytes += sizeof ( word );
+  }
+
+  uint64_t tail = 0;
+  std::memcpy ( &tail, bytes, size );
+  return hashCombine ( hash, tail );
+}
+
+//FNV-1a de 64 bits byte a byte. Estable: sirve para comparar contenidos
+//entre ejecuciones (SPIR-V, pipeline cache en disco)
+static inline uint64_t hashFnv1a ( const void* data, size_t size )
+{
+  const unsigned char* bytes = static_cast<const unsigned char*>(data);
+  uint64_t hash = 14695981039346656037ull;
+  for ( size_t i = 0; i < size; i++ )
+  {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
+
+//Los handles no dispatchables son punteros o enteros según la plataforma
+template < typename Handle >
+static inline uint64_t hashHandle ( uint64_t hash, Handle handle )
+{
+  return hashBytes ( hash, &handle, sizeof ( handle ));
+}
+
+#endif //VKHASH_H
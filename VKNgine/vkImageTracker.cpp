@@ -0,0 +1,459 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkImageTracker.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+static const VkAccessFlags WRITE_ACCESS_MASK =
+  VK_ACCESS_SHADER_WRITE_BIT
+  | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+  | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT
+  | VK_ACCESS_TRANSFER_WRITE_BIT
+  | VK_ACCESS_HOST_WRITE_BIT
+  | VK_ACCESS_MEMORY_WRITE_BIT;
+
+static bool sameUsage ( const ImageUsage& a, const ImageUsage& b )
+{
+  return a._layout == b._layout
+    && a._stage == b._stage
+    && a._access == b._access;
+}
+
+void ImageTracker::registerImage ( VkImage image,
+                                   VkImageAspectFlags aspectMask,
+                                   uint32_t mipLevels,
+                                   uint32_t arrayLayers,
+                                   VkImageLayout initialLayout )
+{
+  TrackedImage& entry = _images[image];
+  entry._aspectMask = aspectMask;
+  entry._mipLevels = mipLevels;
+  entry._arrayLayers = arrayLayers;
+
+  ImageUsage initial;
+  initial._layout = initialLayout;
+  entry._state.assign ( mipLevels * arrayLayers, initial );
+  entry._lastWrite.assign ( mipLevels * arrayLayers, LastWrite ( ));
+  entry._pendingIndex.assign ( mipLevels * arrayLayers, -1 );
+}
+
+void ImageTracker::forgetImage ( VkImage image )
+{
+  _pending.erase ( std::remove_if ( _pending.begin ( ),
+                                    _pending.end ( ),
+                                    [ image ] ( const PendingTransition& p )
+                                    {
+                                      return p._image == image;
+                                    } ),
+                   _pending.end ( ));
+
+  _images.erase ( image );
+
+  //Los índices de las demás imágenes han podido moverse
+  for ( auto& entry : _images )
+  {
+    std::fill ( entry.second._pendingIndex.begin ( ),
+                entry.second._pendingIndex.end ( ),
+                -1 );
+  }
+  for ( size_t i = 0; i < _pending.size ( ); i++ )
+  {
+    TrackedImage& entry = _images[_pending[i]._image];
+    entry._pendingIndex[_pending[i]._mipLevel * entry._arrayLayers
+      + _pending[i]._arrayLayer] = static_cast<int>(i);
+  }
+}
+
+bool ImageTracker::isTracked ( VkImage image ) const
+{
+  return _images.count ( image ) != 0;
+}
+
+VkImageAspectFlags ImageTracker::aspectMask ( VkImage image ) const
+{
+  auto it = _images.find ( image );
+  if ( it == _images.end ( ))
+  {
+    throw std::runtime_error ( "image not registered in tracker!" );
+  }
+
+  return it->second._aspectMask;
+}
+
+ImageUsage ImageTracker::defaultUsage ( VkImageLayout layout )
+{
+  ImageUsage usage;
+  usage._layout = layout;
+
+  switch ( layout )
+  {
+    case VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL:
+      usage._stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+      usage._access = VK_ACCESS_TRANSFER_WRITE_BIT;
+      break;
+    case VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL:
+      usage._stage = VK_PIPELINE_STAGE_TRANSFER_BIT;
+      usage._access = VK_ACCESS_TRANSFER_READ_BIT;
+      break;
+    case VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL:
+      usage._stage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      usage._access = VK_ACCESS_SHADER_READ_BIT;
+      break;
+    case VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL:
+      usage._stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+      usage._access = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
+        | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+      break;
+    case VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL:
+      usage._stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+        | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT;
+      usage._access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+        | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
+      break;
+    case VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL:
+      usage._stage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT
+        | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
+      usage._access = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
+        | VK_ACCESS_SHADER_READ_BIT;
+      break;
+    case VK_IMAGE_LAYOUT_PRESENT_SRC_KHR:
+      //La presentación se sincroniza con semáforos
+      usage._stage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+      usage._access = 0;
+      break;
+    case VK_IMAGE_LAYOUT_GENERAL:
+      usage._stage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+      usage._access = VK_ACCESS_MEMORY_READ_BIT | VK_ACCESS_MEMORY_WRITE_BIT;
+      break;
+    default:
+      usage._stage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+      usage._access = 0;
+      break;
+  }
+
+  return usage;
+}
+
+void ImageTracker::require ( VkImage image,
+                             VkImageLayout layout,
+                             uint32_t baseMipLevel,
+                             uint32_t levelCount,
+                             uint32_t baseArrayLayer,
+                             uint32_t layerCount )
+{
+  require ( image,
+            defaultUsage ( layout ),
+            baseMipLevel,
+            levelCount,
+            baseArrayLayer,
+            layerCount );
+}
+
+void ImageTracker::require ( VkImage image,
+                             const ImageUsage& usage,
+                             uint32_t baseMipLevel,
+                             uint32_t levelCount,
+                             uint32_t baseArrayLayer,
+                             uint32_t layerCount )
+{
+  TrackedImage& entry = tracked ( image );
+
+  uint32_t mipEnd = levelCount == VK_REMAINING_MIP_LEVELS
+    ? entry._mipLevels : baseMipLevel + levelCount;
+  uint32_t layerEnd = layerCount == VK_REMAINING_ARRAY_LAYERS
+    ? entry._arrayLayers : baseArrayLayer + layerCount;
+
+  for ( uint32_t mip = baseMipLevel; mip < mipEnd; mip++ )
+  {
+    for ( uint32_t layer = baseArrayLayer; layer < layerEnd; layer++ )
+    {
+      uint32_t index = mip * entry._arrayLayers + layer;
+      ImageUsage& current = entry._state[index];
+      LastWrite& lastWrite = entry._lastWrite[index];
+
+      //Ya hay una transición pendiente (ningún comando entre medias): se
+      //amplía su destino y gana el último layout pedido
+      int pendingIndex = entry._pendingIndex[index];
+      if ( pendingIndex >= 0 )
+      {
+        ImageUsage& after = _pending[pendingIndex]._after;
+        after._layout = usage._layout;
+        after._stage |= usage._stage;
+        after._access |= usage._access;
+        current = after;
+        if ( usage._access & WRITE_ACCESS_MASK )
+        {
+          lastWrite._stage = after._stage;
+          lastWrite._access = after._access & WRITE_ACCESS_MASK;
+        }
+        continue;
+      }
+
+      PendingTransition transition;
+      transition._image = image;
+      transition._mipLevel = mip;
+      transition._arrayLayer = layer;
+
+      if ( current._layout == usage._layout
+        && !( current._access & WRITE_ACCESS_MASK )
+        && !( usage._access & WRITE_ACCESS_MASK ))
+      {
+        //Lectura tras lectura en el mismo layout: sobra la barrera si una
+        //anterior ya hizo visible la última escritura a esta etapa y acceso
+        if (( usage._stage & ~current._stage ) == 0
+          && ( usage._access & ~current._access ) == 0 )
+        {
+          continue;
+        }
+
+        //Sin escritura previa no hay nada que esperar
+        if ( lastWrite._stage == 0 )
+        {
+          current._stage |= usage._stage;
+          current._access |= usage._access;
+          continue;
+        }
+
+        //Nuevo lector: se sincroniza con la última escritura, no con los
+        //lectores acumulados
+        transition._before._layout = current._layout;
+        transition._before._stage = lastWrite._stage;
+        transition._before._access = lastWrite._access;
+        transition._after = current;
+        transition._after._stage |= usage._stage;
+        transition._after._access |= usage._access;
+      }
+      else
+      {
+        transition._before = current;
+        transition._after = usage;
+
+        //Escritura o transición de layout: los siguientes lectores se
+        //sincronizan con ella
+        if ( usage._access & WRITE_ACCESS_MASK
+          || current._layout != usage._layout )
+        {
+          lastWrite._stage = usage._stage;
+          lastWrite._access = usage._access & WRITE_ACCESS_MASK;
+        }
+      }
+
+      entry._pendingIndex[index] = static_cast<int>(_pending.size ( ));
+      _pending.push_back ( transition );
+      current = transition._after;
+    }
+  }
+}
+
+void ImageTracker::assume ( VkImage image,
+                            const ImageUsage& usage,
+                            uint32_t baseMipLevel,
+                            uint32_t levelCount,
+                            uint32_t baseArrayLayer,
+                            uint32_t layerCount )
+{
+  TrackedImage& entry = tracked ( image );
+
+  uint32_t mipEnd = levelCount == VK_REMAINING_MIP_LEVELS
+    ? entry._mipLevels : baseMipLevel + levelCount;
+  uint32_t layerEnd = layerCount == VK_REMAINING_ARRAY_LAYERS
+    ? entry._arrayLayers : baseArrayLayer + layerCount;
+
+  for ( uint32_t mip = baseMipLevel; mip < mipEnd; mip++ )
+  {
+    for ( uint32_t layer = baseArrayLayer; layer < layerEnd; layer++ )
+    {
+      uint32_t index = mip * entry._arrayLayers + layer;
+      entry._state[index] = usage;
+      entry._lastWrite[index]._stage = usage._stage;
+      entry._lastWrite[index]._access = usage._access & WRITE_ACCESS_MASK;
+    }
+  }
+}
+
+void ImageTracker::requireMemory ( VkPipelineStageFlags srcStage,
+                                  VkAccessFlags srcAccess,
+                                  VkPipelineStageFlags dstStage,
+                                  VkAccessFlags dstAccess )
+{
+  _memorySrcStage |= srcStage;
+  _memorySrcAccess |= srcAccess;
+  _memoryDstStage |= dstStage;
+  _memoryDstAccess |= dstAccess;
+}
+
+ImageUsage ImageTracker::usage ( VkImage image,
+                                 uint32_t mipLevel,
+                                 uint32_t arrayLayer ) const
+{
+  auto it = _images.find ( image );
+  if ( it == _images.end ( ))
+  {
+    throw std::runtime_error ( "image not registered in tracker!" );
+  }
+
+  return it->second._state[mipLevel * it->second._arrayLayers + arrayLayer];
+}
+
+bool ImageTracker::hasPendingBarriers ( ) const
+{
+  return !_pending.empty ( ) || _memoryDstStage != 0;
+}
+
+//Emite todas las transiciones pendientes en una sola llamada, agrupando
+//capas y mips contiguos con la misma transición en una única barrera
+void ImageTracker::flush ( VkCommandBuffer commandBuffer )
+{
+  if ( !hasPendingBarriers ( ))
+    return;
+
+  std::sort ( _pending.begin ( ),
+              _pending.end ( ),
+              [ ] ( const PendingTransition& a, const PendingTransition& b )
+              {
+                if ( a._image != b._image )
+                  return a._image < b._image;
+                if ( a._mipLevel != b._mipLevel )
+                  return a._mipLevel < b._mipLevel;
+                return a._arrayLayer < b._arrayLayer;
+              } );
+
+  std::vector < VkImageMemoryBarrier > barriers;
+  std::vector < const PendingTransition* > barrierTransitions;
+  VkPipelineStageFlags srcStage = _memorySrcStage;
+  VkPipelineStageFlags dstStage = _memoryDstStage;
+
+  for ( const PendingTransition& p : _pending )
+  {
+    //Solo hace falta hacer visibles las escrituras previas
+    VkAccessFlags srcAccess = p._before._access & WRITE_ACCESS_MASK;
+    srcStage |= p._before._stage;
+    dstStage |= p._after._stage;
+
+    if ( !barriers.empty ( ))
+    {
+      VkImageMemoryBarrier& last = barriers.back ( );
+      const PendingTransition& lastTransition = *barrierTransitions.back ( );
+      if ( last.image == p._image
+        && sameUsage ( lastTransition._before, p._before )
+        && sameUsage ( lastTransition._after, p._after )
+        && last.subresourceRange.baseMipLevel == p._mipLevel
+        && last.subresourceRange.levelCount == 1
+        && last.subresourceRange.baseArrayLayer
+          + last.subresourceRange.layerCount == p._arrayLayer )
+      {
+        last.subresourceRange.layerCount++;
+        continue;
+      }
+    }
+
+    VkImageMemoryBarrier barrier = {};
+    barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+    barrier.oldLayout = p._before._layout;
+    barrier.newLayout = p._after._layout;
+    barrier.srcAccessMask = srcAccess;
+    barrier.dstAccessMask = p._after._access;
+    barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+    barrier.image = p._image;
+    barrier.subresourceRange.aspectMask = _images[p._image]._aspectMask;
+    barrier.subresourceRange.baseMipLevel = p._mipLevel;
+    barrier.subresourceRange.levelCount = 1;
+    barrier.subresourceRange.baseArrayLayer = p._arrayLayer;
+    barrier.subresourceRange.layerCount = 1;
+
+    barriers.push_back ( barrier );
+    barrierTransitions.push_back ( &p );
+  }
+
+  //Mips consecutivos con el mismo rango de capas
+  std::vector < VkImageMemoryBarrier > merged;
+  std::vector < const PendingTransition* > mergedTransitions;
+  for ( size_t i = 0; i < barriers.size ( ); i++ )
+  {
+    if ( !merged.empty ( ))
+    {
+      VkImageMemoryBarrier& last = merged.back ( );
+      const VkImageSubresourceRange& range = barriers[i].subresourceRange;
+      if ( last.image == barriers[i].image
+        && sameUsage ( mergedTransitions.back ( )->_before,
+                       barrierTransitions[i]->_before )
+        && sameUsage ( mergedTransitions.back ( )->_after,
+                       barrierTransitions[i]->_after )
+        && last.subresourceRange.baseArrayLayer == range.baseArrayLayer
+        && last.subresourceRange.layerCount == range.layerCount
+        && last.subresourceRange.baseMipLevel
+          + last.subresourceRange.levelCount == range.baseMipLevel )
+      {
+        last.subresourceRange.levelCount += range.levelCount;
+        continue;
+      }
+    }
+
+    merged.push_back ( barriers[i] );
+    mergedTransitions.push_back ( barrierTransitions[i] );
+  }
+
+  if ( srcStage == 0 )
+    srcStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+  if ( dstStage == 0 )
+    dstStage = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+
+  VkMemoryBarrier memoryBarrier = {};
+  memoryBarrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  memoryBarrier.srcAccessMask = _memorySrcAccess;
+  memoryBarrier.dstAccessMask = _memoryDstAccess;
+  uint32_t memoryBarrierCount = _memoryDstStage != 0 ? 1 : 0;
+
+  vkCmdPipelineBarrier ( commandBuffer,
+                         srcStage,
+                         dstStage,
+                         0,
+                         memoryBarrierCount, &memoryBarrier,
+                         0, nullptr,
+                         static_cast<uint32_t>(merged.size ( )),
+                         merged.data ( ));
+
+  for ( auto& entry : _images )
+  {
+    std::fill ( entry.second._pendingIndex.begin ( ),
+                entry.second._pendingIndex.end ( ),
+                -1 );
+  }
+  _pending.clear ( );
+  _memorySrcStage = 0;
+  _memoryDstStage = 0;
+  _memorySrcAccess = 0;
+  _memoryDstAccess = 0;
+}
+
+ImageTracker::TrackedImage& ImageTracker::tracked ( VkImage image )
+{
+  auto it = _images.find ( image );
+  if ( it == _images.end ( ))
+  {
+    throw std::runtime_error ( "image not registered in tracker!" );
+  }
+
+  return it->second;
+}
@@ -0,0 +1,166 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKIMAGETRACKER_H
+#define VKIMAGETRACKER_H
+
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+//Último uso conocido de un subrecurso (mip, capa) de una imagen
+struct ImageUsage
+{
+  VkImageLayout _layout = VK_IMAGE_LAYOUT_UNDEFINED;
+  VkPipelineStageFlags _stage = 0;
+  VkAccessFlags _access = 0;
+};
+
+//Aspectos de la imagen a partir de su formato
+inline VkImageAspectFlags aspectFlagsForFormat ( VkFormat format )
+{
+  switch ( format )
+  {
+    case VK_FORMAT_D16_UNORM:
+    case VK_FORMAT_X8_D24_UNORM_PACK32:
+    case VK_FORMAT_D32_SFLOAT:
+      return VK_IMAGE_ASPECT_DEPTH_BIT;
+    case VK_FORMAT_S8_UINT:
+      return VK_IMAGE_ASPECT_STENCIL_BIT;
+    case VK_FORMAT_D16_UNORM_S8_UINT:
+    case VK_FORMAT_D24_UNORM_S8_UINT:
+    case VK_FORMAT_D32_SFLOAT_S8_UINT:
+      return VK_IMAGE_ASPECT_DEPTH_BIT | VK_IMAGE_ASPECT_STENCIL_BIT;
+    default:
+      return VK_IMAGE_ASPECT_COLOR_BIT;
+  }
+}
+
+//Seguimiento del estado (layout, etapa, acceso) de cada subrecurso de las
+//imágenes registradas. Los usos pedidos con require (y las dependencias
+//de memoria de requireMemory) se acumulan y flush los emite en un único
+//vkCmdPipelineBarrier, omitiendo los redundantes (lectura tras lectura en
+//el mismo layout cuya etapa y acceso ya cubrió una barrera anterior). Se
+//llama a flush justo antes del comando que consume
+//las transiciones, no después de cada require.
+//El estado se registra en orden de grabación: se asume que los command
+//buffers se ejecutan en ese mismo orden.
+class ImageTracker
+{
+  public:
+    void registerImage ( VkImage image,
+                         VkImageAspectFlags aspectMask,
+                         uint32_t mipLevels,
+                         uint32_t arrayLayers,
+                         VkImageLayout initialLayout =
+                           VK_IMAGE_LAYOUT_UNDEFINED );
+
+    void forgetImage ( VkImage image );
+
+    bool isTracked ( VkImage image ) const;
+
+    VkImageAspectFlags aspectMask ( VkImage image ) const;
+
+    //Etapa y acceso mínimos para el uso habitual de cada layout
+    static ImageUsage defaultUsage ( VkImageLayout layout );
+
+    void require ( VkImage image,
+                   VkImageLayout layout,
+                   uint32_t baseMipLevel = 0,
+                   uint32_t levelCount = VK_REMAINING_MIP_LEVELS,
+                   uint32_t baseArrayLayer = 0,
+                   uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS );
+
+    void require ( VkImage image,
+                   const ImageUsage& usage,
+                   uint32_t baseMipLevel = 0,
+                   uint32_t levelCount = VK_REMAINING_MIP_LEVELS,
+                   uint32_t baseArrayLayer = 0,
+                   uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS );
+
+    //Cambios de estado hechos fuera del tracker (render pass, cambios de
+    //familia de cola...)
+    void assume ( VkImage image,
+                  const ImageUsage& usage,
+                  uint32_t baseMipLevel = 0,
+                  uint32_t levelCount = VK_REMAINING_MIP_LEVELS,
+                  uint32_t baseArrayLayer = 0,
+                  uint32_t layerCount = VK_REMAINING_ARRAY_LAYERS );
+
+    //Dependencia de memoria global (p.ej. buffers) que se emite en el
+    //mismo flush que las transiciones de imagen
+    void requireMemory ( VkPipelineStageFlags srcStage,
+                         VkAccessFlags srcAccess,
+                         VkPipelineStageFlags dstStage,
+                         VkAccessFlags dstAccess );
+
+    ImageUsage usage ( VkImage image,
+                       uint32_t mipLevel = 0,
+                       uint32_t arrayLayer = 0 ) const;
+
+    bool hasPendingBarriers ( ) const;
+
+    void flush ( VkCommandBuffer commandBuffer );
+
+  private:
+    //Última escritura (o transición de layout) de un subrecurso: origen
+    //de la dependencia de los lectores que aún no cubre ninguna barrera
+    struct LastWrite
+    {
+      VkPipelineStageFlags _stage = 0;
+      VkAccessFlags _access = 0;
+    };
+
+    struct TrackedImage
+    {
+      VkImageAspectFlags _aspectMask;
+      uint32_t _mipLevels;
+      uint32_t _arrayLayers;
+      //Indexado por mip * _arrayLayers + capa
+      std::vector < ImageUsage > _state;
+      std::vector < LastWrite > _lastWrite;
+      //Índice en _pending o -1
+      std::vector < int > _pendingIndex;
+    };
+
+    struct PendingTransition
+    {
+      VkImage _image;
+      uint32_t _mipLevel;
+      uint32_t _arrayLayer;
+      ImageUsage _before;
+      ImageUsage _after;
+    };
+
+    TrackedImage& tracked ( VkImage image );
+
+    std::unordered_map < VkImage, TrackedImage > _images;
+    std::vector < PendingTransition > _pending;
+
+    //Dependencia de memoria acumulada por requireMemory
+    VkPipelineStageFlags _memorySrcStage = 0;
+    VkPipelineStageFlags _memoryDstStage = 0;
+    VkAccessFlags _memorySrcAccess = 0;
+    VkAccessFlags _memoryDstAccess = 0;
+};
+
+#endif //VKIMAGETRACKER_H
@@ -0,0 +1,329 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkPipelineCache.h"
+#include "vkHash.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+//Cabecera de VK_PIPELINE_CACHE_HEADER_VERSION_ONE: longitud, versión,
+//vendorID, deviceID y pipelineCacheUUID
+static const size_t CACHE_HEADER_SIZE = 4 * sizeof ( uint32_t ) + VK_UUID_SIZE;
+
+//FNV-1a: solo para saber si el contenido cambió
+static uint64_t hashData ( const std::vector < char >& data )
+{
+  return hashFnv1a ( data.data ( ), data.size ( ));
+}
+
+static bool readCacheFile ( const std::string& path, std::vector < char >& data )
+{
+  std::ifstream file ( path, std::ios::ate | std::ios::binary );
+  if ( !file.is_open ( ))
+  {
+    return false;
+  }
+
+  std::streamoff size = file.tellg ( );
+  if ( size <= 0 )
+  {
+    return false;
+  }
+
+  data.resize ( static_cast<size_t>(size));
+  file.seekg ( 0 );
+  file.read ( data.data ( ), size );
+  return file.good ( );
+}
+
+//Hasta el disco, no solo hasta la cache del SO: si no, tras un corte el
+//rename puede haber llegado y los datos no
+static bool syncFile ( std::FILE* file )
+{
+#ifdef _WIN32
+  HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle ( _fileno ( file )));
+  return FlushFileBuffers ( handle ) != 0;
+#else
+  return fsync ( fileno ( file )) == 0;
+#endif
+}
+
+//Escritura a un temporal sincronizado y rename: un corte a mitad nunca
+//deja un fichero truncado con el nombre bueno
+static bool writeFileAtomic ( const std::string& path,
+                              const std::vector < char >& data )
+{
+  std::string temporary = path + ".tmp";
+  std::FILE* file = std::fopen ( temporary.c_str ( ), "wb" );
+  if ( file == nullptr )
+  {
+    return false;
+  }
+
+  bool written = std::fwrite ( data.data ( ), 1, data.size ( ), file ) == data.size ( )
+    && std::fflush ( file ) == 0
+    && syncFile ( file );
+  written = std::fclose ( file ) == 0 && written;
+  if ( !written )
+  {
+    std::remove ( temporary.c_str ( ));
+    return false;
+  }
+
+#ifdef _WIN32
+  bool renamed = MoveFileExA ( temporary.c_str ( ),
+                               path.c_str ( ),
+                               MOVEFILE_REPLACE_EXISTING
+                                 | MOVEFILE_WRITE_THROUGH ) != 0;
+#else
+  bool renamed = std::rename ( temporary.c_str ( ), path.c_str ( )) == 0;
+#endif
+  if ( !renamed )
+  {
+    std::remove ( temporary.c_str ( ));
+  }
+  return renamed;
+}
+
+PipelineCache::~PipelineCache ( )
+{
+  joinSave ( );
+}
+
+void PipelineCache::init ( VkPhysicalDevice physicalDevice,
+                           VkDevice device,
+                           const std::string& path )
+{
+  _device = device;
+  _path = path;
+  vkGetPhysicalDeviceProperties ( physicalDevice, &_properties );
+
+  std::vector < char > data;
+  _loaded = !_path.empty ( )
+    && readCacheFile ( _path, data )
+    && isCompatible ( data );
+  if ( !_loaded )
+  {
+    data.clear ( );
+  }
+
+  VkPipelineCacheCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
+  createInfo.initialDataSize = data.size ( );
+  createInfo.pInitialData = data.empty ( ) ? nullptr : data.data ( );
+
+  //El driver puede rechazar datos que pasan la cabecera: se reintenta vacía
+  VkResult result = vkCreatePipelineCache ( _device, &createInfo, nullptr, &_cache );
+  if ( result != VK_SUCCESS && _loaded )
+  {
+    _loaded = false;
+    data.clear ( );
+    createInfo.initialDataSize = 0;
+    createInfo.pInitialData = nullptr;
+    result = vkCreatePipelineCache ( _device, &createInfo, nullptr, &_cache );
+  }
+  if ( result != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create pipeline cache!" );
+  }
+
+  _savedHash = _loaded ? hashData ( data ) : 0;
+  _savedPipelines = 0;
+  _lastSave = std::chrono::steady_clock::now ( );
+}
+
+void PipelineCache::destroy ( )
+{
+  if ( _cache == VK_NULL_HANDLE )
+  {
+    return;
+  }
+
+  if ( !save ( ))
+  {
+    std::cerr << "failed to save pipeline cache " << _path << std::endl;
+  }
+  vkDestroyPipelineCache ( _device, _cache, nullptr );
+  _cache = VK_NULL_HANDLE;
+}
+
+VkPipelineCache PipelineCache::handle ( ) const
+{
+  return _cache;
+}
+
+bool PipelineCache::loadedFromDisk ( ) const
+{
+  return _loaded;
+}
+
+bool PipelineCache::save ( )
+{
+  joinSave ( );
+  _saveFailed = false;
+
+  _lastSave = std::chrono::steady_clock::now ( );
+  if ( _path.empty ( ) || _cache == VK_NULL_HANDLE )
+  {
+    return true;
+  }
+
+  std::vector < char > data;
+  return readCacheData ( data ) && writeIfChanged ( data );
+}
+
+bool PipelineCache::saveIfDue ( double intervalSeconds,
+                                uint64_t compiledPipelines )
+{
+  if ( compiledPipelines == _savedPipelines )
+  {
+    return !_saveFailed.exchange ( false );
+  }
+
+  bool started = false;
+  bool saved = saveInBackground ( intervalSeconds, started );
+  if ( started )
+  {
+    _savedPipelines = compiledPipelines;
+  }
+  return saved;
+}
+
+bool PipelineCache::saveIfDue ( double intervalSeconds )
+{
+  bool started = false;
+  return saveInBackground ( intervalSeconds, started );
+}
+
+bool PipelineCache::saveInBackground ( double intervalSeconds, bool& started )
+{
+  bool saved = !_saveFailed.exchange ( false );
+  if ( _path.empty ( ) || _cache == VK_NULL_HANDLE || _saving )
+  {
+    return saved;
+  }
+
+  std::chrono::duration < double > elapsed =
+    std::chrono::steady_clock::now ( ) - _lastSave;
+  if ( elapsed.count ( ) < intervalSeconds )
+  {
+    return saved;
+  }
+  _lastSave = std::chrono::steady_clock::now ( );
+
+  //vkGetPipelineCacheData es una copia: se queda en este hilo
+  std::vector < char > data;
+  if ( !readCacheData ( data ))
+  {
+    return false;
+  }
+  started = true;
+
+  //El anterior ya ha terminado (_saving es false)
+  joinSave ( );
+  _saving = true;
+  _saveThread = std::thread ( [ this, data = std::move ( data ) ] ( )
+  {
+    if ( !writeIfChanged ( data ))
+    {
+      _saveFailed = true;
+    }
+    _saving = false;
+  } );
+  return saved;
+}
+
+void PipelineCache::joinSave ( )
+{
+  if ( _saveThread.joinable ( ))
+  {
+    _saveThread.join ( );
+  }
+}
+
+bool PipelineCache::readCacheData ( std::vector < char >& data ) const
+{
+  size_t size = 0;
+  if ( vkGetPipelineCacheData ( _device, _cache, &size, nullptr ) != VK_SUCCESS
+    || size == 0 )
+  {
+    return false;
+  }
+
+  //VK_INCOMPLETE si crece entre las dos llamadas: se guarda lo obtenido,
+  //que sigue siendo una cache válida
+  data.resize ( size );
+  VkResult result = vkGetPipelineCacheData ( _device, _cache, &size, data.data ( ));
+  if ( result != VK_SUCCESS && result != VK_INCOMPLETE )
+  {
+    return false;
+  }
+  data.resize ( size );
+  return true;
+}
+
+bool PipelineCache::writeIfChanged ( const std::vector < char >& data )
+{
+  uint64_t hash = hashData ( data );
+  if ( hash == _savedHash )
+  {
+    return true;
+  }
+
+  if ( !writeFileAtomic ( _path, data ))
+  {
+    return false;
+  }
+  _savedHash = hash;
+  return true;
+}
+
+bool PipelineCache::isCompatible ( const std::vector < char >& data ) const
+{
+  if ( data.size ( ) < CACHE_HEADER_SIZE )
+  {
+    return false;
+  }
+
+  uint32_t header[4];
+  std::memcpy ( header, data.data ( ), sizeof ( header ));
+  uint8_t uuid[VK_UUID_SIZE];
+  std::memcpy ( uuid, data.data ( ) + sizeof ( header ), VK_UUID_SIZE );
+
+  return header[0] >= CACHE_HEADER_SIZE
+    && header[0] <= data.size ( )
+    && header[1] == VK_PIPELINE_CACHE_HEADER_VERSION_ONE
+    && header[2] == _properties.vendorID
+    && header[3] == _properties.deviceID
+    && std::memcmp ( uuid, _properties.pipelineCacheUUID, VK_UUID_SIZE ) == 0;
+}
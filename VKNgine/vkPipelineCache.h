@@ -0,0 +1,103 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKPIPELINECACHE_H
+#define VKPIPELINECACHE_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+//VkPipelineCache persistente en disco. Al iniciar se carga el fichero si
+//su cabecera corresponde al dispositivo (vendorID, deviceID y
+//pipelineCacheUUID); si no, se empieza vacía y el driver compila de
+//nuevo. Se guarda de forma atómica (fichero temporal sincronizado a disco
+//y rename) y solo si el contenido ha cambiado desde el último guardado
+class PipelineCache
+{
+  public:
+    ~PipelineCache ( );
+
+    //Ruta vacía: cache solo en memoria
+    void init ( VkPhysicalDevice physicalDevice,
+                VkDevice device,
+                const std::string &path );
+
+    //Espera al guardado en segundo plano, guarda y destruye la cache
+    void destroy ( );
+
+    VkPipelineCache handle ( ) const;
+
+    //El fichero existía y era de este dispositivo
+    bool loadedFromDisk ( ) const;
+
+    //Síncrono. false si no se pudo escribir (la cache sigue siendo válida)
+    bool save ( );
+
+    //Para llamar en cada frame con el contador de pipelines compilados con
+    //la cache: si no ha cambiado desde el último guardado no hace nada. Si
+    //no, como mucho cada interval segundos lee los datos de la cache y el
+    //hash y la escritura se hacen en otro hilo. false si falló el guardado
+    //en segundo plano anterior
+    bool saveIfDue ( double intervalSeconds, uint64_t compiledPipelines );
+
+    //Sin contador (pipelines creados fuera de un PipelineRegistry): cada
+    //interval segundos, y solo se escribe si cambió el contenido
+    bool saveIfDue ( double intervalSeconds );
+
+  private:
+    bool isCompatible ( const std::vector < char > &data ) const;
+
+    bool readCacheData ( std::vector < char > &data ) const;
+
+    //Escribe si el hash es distinto del último guardado
+    bool writeIfChanged ( const std::vector < char > &data );
+
+    //Lee los datos y lanza el hilo si ha pasado el intervalo y no hay otro
+    //guardado en marcha. started indica si se lanzó
+    bool saveInBackground ( double intervalSeconds, bool &started );
+
+    void joinSave ( );
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VkPipelineCache _cache = VK_NULL_HANDLE;
+    VkPhysicalDeviceProperties _properties = {};
+    std::string _path;
+    bool _loaded = false;
+
+    //Huella de lo último escrito, para no reescribir lo mismo. Solo la
+    //toca el hilo de guardado (o save ( ) tras esperarlo)
+    uint64_t _savedHash = 0;
+    std::chrono::steady_clock::time_point _lastSave;
+    uint64_t _savedPipelines = 0;
+
+    //Guardado en segundo plano: uno a la vez
+    std::thread _saveThread;
+    std::atomic < bool > _saving { false };
+    std::atomic < bool > _saveFailed { false };
+};
+
+#endif //VKPIPELINECACHE_H
@@ -0,0 +1,521 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkPipelineRegistry.h"
+#include "vkWorkerPool.h"
+#include "vkHash.h"
+
+#include <stdexcept>
+
+//Un pipeline por worker como mínimo: compilar es caro
+static const size_t MIN_PIPELINES_PER_WORKER = 1;
+
+bool PipelineShaderStage::operator== ( const PipelineShaderStage& other ) const
+{
+  return _stage == other._stage
+    && _codeHash == other._codeHash
+    && _specialization == other._specialization;
+}
+
+bool GraphicsPipelineDesc::operator== ( const GraphicsPipelineDesc& other ) const
+{
+  if ( _stages != other._stages
+    || _bindings.size ( ) != other._bindings.size ( )
+    || _attributes.size ( ) != other._attributes.size ( ))
+  {
+    return false;
+  }
+
+  for ( size_t i = 0; i < _bindings.size ( ); i++ )
+  {
+    const VkVertexInputBindingDescription& a = _bindings[i];
+    const VkVertexInputBindingDescription& b = other._bindings[i];
+    if ( a.binding != b.binding || a.stride != b.stride
+      || a.inputRate != b.inputRate )
+    {
+      return false;
+    }
+  }
+
+  for ( size_t i = 0; i < _attributes.size ( ); i++ )
+  {
+    const VkVertexInputAttributeDescription& a = _attributes[i];
+    const VkVertexInputAttributeDescription& b = other._attributes[i];
+    if ( a.location != b.location || a.binding != b.binding
+      || a.format != b.format || a.offset != b.offset )
+    {
+      return false;
+    }
+  }
+
+  return _topology == other._topology
+    && _polygonMode == other._polygonMode
+    && _cullMode == other._cullMode
+    && _frontFace == other._frontFace
+    && _lineWidth == other._lineWidth
+    && _samples == other._samples
+    && _depthTest == other._depthTest
+    && _depthWrite == other._depthWrite
+    && _depthCompare == other._depthCompare
+    && _blend == other._blend
+    && _srcColorFactor == other._srcColorFactor
+    && _dstColorFactor == other._dstColorFactor
+    && _colorBlendOp == other._colorBlendOp
+    && _srcAlphaFactor == other._srcAlphaFactor
+    && _dstAlphaFactor == other._dstAlphaFactor
+    && _alphaBlendOp == other._alphaBlendOp
+    && _colorWriteMask == other._colorWriteMask
+    && _layout == other._layout
+    && _renderPass == other._renderPass
+    && _subpass == other._subpass;
+}
+
+size_t GraphicsPipelineDesc::hash ( ) const
+{
+  uint64_t hash = 0;
+  for ( const PipelineShaderStage& stage : _stages )
+  {
+    hash = hashCombine ( hash, stage._stage );
+    hash = hashCombine ( hash, stage._codeHash );
+    for ( const auto& constant : stage._specialization )
+    {
+      hash = hashCombine ( hash, constant.first );
+      hash = hashCombine ( hash, constant.second );
+    }
+  }
+
+  for ( const VkVertexInputBindingDescription& binding : _bindings )
+  {
+    hash = hashCombine ( hash, binding.binding );
+    hash = hashCombine ( hash, binding.stride );
+    hash = hashCombine ( hash, binding.inputRate );
+  }
+
+  for ( const VkVertexInputAttributeDescription& attribute : _attributes )
+  {
+    hash = hashCombine ( hash, attribute.location );
+    hash = hashCombine ( hash, attribute.binding );
+    hash = hashCombine ( hash, attribute.format );
+    hash = hashCombine ( hash, attribute.offset );
+  }
+
+  //lineWidth cuantizado: dos anchos iguales dan el mismo hash
+  hash = hashCombine ( hash, _topology );
+  hash = hashCombine ( hash, _polygonMode );
+  hash = hashCombine ( hash, _cullMode );
+  hash = hashCombine ( hash, _frontFace );
+  hash = hashCombine ( hash, static_cast<uint64_t>(_lineWidth * 16.0f));
+  hash = hashCombine ( hash, _samples );
+  hash = hashCombine ( hash, ( _depthTest ? 1u : 0u )
+                           | ( _depthWrite ? 2u : 0u )
+                           | ( _blend ? 4u : 0u ));
+  hash = hashCombine ( hash, _depthCompare );
+  if ( _blend )
+  {
+    hash = hashCombine ( hash, _srcColorFactor );
+    hash = hashCombine ( hash, _dstColorFactor );
+    hash = hashCombine ( hash, _colorBlendOp );
+    hash = hashCombine ( hash, _srcAlphaFactor );
+    hash = hashCombine ( hash, _dstAlphaFactor );
+    hash = hashCombine ( hash, _alphaBlendOp );
+  }
+  hash = hashCombine ( hash, _colorWriteMask );
+  hash = hashHandle ( hash, _layout );
+  hash = hashHandle ( hash, _renderPass );
+  return static_cast<size_t>(hashCombine ( hash, _subpass ));
+}
+
+void PipelineRegistry::init ( VkDevice device,
+                              VkPipelineCache cache,
+                              WorkerPool* workers )
+{
+  _device = device;
+  _cache = cache;
+  _workers = workers;
+}
+
+void PipelineRegistry::destroy ( )
+{
+  std::lock_guard < std::mutex > compileLock ( _compileMutex );
+  std::lock_guard < std::mutex > lock ( _mutex );
+  for ( Entry& entry : _entries )
+  {
+    if ( entry._pipeline != VK_NULL_HANDLE )
+    {
+      vkDestroyPipeline ( _device, entry._pipeline, nullptr );
+    }
+  }
+  _entries.clear ( );
+  _lookup.clear ( );
+  _pending.clear ( );
+}
+
+PipelineHandle PipelineRegistry::request ( const GraphicsPipelineDesc& desc )
+{
+  if ( desc._layout == VK_NULL_HANDLE || desc._renderPass == VK_NULL_HANDLE
+    || desc._stages.empty ( ))
+  {
+    throw std::runtime_error ( "failed to request pipeline: incomplete description!" );
+  }
+
+  std::lock_guard < std::mutex > lock ( _mutex );
+  auto found = _lookup.find ( desc );
+  if ( found != _lookup.end ( ))
+  {
+    return found->second;
+  }
+
+  PipelineHandle handle = static_cast<PipelineHandle>(_entries.size ( ));
+  _entries.emplace_back ( );
+  _entries.back ( )._desc = desc;
+  _lookup.emplace ( desc, handle );
+  _pending.push_back ( handle );
+  return handle;
+}
+
+void PipelineRegistry::compilePending ( )
+{
+  std::lock_guard < std::mutex > compileLock ( _compileMutex );
+
+  //Las referencias a elementos del deque no cambian al añadir: se compila
+  //sin el lock y request() sigue funcionando desde otros hilos
+  std::vector < Entry* > batch;
+  {
+    std::lock_guard < std::mutex > lock ( _mutex );
+    batch.reserve ( _pending.size ( ));
+    for ( PipelineHandle handle : _pending )
+    {
+      batch.push_back ( &_entries[handle] );
+    }
+    _pending.clear ( );
+  }
+
+  if ( batch.empty ( ))
+  {
+    return;
+  }
+
+  try
+  {
+    if ( _workers && _workers->workerCount ( ) > 1 && batch.size ( ) > 1 )
+    {
+      _workers->parallelFor ( batch.size ( ), MIN_PIPELINES_PER_WORKER,
+        [ this, &batch ] ( size_t begin, size_t end, uint32_t )
+        {
+          compileRange ( batch, begin, end );
+        } );
+    }
+    else
+    {
+      compileRange ( batch, 0, batch.size ( ));
+    }
+  }
+  catch ( ... )
+  {
+    //Los lotes de otros workers que sí se crearon quedan listos. Los que
+    //fallaron salen del mapa: si no, request() devolvería para siempre un
+    //handle que nunca está listo
+    std::lock_guard < std::mutex > lock ( _mutex );
+    for ( Entry* entry : batch )
+    {
+      if ( entry->_pipeline != VK_NULL_HANDLE )
+      {
+        entry->_ready = true;
+        _compiled++;
+      }
+      else if ( !entry->_released )
+      {
+        _lookup.erase ( entry->_desc );
+        entry->_released = true;
+      }
+    }
+    throw;
+  }
+
+  std::lock_guard < std::mutex > lock ( _mutex );
+  for ( Entry* entry : batch )
+  {
+    entry->_ready = true;
+  }
+  _compiled += batch.size ( );
+}
+
+//Un lote por worker: todas las create infos se construyen antes y se
+//pasan en una sola llamada a vkCreateGraphicsPipelines
+void PipelineRegistry::compileRange ( const std::vector < Entry* >& entries,
+                                      size_t begin,
+                                      size_t end )
+{
+  size_t count = end - begin;
+
+  //Tamaño fijo desde el principio: las create infos apuntan dentro de
+  //estos vectores
+  std::vector < std::vector < VkPipelineShaderStageCreateInfo > > stages ( count );
+  std::vector < std::vector < VkSpecializationMapEntry > > mapEntries ( count );
+  std::vector < std::vector < uint32_t > > specData ( count );
+  std::vector < std::vector < VkSpecializationInfo > > specInfos ( count );
+  std::vector < VkPipelineVertexInputStateCreateInfo > vertexInput ( count );
+  std::vector < VkPipelineInputAssemblyStateCreateInfo > inputAssembly ( count );
+  std::vector < VkPipelineRasterizationStateCreateInfo > rasterizer ( count );
+  std::vector < VkPipelineMultisampleStateCreateInfo > multisampling ( count );
+  std::vector < VkPipelineDepthStencilStateCreateInfo > depthStencil ( count );
+  std::vector < VkPipelineColorBlendAttachmentState > blendAttachment ( count );
+  std::vector < VkPipelineColorBlendStateCreateInfo > colorBlending ( count );
+  std::vector < VkGraphicsPipelineCreateInfo > pipelineInfos ( count );
+
+  //Viewport y scissor se fijan al grabar
+  static const VkDynamicState dynamicStates[] =
+  {
+    VK_DYNAMIC_STATE_VIEWPORT,
+    VK_DYNAMIC_STATE_SCISSOR
+  };
+
+  VkPipelineViewportStateCreateInfo viewportState = {};
+  viewportState.sType = VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
+  viewportState.viewportCount = 1;
+  viewportState.scissorCount = 1;
+
+  VkPipelineDynamicStateCreateInfo dynamicState = {};
+  dynamicState.sType = VK_STRUCTURE_TYPE_PIPELINE_DYNAMIC_STATE_CREATE_INFO;
+  dynamicState.dynamicStateCount = 2;
+  dynamicState.pDynamicStates = dynamicStates;
+
+  for ( size_t i = 0; i < count; i++ )
+  {
+    const GraphicsPipelineDesc& desc = entries[begin + i]->_desc;
+
+    //Las constantes de cada etapa van seguidas en specData
+    size_t constantCount = 0;
+    for ( const PipelineShaderStage& stage : desc._stages )
+    {
+      constantCount += stage._specialization.size ( );
+    }
+    mapEntries[i].reserve ( constantCount );
+    specData[i].reserve ( constantCount );
+    specInfos[i].resize ( desc._stages.size ( ));
+    stages[i].resize ( desc._stages.size ( ));
+
+    for ( size_t s = 0; s < desc._stages.size ( ); s++ )
+    {
+      const PipelineShaderStage& stage = desc._stages[s];
+      VkPipelineShaderStageCreateInfo& stageInfo = stages[i][s];
+      stageInfo = {};
+      stageInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+      stageInfo.stage = stage._stage;
+      stageInfo.module = stage._module;
+      stageInfo.pName = "main";
+
+      if ( !stage._specialization.empty ( ))
+      {
+        size_t first = mapEntries[i].size ( );
+        for ( const auto& constant : stage._specialization )
+        {
+          VkSpecializationMapEntry mapEntry = {};
+          mapEntry.constantID = constant.first;
+          mapEntry.offset = static_cast<uint32_t>(
+            ( specData[i].size ( ) - first ) * sizeof ( uint32_t ));
+          mapEntry.size = sizeof ( uint32_t );
+          mapEntries[i].push_back ( mapEntry );
+          specData[i].push_back ( constant.second );
+        }
+
+        VkSpecializationInfo& specInfo = specInfos[i][s];
+        specInfo.mapEntryCount =
+          static_cast<uint32_t>(stage._specialization.size ( ));
+        specInfo.pMapEntries = mapEntries[i].data ( ) + first;
+        specInfo.dataSize = stage._specialization.size ( ) * sizeof ( uint32_t );
+        specInfo.pData = specData[i].data ( ) + first;
+        stageInfo.pSpecializationInfo = &specInfo;
+      }
+    }
+
+    vertexInput[i] = {};
+    vertexInput[i].sType = VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
+    vertexInput[i].vertexBindingDescriptionCount =
+      static_cast<uint32_t>(desc._bindings.size ( ));
+    vertexInput[i].pVertexBindingDescriptions = desc._bindings.data ( );
+    vertexInput[i].vertexAttributeDescriptionCount =
+      static_cast<uint32_t>(desc._attributes.size ( ));
+    vertexInput[i].pVertexAttributeDescriptions = desc._attributes.data ( );
+
+    inputAssembly[i] = {};
+    inputAssembly[i].sType = VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
+    inputAssembly[i].topology = desc._topology;
+    inputAssembly[i].primitiveRestartEnable = VK_FALSE;
+
+    rasterizer[i] = {};
+    rasterizer[i].sType = VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
+    rasterizer[i].depthClampEnable = VK_FALSE;
+    rasterizer[i].rasterizerDiscardEnable = VK_FALSE;
+    rasterizer[i].polygonMode = desc._polygonMode;
+    rasterizer[i].lineWidth = desc._lineWidth;
+    rasterizer[i].cullMode = desc._cullMode;
+    rasterizer[i].frontFace = desc._frontFace;
+    rasterizer[i].depthBiasEnable = VK_FALSE;
+
+    multisampling[i] = {};
+    multisampling[i].sType = VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
+    multisampling[i].sampleShadingEnable = VK_FALSE;
+    multisampling[i].rasterizationSamples = desc._samples;
+
+    depthStencil[i] = {};
+    depthStencil[i].sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
+    depthStencil[i].depthTestEnable = desc._depthTest ? VK_TRUE : VK_FALSE;
+    depthStencil[i].depthWriteEnable = desc._depthWrite ? VK_TRUE : VK_FALSE;
+    depthStencil[i].depthCompareOp = desc._depthCompare;
+    depthStencil[i].depthBoundsTestEnable = VK_FALSE;
+    depthStencil[i].stencilTestEnable = VK_FALSE;
+
+    blendAttachment[i] = {};
+    blendAttachment[i].colorWriteMask = desc._colorWriteMask;
+    blendAttachment[i].blendEnable = desc._blend ? VK_TRUE : VK_FALSE;
+    blendAttachment[i].srcColorBlendFactor = desc._srcColorFactor;
+    blendAttachment[i].dstColorBlendFactor = desc._dstColorFactor;
+    blendAttachment[i].colorBlendOp = desc._colorBlendOp;
+    blendAttachment[i].srcAlphaBlendFactor = desc._srcAlphaFactor;
+    blendAttachment[i].dstAlphaBlendFactor = desc._dstAlphaFactor;
+    blendAttachment[i].alphaBlendOp = desc._alphaBlendOp;
+
+    colorBlending[i] = {};
+    colorBlending[i].sType = VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
+    colorBlending[i].logicOpEnable = VK_FALSE;
+    colorBlending[i].logicOp = VK_LOGIC_OP_COPY;
+    colorBlending[i].attachmentCount = 1;
+    colorBlending[i].pAttachments = &blendAttachment[i];
+
+    VkGraphicsPipelineCreateInfo& pipelineInfo = pipelineInfos[i];
+    pipelineInfo = {};
+    pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
+    pipelineInfo.stageCount = static_cast<uint32_t>(stages[i].size ( ));
+    pipelineInfo.pStages = stages[i].data ( );
+    pipelineInfo.pVertexInputState = &vertexInput[i];
+    pipelineInfo.pInputAssemblyState = &inputAssembly[i];
+    pipelineInfo.pViewportState = &viewportState;
+    pipelineInfo.pRasterizationState = &rasterizer[i];
+    pipelineInfo.pMultisampleState = &multisampling[i];
+    pipelineInfo.pDepthStencilState = &depthStencil[i];
+    pipelineInfo.pColorBlendState = &colorBlending[i];
+    pipelineInfo.pDynamicState = &dynamicState;
+    pipelineInfo.layout = desc._layout;
+    pipelineInfo.renderPass = desc._renderPass;
+    pipelineInfo.subpass = desc._subpass;
+    pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+  }
+
+  std::vector < VkPipeline > pipelines ( count, VK_NULL_HANDLE );
+  //La pipeline cache es thread safe: los workers la comparten
+  if ( vkCreateGraphicsPipelines ( _device, _cache,
+                                   static_cast<uint32_t>(count),
+                                   pipelineInfos.data ( ), nullptr,
+                                   pipelines.data ( )) != VK_SUCCESS )
+  {
+    for ( VkPipeline pipeline : pipelines )
+    {
+      if ( pipeline != VK_NULL_HANDLE )
+      {
+        vkDestroyPipeline ( _device, pipeline, nullptr );
+      }
+    }
+    throw std::runtime_error ( "failed to create graphics pipeline!" );
+  }
+
+  for ( size_t i = 0; i < count; i++ )
+  {
+    entries[begin + i]->_pipeline = pipelines[i];
+  }
+}
+
+bool PipelineRegistry::isReady ( PipelineHandle handle ) const
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  return handle < _entries.size ( ) && _entries[handle]._ready
+    && !_entries[handle]._released;
+}
+
+VkPipeline PipelineRegistry::resolve ( PipelineHandle handle )
+{
+  if ( !isReady ( handle ))
+  {
+    compilePending ( );
+  }
+
+  std::lock_guard < std::mutex > lock ( _mutex );
+  if ( handle >= _entries.size ( ) || !_entries[handle]._ready
+    || _entries[handle]._released )
+  {
+    throw std::runtime_error ( "failed to resolve pipeline handle!" );
+  }
+  return _entries[handle]._pipeline;
+}
+
+void PipelineRegistry::releaseRenderPass ( VkRenderPass renderPass )
+{
+  std::lock_guard < std::mutex > compileLock ( _compileMutex );
+  std::lock_guard < std::mutex > lock ( _mutex );
+
+  //Las entradas se quedan (los handles son índices) pero salen del mapa:
+  //una petición nueva con el mismo render pass crea otra
+  for ( Entry& entry : _entries )
+  {
+    if ( entry._released || entry._desc._renderPass != renderPass )
+    {
+      continue;
+    }
+
+    if ( entry._pipeline != VK_NULL_HANDLE )
+    {
+      vkDestroyPipeline ( _device, entry._pipeline, nullptr );
+      entry._pipeline = VK_NULL_HANDLE;
+    }
+    entry._released = true;
+    _lookup.erase ( entry._desc );
+    entry._desc._stages.clear ( );
+    entry._desc._bindings.clear ( );
+    entry._desc._attributes.clear ( );
+  }
+
+  for ( auto it = _pending.begin ( ); it != _pending.end ( ); )
+  {
+    it = _entries[*it]._released ? _pending.erase ( it ) : it + 1;
+  }
+}
+
+size_t PipelineRegistry::pipelineCount ( ) const
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  size_t count = 0;
+  for ( const Entry& entry : _entries )
+  {
+    count += entry._pipeline != VK_NULL_HANDLE ? 1 : 0;
+  }
+  return count;
+}
+
+uint64_t PipelineRegistry::compiledCount ( ) const
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  return _compiled;
+}
+
+uint64_t PipelineRegistry::hashCode ( const void* code, size_t size )
+{
+  return hashFnv1a ( code, size );
+}
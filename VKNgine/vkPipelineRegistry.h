@@ -0,0 +1,182 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKPIPELINEREGISTRY_H
+#define VKPIPELINEREGISTRY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+class WorkerPool;
+
+//Etapa de un pipeline. Se identifica por el contenido del SPIR-V (hash)
+//y no por el módulo: los handles se reutilizan al destruir módulos
+struct PipelineShaderStage
+{
+  VkShaderStageFlagBits _stage = VK_SHADER_STAGE_VERTEX_BIT;
+  VkShaderModule _module = VK_NULL_HANDLE;
+  uint64_t _codeHash = 0;
+
+  //Constantes de especialización de 32 bits (id, valor)
+  std::vector < std::pair < uint32_t, uint32_t > > _specialization;
+
+  bool operator== ( const PipelineShaderStage& other ) const;
+};
+
+//Estado completo de un pipeline gráfico: todo lo que cambia el binario.
+//El viewport y el scissor son siempre dinámicos. Dos descripciones
+//iguales comparten pipeline
+struct GraphicsPipelineDesc
+{
+  std::vector < PipelineShaderStage > _stages;
+
+  //Vertex input
+  std::vector < VkVertexInputBindingDescription > _bindings;
+  std::vector < VkVertexInputAttributeDescription > _attributes;
+  VkPrimitiveTopology _topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+
+  //Raster
+  VkPolygonMode _polygonMode = VK_POLYGON_MODE_FILL;
+  VkCullModeFlags _cullMode = VK_CULL_MODE_BACK_BIT;
+  VkFrontFace _frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+  float _lineWidth = 1.0f;
+  VkSampleCountFlagBits _samples = VK_SAMPLE_COUNT_1_BIT;
+
+  //Depth
+  bool _depthTest = true;
+  bool _depthWrite = true;
+  VkCompareOp _depthCompare = VK_COMPARE_OP_LESS;
+
+  //Blend (un solo attachment de color)
+  bool _blend = false;
+  VkBlendFactor _srcColorFactor = VK_BLEND_FACTOR_SRC_ALPHA;
+  VkBlendFactor _dstColorFactor = VK_BLEND_FACTOR_ONE_MINUS_SRC_ALPHA;
+  VkBlendOp _colorBlendOp = VK_BLEND_OP_ADD;
+  VkBlendFactor _srcAlphaFactor = VK_BLEND_FACTOR_ONE;
+  VkBlendFactor _dstAlphaFactor = VK_BLEND_FACTOR_ZERO;
+  VkBlendOp _alphaBlendOp = VK_BLEND_OP_ADD;
+  VkColorComponentFlags _colorWriteMask = VK_COLOR_COMPONENT_R_BIT
+    | VK_COLOR_COMPONENT_G_BIT | VK_COLOR_COMPONENT_B_BIT
+    | VK_COLOR_COMPONENT_A_BIT;
+
+  //Compatibilidad con el render pass
+  VkPipelineLayout _layout = VK_NULL_HANDLE;
+  VkRenderPass _renderPass = VK_NULL_HANDLE;
+  uint32_t _subpass = 0;
+
+  bool operator== ( const GraphicsPipelineDesc& other ) const;
+
+  size_t hash ( ) const;
+};
+
+struct GraphicsPipelineDescHash
+{
+  size_t operator() ( const GraphicsPipelineDesc& desc ) const
+  {
+    return desc.hash ( );
+  }
+};
+
+//Handle de un pipeline pedido al registro. Se resuelve al VkPipeline
+//cuando termina su compilación
+typedef uint32_t PipelineHandle;
+
+//Registro de pipelines gráficos. Las peticiones iguales se deduplican y las
+//nuevas se compilan por lotes (una llamada a vkCreateGraphicsPipelines por
+//worker) con la pipeline cache compartida
+class PipelineRegistry
+{
+  public:
+    static const PipelineHandle NO_PIPELINE = 0xFFFFFFFF;
+
+    //Sin workers se compila en el hilo que llama
+    void init ( VkDevice device,
+                VkPipelineCache cache,
+                WorkerPool* workers = nullptr );
+
+    //Destruye todos los pipelines
+    void destroy ( );
+
+    //Desde cualquier hilo. Los módulos tienen que vivir hasta compilar
+    PipelineHandle request ( const GraphicsPipelineDesc& desc );
+
+    //Compila todo lo pedido y no compilado. Usa los workers y WorkerPool
+    //no es reentrante: solo desde el hilo que usa el pool (en vulkanApp el
+    //de render, o el principal antes de arrancarlo) y nunca desde dentro
+    //de un parallelFor
+    void compilePending ( );
+
+    bool isReady ( PipelineHandle handle ) const;
+
+    //Compila lo pendiente si el pipeline aún no está listo: mismas
+    //restricciones de hilo que compilePending ( )
+    VkPipeline resolve ( PipelineHandle handle );
+
+    //Destruye los pipelines creados para un render pass que va a
+    //desaparecer. Sus handles dejan de ser válidos
+    void releaseRenderPass ( VkRenderPass renderPass );
+
+    size_t pipelineCount ( ) const;
+
+    //Pipelines compilados desde init ( ): si no cambia, la pipeline cache
+    //no tiene nada nuevo que guardar
+    uint64_t compiledCount ( ) const;
+
+    //Para rellenar PipelineShaderStage::_codeHash
+    static uint64_t hashCode ( const void* code, size_t size );
+
+  private:
+    struct Entry
+    {
+      GraphicsPipelineDesc _desc;
+      VkPipeline _pipeline = VK_NULL_HANDLE;
+      bool _ready = false;
+      bool _released = false;
+    };
+
+    void compileRange ( const std::vector < Entry* >& entries,
+                        size_t begin,
+                        size_t end );
+
+    VkDevice _device = VK_NULL_HANDLE;
+    VkPipelineCache _cache = VK_NULL_HANDLE;
+    WorkerPool* _workers = nullptr;
+
+    mutable std::mutex _mutex;
+    //deque: request() añade sin mover las entradas que se están compilando
+    std::deque < Entry > _entries;
+    std::unordered_map < GraphicsPipelineDesc,
+                         PipelineHandle,
+                         GraphicsPipelineDescHash > _lookup;
+    std::vector < PipelineHandle > _pending;
+    uint64_t _compiled = 0;
+
+    //Solo una compilación a la vez
+    std::mutex _compileMutex;
+};
+
+#endif //VKPIPELINEREGISTRY_H
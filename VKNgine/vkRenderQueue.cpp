@@ -0,0 +1,251 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkRenderQueue.h"
+#include "vkWorkerPool.h"
+
+#include <algorithm>
+#include <functional>
+
+//Por debajo de esto no compensa repartir entre workers
+static const size_t MIN_ITEMS_PER_PARTITION = 16384;
+
+static const uint32_t RADIX_BITS = 8;
+static const uint32_t RADIX_SIZE = 1 << RADIX_BITS;
+static const uint32_t DIGIT_COUNT = 64 / RADIX_BITS;
+
+static const uint32_t DEPTH_SHIFT = 0;
+static const uint32_t MESH_SHIFT = DEPTH_SHIFT + RenderQueue::DEPTH_BITS;
+static const uint32_t MATERIAL_SHIFT = MESH_SHIFT + RenderQueue::MESH_BITS;
+static const uint32_t PIPELINE_SHIFT = MATERIAL_SHIFT + RenderQueue::MATERIAL_BITS;
+static const uint32_t PASS_SHIFT = PIPELINE_SHIFT + RenderQueue::PIPELINE_BITS;
+
+static inline uint64_t packField ( uint32_t value, uint32_t bits, uint32_t shift )
+{
+  return ( static_cast<uint64_t>(value) & (( uint64_t ( 1 ) << bits ) - 1 ))
+    << shift;
+}
+
+static inline uint32_t unpackField ( uint64_t key, uint32_t bits, uint32_t shift )
+{
+  return static_cast<uint32_t>(( key >> shift )
+                               & (( uint64_t ( 1 ) << bits ) - 1 ));
+}
+
+static inline uint32_t digitOf ( uint64_t key, uint32_t digit )
+{
+  return static_cast<uint32_t>(( key >> ( digit * RADIX_BITS ))
+                               & ( RADIX_SIZE - 1 ));
+}
+
+//Ejecuta task por partición, repartidas entre los workers si hay varias
+static void forEachPartition ( WorkerPool* workers,
+                               size_t partitions,
+                               const std::function < void ( size_t ) >& task )
+{
+  if ( partitions == 1 )
+  {
+    task ( 0 );
+    return;
+  }
+
+  workers->parallelFor ( partitions, 1,
+    [&] ( size_t begin, size_t end, uint32_t )
+    {
+      for ( size_t partition = begin; partition < end; partition++ )
+      {
+        task ( partition );
+      }
+    } );
+}
+
+RenderQueueStats& RenderQueueStats::operator+= ( const RenderQueueStats& other )
+{
+  _draws += other._draws;
+  _binds += other._binds;
+  _elidedBinds += other._elidedBinds;
+  return *this;
+}
+
+uint64_t RenderQueue::makeKey ( uint32_t passId,
+                                uint32_t pipelineId,
+                                uint32_t materialId,
+                                uint32_t meshId,
+                                uint32_t depthValue )
+{
+  return packField ( passId, PASS_BITS, PASS_SHIFT )
+    | packField ( pipelineId, PIPELINE_BITS, PIPELINE_SHIFT )
+    | packField ( materialId, MATERIAL_BITS, MATERIAL_SHIFT )
+    | packField ( meshId, MESH_BITS, MESH_SHIFT )
+    | packField ( depthValue, DEPTH_BITS, DEPTH_SHIFT );
+}
+
+uint32_t RenderQueue::pass ( uint64_t key )
+{
+  return unpackField ( key, PASS_BITS, PASS_SHIFT );
+}
+
+uint32_t RenderQueue::pipeline ( uint64_t key )
+{
+  return unpackField ( key, PIPELINE_BITS, PIPELINE_SHIFT );
+}
+
+uint32_t RenderQueue::material ( uint64_t key )
+{
+  return unpackField ( key, MATERIAL_BITS, MATERIAL_SHIFT );
+}
+
+uint32_t RenderQueue::mesh ( uint64_t key )
+{
+  return unpackField ( key, MESH_BITS, MESH_SHIFT );
+}
+
+uint32_t RenderQueue::depth ( uint64_t key )
+{
+  return unpackField ( key, DEPTH_BITS, DEPTH_SHIFT );
+}
+
+uint32_t RenderQueue::quantizeDepth ( float normalized )
+{
+  const float maxDepth = static_cast<float>(( 1u << DEPTH_BITS ) - 1 );
+  float clamped = std::min ( std::max ( normalized, 0.0f ), 1.0f );
+  return static_cast<uint32_t>(clamped * maxDepth);
+}
+
+void RenderQueue::clear ( )
+{
+  _items.clear ( );
+}
+
+void RenderQueue::reserve ( size_t count )
+{
+  _items.reserve ( count );
+}
+
+void RenderQueue::push ( uint64_t key, uint32_t object )
+{
+  RenderItem item;
+  item._key = key;
+  item._object = object;
+  _items.push_back ( item );
+}
+
+//LSD radix: cada partición cuenta sus cubetas, el prefijo (cubeta mayor,
+//partición menor) da a cada una su zona de salida y el reparto conserva
+//el orden, así que el resultado no depende del número de workers
+void RenderQueue::sort ( WorkerPool* workers )
+{
+  size_t count = _items.size ( );
+  if ( count < 2 )
+  {
+    return;
+  }
+
+  size_t partitions = 1;
+  if ( workers && count >= 2 * MIN_ITEMS_PER_PARTITION )
+  {
+    partitions = std::min < size_t > ( workers->workerCount ( ),
+                                       count / MIN_ITEMS_PER_PARTITION );
+    partitions = std::max < size_t > ( partitions, 1 );
+  }
+
+  //Los bytes constantes no reordenan nada: basta comparar con la primera
+  //clave en una pasada
+  uint64_t first = _items[0]._key;
+  uint64_t varying = 0;
+  for ( const RenderItem& item : _items )
+  {
+    varying |= item._key ^ first;
+  }
+  if ( varying == 0 )
+  {
+    return;
+  }
+
+  _scratch.resize ( count );
+  _histograms.resize ( partitions * RADIX_SIZE );
+
+  RenderItem* source = _items.data ( );
+  RenderItem* destination = _scratch.data ( );
+
+  for ( uint32_t digit = 0; digit < DIGIT_COUNT; digit++ )
+  {
+    if ( digitOf ( varying, digit ) == 0 )
+    {
+      continue;
+    }
+
+    forEachPartition ( workers, partitions, [&] ( size_t partition )
+    {
+      uint32_t* histogram = &_histograms[partition * RADIX_SIZE];
+      std::fill ( histogram, histogram + RADIX_SIZE, 0 );
+
+      size_t begin = count * partition / partitions;
+      size_t end = count * ( partition + 1 ) / partitions;
+      for ( size_t i = begin; i < end; i++ )
+      {
+        histogram[digitOf ( source[i]._key, digit )]++;
+      }
+    } );
+
+    //Histogramas -> offsets de escritura
+    uint32_t offset = 0;
+    for ( uint32_t bucket = 0; bucket < RADIX_SIZE; bucket++ )
+    {
+      for ( size_t partition = 0; partition < partitions; partition++ )
+      {
+        uint32_t& slot = _histograms[partition * RADIX_SIZE + bucket];
+        uint32_t bucketCount = slot;
+        slot = offset;
+        offset += bucketCount;
+      }
+    }
+
+    forEachPartition ( workers, partitions, [&] ( size_t partition )
+    {
+      uint32_t* offsets = &_histograms[partition * RADIX_SIZE];
+
+      size_t begin = count * partition / partitions;
+      size_t end = count * ( partition + 1 ) / partitions;
+      for ( size_t i = begin; i < end; i++ )
+      {
+        destination[offsets[digitOf ( source[i]._key, digit )]++] = source[i];
+      }
+    } );
+
+    std::swap ( source, destination );
+  }
+
+  if ( source != _items.data ( ))
+  {
+    _items.swap ( _scratch );
+  }
+}
+
+const std::vector < RenderItem >& RenderQueue::items ( ) const
+{
+  return _items;
+}
+
+size_t RenderQueue::size ( ) const
+{
+  return _items.size ( );
+}
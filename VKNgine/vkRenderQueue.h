@@ -0,0 +1,102 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKRENDERQUEUE_H
+#define VKRENDERQUEUE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+class WorkerPool;
+
+//Draw encolado: clave de ordenación e índice del objeto que dibuja
+struct RenderItem
+{
+  uint64_t _key;
+  uint32_t _object;
+};
+
+//Cambios de estado grabados en un frame. Una grabación ingenua vincularía
+//pipeline, descriptores y geometría en cada draw: los que se ahorran son
+//los elididos
+struct RenderQueueStats
+{
+  uint32_t _draws = 0;
+  uint32_t _binds = 0;
+  uint32_t _elidedBinds = 0;
+
+  RenderQueueStats& operator+= ( const RenderQueueStats& other );
+};
+
+//Cola de draws ordenada por una clave de 64 bits. De más a menos
+//significativo: pase, pipeline, material, mallado y profundidad. Al
+//recorrerla en orden los draws que comparten estado quedan juntos
+class RenderQueue
+{
+  public:
+    static const uint32_t PASS_BITS = 4;
+    static const uint32_t PIPELINE_BITS = 10;
+    static const uint32_t MATERIAL_BITS = 14;
+    static const uint32_t MESH_BITS = 12;
+    static const uint32_t DEPTH_BITS = 24;
+
+    //Los campos que no caben en sus bits se truncan
+    static uint64_t makeKey ( uint32_t passId,
+                              uint32_t pipelineId,
+                              uint32_t materialId,
+                              uint32_t meshId,
+                              uint32_t depthValue );
+
+    static uint32_t pass ( uint64_t key );
+    static uint32_t pipeline ( uint64_t key );
+    static uint32_t material ( uint64_t key );
+    static uint32_t mesh ( uint64_t key );
+    static uint32_t depth ( uint64_t key );
+
+    //Profundidad normalizada [0, 1] al campo de la clave (de delante a
+    //atrás). Para pases transparentes se invierte antes
+    static uint32_t quantizeDepth ( float normalized );
+
+    void clear ( );
+
+    void reserve ( size_t count );
+
+    void push ( uint64_t key, uint32_t object );
+
+    //Radix sort estable de 8 bits por pasada; se saltan los bytes que son
+    //iguales en todas las claves. Sin workers se hace todo en el hilo que
+    //llama
+    void sort ( WorkerPool* workers = nullptr );
+
+    const std::vector < RenderItem >& items ( ) const;
+
+    size_t size ( ) const;
+
+  private:
+    std::vector < RenderItem > _items;
+    std::vector < RenderItem > _scratch;
+
+    //Un histograma (o sus offsets) de 256 cubetas por partición
+    std::vector < uint32_t > _histograms;
+};
+
+#endif //VKRENDERQUEUE_H
@@ -0,0 +1,291 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkShaderLibrary.h"
+#include "vkPipelineRegistry.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const uint32_t SPIRV_MAGIC = 0x07230203;
+static const uint32_t SPIRV_MAGIC_SWAPPED = 0x03022307;
+
+//Cabecera de SPIR-V: magic, versión, generador, bound y schema
+static const size_t SPIRV_HEADER_WORDS = 5;
+
+static const uint32_t SPIRV_OP_FUNCTION = 54;
+static const uint32_t SPIRV_OP_DECORATE = 71;
+static const uint32_t SPIRV_DECORATION_SPEC_ID = 1;
+
+namespace
+{
+
+//Fichero mapeado en solo lectura mientras dura el objeto
+class MappedFile
+{
+  public:
+    explicit MappedFile ( const std::string& path )
+    {
+#ifdef _WIN32
+      _file = CreateFileA ( path.c_str ( ), GENERIC_READ, FILE_SHARE_READ,
+                            nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL,
+                            nullptr );
+      if ( _file == INVALID_HANDLE_VALUE )
+      {
+        throw std::runtime_error ( "failed to open file " + path + "!" );
+      }
+
+      LARGE_INTEGER size;
+      if ( !GetFileSizeEx ( _file, &size ))
+      {
+        CloseHandle ( _file );
+        throw std::runtime_error ( "failed to stat file " + path + "!" );
+      }
+      _size = static_cast<size_t>(size.QuadPart);
+      if ( _size == 0 )
+      {
+        return;
+      }
+
+      _mapping = CreateFileMappingA ( _file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+      _data = _mapping ? MapViewOfFile ( _mapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+      if ( !_data )
+      {
+        if ( _mapping )
+        {
+          CloseHandle ( _mapping );
+        }
+        CloseHandle ( _file );
+        throw std::runtime_error ( "failed to map file " + path + "!" );
+      }
+#else
+      int descriptor = open ( path.c_str ( ), O_RDONLY );
+      if ( descriptor < 0 )
+      {
+        throw std::runtime_error ( "failed to open file " + path + "!" );
+      }
+
+      struct stat info;
+      if ( fstat ( descriptor, &info ) != 0 )
+      {
+        close ( descriptor );
+        throw std::runtime_error ( "failed to stat file " + path + "!" );
+      }
+      _size = static_cast<size_t>(info.st_size);
+
+      //El mapa sigue válido después de cerrar el descriptor
+      if ( _size > 0 )
+      {
+        _data = mmap ( nullptr, _size, PROT_READ, MAP_PRIVATE, descriptor, 0 );
+      }
+      close ( descriptor );
+      if ( _data == MAP_FAILED )
+      {
+        _data = nullptr;
+        throw std::runtime_error ( "failed to map file " + path + "!" );
+      }
+#endif
+    }
+
+    ~MappedFile ( )
+    {
+#ifdef _WIN32
+      if ( _data )
+      {
+        UnmapViewOfFile ( _data );
+        CloseHandle ( _mapping );
+      }
+      CloseHandle ( _file );
+#else
+      if ( _data )
+      {
+        munmap ( _data, _size );
+      }
+#endif
+    }
+
+    MappedFile ( const MappedFile& ) = delete;
+    MappedFile& operator= ( const MappedFile& ) = delete;
+
+    const void* data ( ) const
+    {
+      return _data;
+    }
+
+    size_t size ( ) const
+    {
+      return _size;
+    }
+
+  private:
+    void* _data = nullptr;
+    size_t _size = 0;
+#ifdef _WIN32
+    HANDLE _file = INVALID_HANDLE_VALUE;
+    HANDLE _mapping = nullptr;
+#endif
+};
+
+}
+
+//vkCreateShaderModule exige palabras de 32 bits alineadas y en el orden
+//del host
+static void validateSpirv ( const void* code, size_t size )
+{
+  if ( !code || size < SPIRV_HEADER_WORDS * sizeof ( uint32_t ))
+  {
+    throw std::runtime_error ( "failed to load shader: SPIR-V too small!" );
+  }
+
+  if ( size % sizeof ( uint32_t ) != 0
+    || reinterpret_cast<uintptr_t>(code) % alignof ( uint32_t ) != 0 )
+  {
+    throw std::runtime_error ( "failed to load shader: SPIR-V not 32-bit aligned!" );
+  }
+
+  uint32_t magic = *static_cast<const uint32_t*>(code);
+  if ( magic == SPIRV_MAGIC_SWAPPED )
+  {
+    throw std::runtime_error ( "failed to load shader: SPIR-V with wrong endianness!" );
+  }
+  if ( magic != SPIRV_MAGIC )
+  {
+    throw std::runtime_error ( "failed to load shader: bad SPIR-V magic number!" );
+  }
+}
+
+//Las decoraciones van antes de la primera función: no hace falta recorrer
+//el código entero
+static std::vector < uint32_t > findSpecConstants ( const uint32_t* words,
+                                                     size_t wordCount )
+{
+  std::vector < uint32_t > ids;
+  size_t i = SPIRV_HEADER_WORDS;
+  while ( i < wordCount )
+  {
+    uint32_t opcode = words[i] & 0xFFFF;
+    uint32_t length = words[i] >> 16;
+    if ( length == 0 || i + length > wordCount
+      || opcode == SPIRV_OP_FUNCTION )
+    {
+      break;
+    }
+
+    if ( opcode == SPIRV_OP_DECORATE && length >= 4
+      && words[i + 2] == SPIRV_DECORATION_SPEC_ID )
+    {
+      ids.push_back ( words[i + 3] );
+    }
+    i += length;
+  }
+  return ids;
+}
+
+bool ShaderModule::hasSpecConstant ( uint32_t id ) const
+{
+  return std::find ( _specConstants.begin ( ), _specConstants.end ( ), id )
+    != _specConstants.end ( );
+}
+
+void ShaderLibrary::init ( VkDevice device )
+{
+  _device = device;
+}
+
+void ShaderLibrary::destroy ( )
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  for ( const auto& shader : _byHash )
+  {
+    vkDestroyShaderModule ( _device, shader.second._module, nullptr );
+  }
+  _byHash.clear ( );
+  _byPath.clear ( );
+}
+
+ShaderModule ShaderLibrary::load ( const std::string& path )
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  auto found = _byPath.find ( path );
+  if ( found != _byPath.end ( ))
+  {
+    return found->second;
+  }
+
+  //El mapa de páginas ya está alineado: se pasa tal cual al driver
+  MappedFile file ( path );
+  ShaderModule shader = createLocked ( file.data ( ), file.size ( ));
+  _byPath.emplace ( path, shader );
+  return shader;
+}
+
+ShaderModule ShaderLibrary::create ( const void* code, size_t size )
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  return createLocked ( code, size );
+}
+
+ShaderModule ShaderLibrary::createLocked ( const void* code, size_t size )
+{
+  validateSpirv ( code, size );
+
+  uint64_t codeHash = PipelineRegistry::hashCode ( code, size );
+  auto found = _byHash.find ( codeHash );
+  if ( found != _byHash.end ( ))
+  {
+    return found->second;
+  }
+
+  VkShaderModuleCreateInfo createInfo = {};
+  createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
+  createInfo.codeSize = size;
+  createInfo.pCode = static_cast<const uint32_t*>(code);
+
+  ShaderModule shader;
+  shader._codeHash = codeHash;
+  shader._specConstants =
+    findSpecConstants ( static_cast<const uint32_t*>(code),
+                        size / sizeof ( uint32_t ));
+  if ( vkCreateShaderModule ( _device, &createInfo, nullptr, &shader._module )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create shader module!" );
+  }
+
+  _byHash.emplace ( codeHash, shader );
+  return shader;
+}
+
+size_t ShaderLibrary::moduleCount ( ) const
+{
+  std::lock_guard < std::mutex > lock ( _mutex );
+  return _byHash.size ( );
+}
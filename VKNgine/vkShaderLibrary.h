@@ -0,0 +1,76 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKSHADERLIBRARY_H
+#define VKSHADERLIBRARY_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include <vulkan/vulkan.h>
+
+//Shader module ya creado y el hash de su SPIR-V (el que usa
+//PipelineShaderStage::_codeHash)
+struct ShaderModule
+{
+  VkShaderModule _module = VK_NULL_HANDLE;
+  uint64_t _codeHash = 0;
+
+  //Ids de las constantes de especialización que declara el SPIR-V
+  std::vector < uint32_t > _specConstants;
+
+  bool hasSpecConstant ( uint32_t id ) const;
+};
+
+//Biblioteca de shader modules. Los .spv se mapean en memoria, se validan
+//(magic y alineamiento) y los módulos viven hasta destroy(): recrear
+//pipelines no vuelve a leer ficheros ni a crear módulos
+class ShaderLibrary
+{
+  public:
+    void init ( VkDevice device );
+
+    //Destruye todos los módulos
+    void destroy ( );
+
+    //Desde cualquier hilo. Cada ruta se lee una sola vez
+    ShaderModule load ( const std::string& path );
+
+    //SPIR-V ya en memoria. Contenidos iguales comparten módulo
+    ShaderModule create ( const void* code, size_t size );
+
+    size_t moduleCount ( ) const;
+
+  private:
+    ShaderModule createLocked ( const void* code, size_t size );
+
+    VkDevice _device = VK_NULL_HANDLE;
+
+    mutable std::mutex _mutex;
+    std::unordered_map < std::string, ShaderModule > _byPath;
+    std::unordered_map < uint64_t, ShaderModule > _byHash;
+};
+
+#endif //VKSHADERLIBRARY_H
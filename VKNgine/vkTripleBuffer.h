@@ -0,0 +1,78 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKTRIPLEBUFFER_H
+#define VKTRIPLEBUFFER_H
+
+#include <atomic>
+#include <cstdint>
+
+//Intercambio sin bloqueos entre un productor y un consumidor. El productor
+//rellena writeBuffer ( ) y lo publica; el consumidor toma siempre el último
+//publicado. Ninguno de los dos espera nunca al otro.
+template < typename T >
+class TripleBuffer
+{
+  public:
+    T& writeBuffer ( )
+    {
+      return _buffers[_back];
+    }
+
+    void publish ( )
+    {
+      _back = _shared.exchange ( _back | DIRTY_BIT,
+                                 std::memory_order_acq_rel ) & INDEX_MASK;
+    }
+
+    //true si hay un buffer nuevo desde la última llamada
+    bool acquire ( )
+    {
+      if ( !( _shared.load ( std::memory_order_relaxed ) & DIRTY_BIT ))
+        return false;
+
+      _front = _shared.exchange ( _front,
+                                  std::memory_order_acq_rel ) & INDEX_MASK;
+      return true;
+    }
+
+    const T& readBuffer ( ) const
+    {
+      return _buffers[_front];
+    }
+
+  private:
+    enum : uint8_t
+    {
+      INDEX_MASK = 0x3,
+      DIRTY_BIT = 0x4
+    };
+
+    T _buffers[3];
+
+    //Índice compartido (+ bit de nuevo); _back solo lo toca el productor
+    //y _front solo el consumidor
+    std::atomic < uint8_t > _shared { 1 };
+    uint8_t _back = 0;
+    uint8_t _front = 2;
+};
+
+#endif //VKTRIPLEBUFFER_H
@@ -0,0 +1,172 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include "vkWorkerPool.h"
+
+#include <algorithm>
+
+WorkerPool::~WorkerPool ( )
+{
+  stop ( );
+}
+
+void WorkerPool::start ( uint32_t threadCount )
+{
+  stop ( );
+
+  //Tras un stop ( ) la generación ya no es 0: los hilos nuevos no deben
+  //ejecutar el último trabajo (ya terminado)
+  uint64_t generation = 0;
+  {
+    std::lock_guard < std::mutex > lock ( _mutex );
+    _stopping = false;
+    generation = _generation;
+  }
+  for ( uint32_t i = 0; i < threadCount; i++ )
+  {
+    _threads.emplace_back ( &WorkerPool::workerLoop, this, i + 1, generation );
+  }
+}
+
+void WorkerPool::stop ( )
+{
+  {
+    std::lock_guard < std::mutex > lock ( _mutex );
+    _stopping = true;
+  }
+  _wake.notify_all ( );
+
+  for ( auto& thread : _threads )
+  {
+    thread.join ( );
+  }
+  _threads.clear ( );
+}
+
+uint32_t WorkerPool::workerCount ( ) const
+{
+  return static_cast<uint32_t>(_threads.size ( )) + 1;
+}
+
+void WorkerPool::parallelFor ( size_t count,
+                               size_t minPerWorker,
+                               const RangeTask& task )
+{
+  if ( count == 0 )
+  {
+    return;
+  }
+
+  size_t workers = workerCount ( );
+  size_t chunk = std::max ( std::max ( minPerWorker, size_t ( 1 )),
+                            ( count + workers - 1 ) / workers );
+
+  //Poco trabajo: no compensa despertar a nadie
+  if ( chunk >= count )
+  {
+    task ( 0, count, 0 );
+    return;
+  }
+
+  {
+    std::lock_guard < std::mutex > lock ( _mutex );
+    _task = &task;
+    _count = count;
+    _chunk = chunk;
+    _pending = static_cast<uint32_t>(_threads.size ( ));
+    _error = nullptr;
+    _generation++;
+  }
+  _wake.notify_all ( );
+
+  std::exception_ptr error;
+  try
+  {
+    runRange ( 0 );
+  }
+  catch ( ... )
+  {
+    error = std::current_exception ( );
+  }
+
+  std::unique_lock < std::mutex > lock ( _mutex );
+  _done.wait ( lock, [this] ( ) { return _pending == 0; } );
+  _task = nullptr;
+
+  if ( !error )
+  {
+    error = _error;
+  }
+  lock.unlock ( );
+
+  if ( error )
+  {
+    std::rethrow_exception ( error );
+  }
+}
+
+void WorkerPool::workerLoop ( uint32_t worker, uint64_t generation )
+{
+  std::unique_lock < std::mutex > lock ( _mutex );
+
+  while ( true )
+  {
+    _wake.wait ( lock, [&] ( )
+    {
+      return _stopping || _generation != generation;
+    } );
+    if ( _stopping )
+    {
+      return;
+    }
+    generation = _generation;
+
+    lock.unlock ( );
+    std::exception_ptr error;
+    try
+    {
+      runRange ( worker );
+    }
+    catch ( ... )
+    {
+      error = std::current_exception ( );
+    }
+    lock.lock ( );
+
+    if ( error && !_error )
+    {
+      _error = error;
+    }
+    if ( --_pending == 0 )
+    {
+      _done.notify_one ( );
+    }
+  }
+}
+
+void WorkerPool::runRange ( uint32_t worker )
+{
+  size_t begin = worker * _chunk;
+  if ( begin < _count )
+  {
+    ( *_task ) ( begin, std::min ( begin + _chunk, _count ), worker );
+  }
+}
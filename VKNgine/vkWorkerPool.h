@@ -0,0 +1,83 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#ifndef VKWORKERPOOL_H
+#define VKWORKERPOOL_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+//Hilos persistentes para repartir trabajo por tramos. El hilo que llama a
+//parallelFor también trabaja (es el worker 0)
+class WorkerPool
+{
+  public:
+    typedef std::function < void ( size_t begin,
+                                   size_t end,
+                                   uint32_t worker ) > RangeTask;
+
+    ~WorkerPool ( );
+
+    //threadCount hilos además del llamante (0: todo en el llamante)
+    void start ( uint32_t threadCount );
+
+    void stop ( );
+
+    //Workers que participan en parallelFor, incluido el llamante
+    uint32_t workerCount ( ) const;
+
+    //Reparte [0, count) en un tramo contiguo por worker (al menos
+    //minPerWorker elementos cada uno) y bloquea hasta que terminan todos.
+    //Las excepciones de los workers se relanzan aquí. No es reentrante
+    void parallelFor ( size_t count,
+                       size_t minPerWorker,
+                       const RangeTask &task );
+
+  private:
+    //generation: la del pool al crear el hilo. Solo se atienden los
+    //parallelFor posteriores
+    void workerLoop ( uint32_t worker, uint64_t generation );
+
+    void runRange ( uint32_t worker );
+
+    std::vector < std::thread > _threads;
+
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _done;
+
+    //Trabajo en curso
+    const RangeTask *_task = nullptr;
+    size_t _count = 0;
+    size_t _chunk = 0;
+    uint64_t _generation = 0;
+    uint32_t _pending = 0;
+    bool _stopping = false;
+    std::exception_ptr _error;
+};
+
+#endif //VKWORKERPOOL_H
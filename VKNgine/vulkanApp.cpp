@@ -20,9 +20,7 @@
 */
 
 #include "vulkanApp.h"
-
-const int WIDTH = 800;
-const int HEIGHT = 600;
+#include "vkHash.h"
 
 const std::string MODEL_PATH = "./content/models/chalet.obj";
 const std::string TEXTURE_PATH = "./content/textures/chalet.jpg";
@@ -36,14 +34,176 @@ const std::vector < const char* > deviceExtensions = {
   VK_KHR_SWAPCHAIN_EXTENSION_NAME
 };
 
+//Cada tramo del buffer indirecto empieza por el contador de draws
+const VkDeviceSize INDIRECT_COMMANDS_OFFSET = 16;
+
+//Niveles de la pirámide HiZ (hasta 32768 de lado)
+const uint32_t MAX_HIZ_LEVELS = 16;
+//Tamaño del grupo de cull.comp
+const uint32_t CULL_GROUP_SIZE = 64;
+
+//Segundos entre guardados de la pipeline cache durante la ejecución
+const double PIPELINE_CACHE_SAVE_INTERVAL = 30.0;
+
+vulkanApp::vulkanApp ( bool headless, uint32_t width, uint32_t height )
+  : _headless ( headless )
+{
+  _windowWidth = static_cast<int>(width);
+  _windowHeight = static_cast<int>(height);
+}
+
 void vulkanApp::run ( )
 {
-  initWindow ( );
+  if ( !_headless )
+  {
+    initWindow ( );
+  }
   initVulkan ( );
-  mainLoop ( );
+
+  //Un error en el bucle o en el hilo de render también libera el
+  //dispositivo (y guarda la pipeline cache) antes de propagarse
+  try
+  {
+    mainLoop ( );
+  }
+  catch ( ... )
+  {
+    try
+    {
+      vkDeviceWaitIdle ( _device );
+      cleanup ( );
+    }
+    catch ( const std::exception& error )
+    {
+      std::cerr << "failed to clean up after error: " << error.what ( )
+                << std::endl;
+    }
+    throw;
+  }
   cleanup ( );
 }
 
+bool vulkanApp::isHeadless ( ) const
+{
+  return _headless;
+}
+
+void vulkanApp::setFrameOutput ( const std::string& prefix )
+{
+  _frameOutputPrefix = prefix;
+}
+
+void vulkanApp::setFrameLimit ( uint64_t frames )
+{
+  _frameLimit = frames;
+}
+
+void vulkanApp::requestStop ( )
+{
+  _running = false;
+}
+
+void vulkanApp::setFramesInFlight ( uint32_t count )
+{
+  _framesInFlight = std::max ( count, 1u );
+}
+
+//Se puede llamar desde cualquier hilo: se aplica en el siguiente frame
+void vulkanApp::setPresentPolicy ( PresentPolicy policy, double maxFps )
+{
+  _requestedPolicy = policy;
+  _requestedMaxFps = maxFps;
+  _presentPolicyChanged = true;
+}
+
+PresentPolicy vulkanApp::presentPolicy ( ) const
+{
+  return _requestedPolicy;
+}
+
+FrameTimingStats vulkanApp::frameTimingStats ( ) const
+{
+  std::lock_guard < std::mutex > lock ( _frameTimingMutex );
+  return _frameTiming;
+}
+
+void vulkanApp::setSimulationRate ( double hz )
+{
+  _simulationStep = hz > 0.0 ? 1.0 / hz : 0.0;
+}
+
+void vulkanApp::setFixedTimeStep ( double seconds )
+{
+  _fixedTimeStep = std::max ( seconds, 0.0 );
+}
+
+void vulkanApp::setCameraPath ( CameraPath path )
+{
+  _cameraPath = path;
+}
+
+void vulkanApp::setInstanceUpdater ( InstanceUpdater updater )
+{
+  _instanceUpdater = updater;
+}
+
+void vulkanApp::setFrameStatsCallback ( FrameStatsCallback callback )
+{
+  _frameStatsCallback = callback;
+}
+
+void vulkanApp::setRecordThreads ( int threads )
+{
+  _recordThreads = threads;
+}
+
+void vulkanApp::setGpuStatistics ( bool enable )
+{
+  _gpuStatistics = enable;
+}
+
+void vulkanApp::setDrawPath ( DrawPath path, uint32_t maxDraws )
+{
+  _drawPath = path;
+  _maxIndirectDraws = std::max < uint32_t > ( maxDraws, 1 );
+}
+
+void vulkanApp::setOcclusionCulling ( bool enable )
+{
+  _occlusionCulling = enable;
+}
+
+void vulkanApp::setCpuCulling ( bool enable )
+{
+  _cpuCulling = enable;
+}
+
+void vulkanApp::setCommandBufferReuse ( bool enable )
+{
+  _commandBufferReuse = enable;
+}
+
+void vulkanApp::setPipelineCachePath ( const std::string& path )
+{
+  _pipelineCachePath = path;
+}
+
+std::vector < GpuScopeResult > vulkanApp::gpuProfile ( ) const
+{
+  return _gpuProfiler.results ( );
+}
+
+//Hilo de render: la política pedida pasa a ser la activa
+void vulkanApp::applyPresentPolicy ( )
+{
+  _presentPolicyChanged = false;
+  _presentPolicy = _requestedPolicy;
+
+  double maxFps = _requestedMaxFps;
+  _framePacer.setTargetFrameTime (
+    _presentPolicy == PRESENT_FRAME_CAP && maxFps > 0.0 ? 1.0 / maxFps : 0.0 );
+}
+
 void vulkanApp::initWindow ( )
 {
   //Inicializacion glfw3
@@ -53,9 +213,7 @@ void vulkanApp::initWindow ( )
   glfwWindowHint ( GLFW_CLIENT_API, GLFW_NO_API );
 
   //Creacion de la ventana (ultimos params, monitor y params para ogl)
-  _window = glfwCreateWindow ( WIDTH, HEIGHT, "Vulkan", nullptr, nullptr );
-
-
+  _window = glfwCreateWindow ( _windowWidth, _windowHeight, "Vulkan", nullptr, nullptr );
 
   glfwSetWindowUserPointer ( _window, this );
   glfwSetWindowSizeCallback ( _window,
@@ -67,37 +225,82 @@ void vulkanApp::initVulkan ( )
   //Init
   createInstance ( );
   setupDebugCallback ( );
-  createSurface ( );
+  if ( !_headless )
+  {
+    createSurface ( );
+  }
   pickPhysicalDevice ( );
   createLogicalDevice ( );
+  _pipelineCache.init ( _physicalDevice, _device, _pipelineCachePath );
+
+  //Workers de grabación: el hilo principal y el de render ya están
+  //ocupados. Antes de los pipelines, que también se compilan con ellos
+  uint32_t threads = _recordThreads >= 0
+    ? static_cast<uint32_t>(_recordThreads)
+    : std::max ( std::thread::hardware_concurrency ( ), 2u ) - 2;
+  _recordWorkers.start ( threads );
+  _pipelineRegistry.init ( _device, _pipelineCache.handle ( ), &_recordWorkers );
+  _shaderLibrary.init ( _device );
 
   //Renderconfig
-  createSwapChain ( );
+  if ( _headless )
+  {
+    createOffscreenTargets ( );
+  }
+  else
+  {
+    createSwapChain ( );
+  }
   createRenderPass ( );
   createGraphicsPipeline ( );
 
   //Commands
   createCommandPool ( );
 
+  //Todas las subidas de arranque se graban en un único lote
+  UploadBatch startupBatch;
+  beginUploadBatch ( startupBatch );
+
   createDepthResources ( );
   createFramebuffers ( );
 
-  createTextureImage ( );
+  createTextureImage ( startupBatch );
   createTextureImageView ( );
   createTextureSampler ( );
 
   //Scene elements and synch!
   loadModel ( );
 
-  createVertexBuffer ( );
-  createIndexBuffer ( );
+  createVertexBuffer ( startupBatch );
+  createIndexBuffer ( startupBatch );
+
+  //Un solo envío; el resto de la inicialización se solapa con la copia
+  submitUploadBatch ( startupBatch );
+
   createUniformBuffer ( );
+  createIndirectBuffers ( );
 
   createDescriptorPool ( );
   createDescriptorSet ( );
 
-  createCommandBuffers ( );
+  if ( _drawPath == DRAW_GPU_CULLED )
+  {
+    createCullingResources ( );
+  }
+
   createSemaphores ( );
+  createCommandBuffers ( );
+
+  _gpuProfiler.init ( _physicalDevice,
+                      _device,
+                      _queueFamilyIndices._graphicsFamily,
+                      _framesInFlight,
+                      _gpuStatistics );
+
+  //Triple buffer: hasta tres lecturas en vuelo sin bloquear
+  createReadbackRing ( 3 );
+
+  waitUploadBatch ( startupBatch );
 }
 
 //1)Creación de la instancia de la aplicación
@@ -115,7 +318,7 @@ void vulkanApp::createInstance ( )
   appInfo.applicationVersion = VK_MAKE_VERSION ( 1, 0, 0 );
   appInfo.pEngineName = "No Engine";
   appInfo.engineVersion = VK_MAKE_VERSION ( 1, 0, 0 );
-  appInfo.apiVersion = VK_API_VERSION_1_0;
+  appInfo.apiVersion = VK_API_VERSION_1_2;
 
   VkInstanceCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_INSTANCE_CREATE_INFO;
@@ -209,19 +412,33 @@ void vulkanApp::pickPhysicalDevice ( )
 void vulkanApp::createLogicalDevice ( )
 {
   QueueFamilyIndices lindices = findQueueFamilies ( _physicalDevice );
+  _queueFamilyIndices = lindices;
 
   std::vector < VkDeviceQueueCreateInfo > queueCreateInfos;
   std::set < int > uniqueQueueFamilies =
-    { lindices._graphicsFamily, lindices._presentFamily };
-
-  float queuePriority = 1.0f;
+    { lindices._graphicsFamily,
+      lindices._presentFamily,
+      lindices._transferFamily };
+
+  //La cola de transferencia tiene menos prioridad que la de render, tanto
+  //si comparte familia con la gráfica (es la segunda) como si es dedicada
+  float graphicsPriorities[] = { 1.0f, 0.5f };
+  float transferPriorities[] = { 0.5f };
   for ( int queueFamily : uniqueQueueFamilies )
   {
     VkDeviceQueueCreateInfo queueCreateInfo = {};
     queueCreateInfo.sType = VK_STRUCTURE_TYPE_DEVICE_QUEUE_CREATE_INFO;
     queueCreateInfo.queueFamilyIndex = queueFamily;
     queueCreateInfo.queueCount = 1;
-    queueCreateInfo.pQueuePriorities = &queuePriority;
+    if ( queueFamily == lindices._transferFamily )
+    {
+      queueCreateInfo.queueCount = lindices._transferQueueIndex + 1;
+    }
+    queueCreateInfo.pQueuePriorities =
+      queueFamily == lindices._transferFamily
+        && queueFamily != lindices._graphicsFamily
+      ? transferPriorities
+      : graphicsPriorities;
     queueCreateInfos.push_back ( queueCreateInfo );
   }
 
@@ -229,6 +446,43 @@ void vulkanApp::createLogicalDevice ( )
   deviceFeatures.samplerAnisotropy = VK_TRUE;
   deviceFeatures.geometryShader = VK_TRUE;
 
+  VkPhysicalDeviceFeatures supportedFeatures;
+  vkGetPhysicalDeviceFeatures ( _physicalDevice, &supportedFeatures );
+
+  VkPhysicalDeviceVulkan12Features supported12 = {};
+  supported12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  VkPhysicalDeviceFeatures2 supported2 = {};
+  supported2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  supported2.pNext = &supported12;
+  vkGetPhysicalDeviceFeatures2 ( _physicalDevice, &supported2 );
+
+  //Camino indirecto: cada comando selecciona su objeto con firstInstance.
+  //Sin esa característica se vuelve al camino directo
+  if ( _drawPath != DRAW_DIRECT
+    && supportedFeatures.drawIndirectFirstInstance != VK_TRUE )
+  {
+    _drawPath = DRAW_DIRECT;
+  }
+  _occlusionCulling = _occlusionCulling && _drawPath == DRAW_GPU_CULLED;
+  deviceFeatures.drawIndirectFirstInstance =
+    supportedFeatures.drawIndirectFirstInstance;
+  _multiDrawIndirect = supportedFeatures.multiDrawIndirect == VK_TRUE;
+  deviceFeatures.multiDrawIndirect = supportedFeatures.multiDrawIndirect;
+  _drawIndirectCount = supported12.drawIndirectCount == VK_TRUE;
+
+  //Estadísticas de pipeline para el profiler, solo si se piden
+  if ( _gpuStatistics )
+  {
+    _gpuStatistics = supportedFeatures.pipelineStatisticsQuery == VK_TRUE;
+    deviceFeatures.pipelineStatisticsQuery = supportedFeatures.pipelineStatisticsQuery;
+
+    //Sin inheritedQueries no se pueden ejecutar secundarios con una
+    //consulta activa
+    _inheritedQueries = _gpuStatistics
+      && supportedFeatures.inheritedQueries == VK_TRUE;
+    deviceFeatures.inheritedQueries = _inheritedQueries ? VK_TRUE : VK_FALSE;
+  }
+
   VkDeviceCreateInfo createInfo = {};
   createInfo.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
 
@@ -236,11 +490,24 @@ void vulkanApp::createLogicalDevice ( )
     static_cast<uint32_t>(queueCreateInfos.size ( ));
   createInfo.pQueueCreateInfos = queueCreateInfos.data ( );
 
-  createInfo.pEnabledFeatures = &deviceFeatures;
+  //Timeline semaphores (core en 1.2) para el seguimiento del trabajo GPU
+  VkPhysicalDeviceVulkan12Features features12 = {};
+  features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  features12.timelineSemaphore = VK_TRUE;
+  features12.drawIndirectCount = _drawIndirectCount ? VK_TRUE : VK_FALSE;
+
+  VkPhysicalDeviceFeatures2 deviceFeatures2 = {};
+  deviceFeatures2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  deviceFeatures2.pNext = &features12;
+  deviceFeatures2.features = deviceFeatures;
 
+  createInfo.pNext = &deviceFeatures2;
+  createInfo.pEnabledFeatures = nullptr;
+
+  std::vector < const char* > extensions = getRequiredDeviceExtensions ( );
   createInfo.enabledExtensionCount =
-    static_cast<uint32_t>(deviceExtensions.size ( ));
-  createInfo.ppEnabledExtensionNames = deviceExtensions.data ( );
+    static_cast<uint32_t>(extensions.size ( ));
+  createInfo.ppEnabledExtensionNames = extensions.data ( );
 
   if ( enableValidationLayers )
   {
@@ -261,14 +528,26 @@ void vulkanApp::createLogicalDevice ( )
 
   vkGetDeviceQueue ( _device, lindices._graphicsFamily, 0, &_graphicsQueue );
   vkGetDeviceQueue ( _device, lindices._presentFamily, 0, &_presentQueue );
+  vkGetDeviceQueue ( _device,
+                     lindices._transferFamily,
+                     lindices._transferQueueIndex,
+                     &_transferQueue );
+
+  _graphicsTimeline.init ( _device, _graphicsQueue );
+  if ( _transferQueue != _graphicsQueue )
+  {
+    _transferTimeline.init ( _device, _transferQueue );
+  }
 }
 
 //6) Creación de la SwapChain!!!
-void vulkanApp::createSwapChain ( )
+void vulkanApp::createSwapChain ( VkSwapchainKHR oldSwapChain )
 {
   SwapChainSupportDetails
     swapChainSupport = querySwapChainSupport ( _physicalDevice );
 
+  applyPresentPolicy ( );
+
   //Format, presenta y extend se hace desde los SwapChainSupportDetails!!
   VkSurfaceFormatKHR surfaceFormat = chooseSwapSurfaceFormat ( swapChainSupport._formats );
   VkPresentModeKHR   presentMode = chooseSwapPresentMode ( swapChainSupport._presentModes );
@@ -295,6 +574,14 @@ void vulkanApp::createSwapChain ( )
   // stereo o multitile
   createInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT; //Este valor
 
+  //Para poder leer los frames presentados (readbackSwapChain)
+  _swapChainReadable = ( swapChainSupport._capabilities.supportedUsageFlags
+    & VK_IMAGE_USAGE_TRANSFER_SRC_BIT ) != 0;
+  if ( _swapChainReadable )
+  {
+    createInfo.imageUsage |= VK_IMAGE_USAGE_TRANSFER_SRC_BIT;
+  }
+
 
   QueueFamilyIndices lindices = findQueueFamilies ( _physicalDevice );
   uint32_t queueFamilyIndices[] = { ( uint32_t ) lindices._graphicsFamily,
@@ -317,12 +604,15 @@ void vulkanApp::createSwapChain ( )
 
   createInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 
-  //Modo presentacion (mail-box por defecto)
+  //Modo presentacion según la política (mail-box por defecto)
   createInfo.presentMode = presentMode;
 
   //Activar clipping
   createInfo.clipped = VK_TRUE;
 
+  //Al recrear, la antigua sigue presentando lo que tenga en cola
+  createInfo.oldSwapchain = oldSwapChain;
+
   //Se crea la _swapChain al ginal
   if ( vkCreateSwapchainKHR ( _device, &createInfo, nullptr, &_swapChain )
     != VK_SUCCESS )
@@ -337,6 +627,25 @@ void vulkanApp::createSwapChain ( )
                             &imageCount,
                             _swapChainImages.data ( ));
 
+  for ( VkImage image : _swapChainImages )
+  {
+    _imageTracker.registerImage ( image, VK_IMAGE_ASPECT_COLOR_BIT, 1, 1 );
+  }
+
+  VkSemaphoreCreateInfo semaphoreInfo = {};
+  semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+
+  _renderFinishedSemaphores.resize ( imageCount );
+  for ( auto& semaphore : _renderFinishedSemaphores )
+  {
+    if ( vkCreateSemaphore ( _device, &semaphoreInfo, nullptr, &semaphore )
+      != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to create semaphores!" );
+    }
+  }
+  _imagesInFlight.assign ( imageCount, 0 );
+
   _swapChainImageFormat = surfaceFormat.format;
   _swapChainExtent = extent;
 
@@ -345,6 +654,43 @@ void vulkanApp::createSwapChain ( )
 
 }
 
+//6b) Headless: imágenes offscreen en lugar de la swapchain, una por frame en
+//vuelo para que la copia de un frame no compita con el render del siguiente
+void vulkanApp::createOffscreenTargets ( )
+{
+  applyPresentPolicy ( );
+
+  _swapChainImageFormat = VK_FORMAT_R8G8B8A8_UNORM;
+  _swapChainExtent.width = static_cast<uint32_t>(_windowWidth);
+  _swapChainExtent.height = static_cast<uint32_t>(_windowHeight);
+  _swapChainReadable = true;
+
+  _swapChainImages.resize ( _framesInFlight );
+  _offscreenImageMemory.resize ( _framesInFlight );
+  for ( uint32_t i = 0; i < _framesInFlight; i++ )
+  {
+    createImage ( _swapChainExtent.width,
+                  _swapChainExtent.height,
+                  _swapChainImageFormat,
+                  VK_IMAGE_TILING_OPTIMAL,
+                  VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT
+                  | VK_IMAGE_USAGE_TRANSFER_SRC_BIT,
+                  VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                  _swapChainImages[i],
+                  _offscreenImageMemory[i] );
+  }
+  _imagesInFlight.assign ( _framesInFlight, 0 );
+
+  createImageViews ( );
+}
+
+//Layout en el que el render pass deja la imagen de color
+VkImageLayout vulkanApp::renderedColorLayout ( ) const
+{
+  return _headless ? VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL
+                   : VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+}
+
 //7 Render pass
 void vulkanApp::createRenderPass ( )
 {
@@ -360,14 +706,17 @@ void vulkanApp::createRenderPass ( )
   colorAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   colorAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   colorAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-  colorAttachment.finalLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+  colorAttachment.finalLayout = renderedColorLayout ( );
 
   //Profundidad
   VkAttachmentDescription depthAttachment = {};
   depthAttachment.format = findDepthFormat ( );
   depthAttachment.samples = VK_SAMPLE_COUNT_1_BIT;
   depthAttachment.loadOp = VK_ATTACHMENT_LOAD_OP_CLEAR;
-  depthAttachment.storeOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
+  //La pirámide HiZ se construye con el depth al acabar el pase
+  depthAttachment.storeOp = _occlusionCulling
+                            ? VK_ATTACHMENT_STORE_OP_STORE
+                            : VK_ATTACHMENT_STORE_OP_DONT_CARE;
   depthAttachment.stencilLoadOp = VK_ATTACHMENT_LOAD_OP_DONT_CARE;
   depthAttachment.stencilStoreOp = VK_ATTACHMENT_STORE_OP_DONT_CARE;
   depthAttachment.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -395,12 +744,19 @@ void vulkanApp::createRenderPass ( )
   dependency.srcSubpass = VK_SUBPASS_EXTERNAL;
   dependency.dstSubpass = 0;
 
-  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
-  dependency.srcAccessMask = 0;
+  //El depth es único para todos los frames en vuelo: el clear de un frame
+  //espera a los tests de profundidad del anterior (y a la lectura de la
+  //pirámide HiZ)
+  dependency.srcStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+    | VK_PIPELINE_STAGE_LATE_FRAGMENT_TESTS_BIT
+    | VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  dependency.srcAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
-  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  dependency.dstStageMask = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT
+    | VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
   dependency.dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT
-    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+    | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT
+    | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
 
   std::array < VkAttachmentDescription, 2 >
     attachments = { colorAttachment, depthAttachment };
@@ -428,7 +784,7 @@ void vulkanApp::createDescriptorSetLayout ( )
   VkDescriptorSetLayoutBinding uboLayoutBinding = {};
   uboLayoutBinding.binding = 0;
   uboLayoutBinding.descriptorCount = 1;
-  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  uboLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   uboLayoutBinding.pImmutableSamplers = nullptr;
   uboLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
 
@@ -439,7 +795,17 @@ void vulkanApp::createDescriptorSetLayout ( )
   samplerLayoutBinding.pImmutableSamplers = nullptr;
   samplerLayoutBinding.stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
 
-  std::array < VkDescriptorSetLayoutBinding, 2 > bindings = { uboLayoutBinding, samplerLayoutBinding };
+  //Transformaciones del camino indirecto, tramo del frame por offset
+  VkDescriptorSetLayoutBinding objectLayoutBinding = {};
+  objectLayoutBinding.binding = 2;
+  objectLayoutBinding.descriptorCount = 1;
+  objectLayoutBinding.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  objectLayoutBinding.pImmutableSamplers = nullptr;
+  objectLayoutBinding.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+
+  std::array < VkDescriptorSetLayoutBinding, 3 > bindings = { uboLayoutBinding,
+                                                              samplerLayoutBinding,
+                                                              objectLayoutBinding };
   VkDescriptorSetLayoutCreateInfo layoutInfo = {};
   layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
   layoutInfo.bindingCount = static_cast<uint32_t>(bindings.size ( ));
@@ -458,136 +824,10 @@ void vulkanApp::createDescriptorSetLayout ( )
 //9) Creación del pipeline gráfico
 void vulkanApp::createGraphicsPipeline ( )
 {
-  //Ya están los shaders compilados
-  std::vector < char > vertShaderCode = readFile ( "./content/vk_shaders/geompassthrough/vert.spv" );
-  std::vector < char > geomShaderCode = readFile ( "./content/vk_shaders/geompassthrough/geom.spv" );
-  std::vector < char > fragShaderCode = readFile ( "./content/vk_shaders/geompassthrough/frag.spv" );
-
-  VkShaderModule vertShaderModule = createShaderModule ( vertShaderCode );
-  VkShaderModule geomShaderModule = createShaderModule ( geomShaderCode );
-  VkShaderModule fragShaderModule = createShaderModule ( fragShaderCode );
-
-  //Generacion y configuracion de cada una de las stages del pipeline
-  VkPipelineShaderStageCreateInfo vertShaderStageInfo = {};
-  vertShaderStageInfo.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  vertShaderStageInfo.stage = VK_SHADER_STAGE_VERTEX_BIT;
-  vertShaderStageInfo.module = vertShaderModule;
-  vertShaderStageInfo.pName = "main";
-
-  VkPipelineShaderStageCreateInfo geomShaderStageInfo = {};
-  geomShaderStageInfo.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  geomShaderStageInfo.stage = VK_SHADER_STAGE_GEOMETRY_BIT;
-  geomShaderStageInfo.module = geomShaderModule;
-  geomShaderStageInfo.pName = "main";
-
-  VkPipelineShaderStageCreateInfo fragShaderStageInfo = {};
-  fragShaderStageInfo.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
-  fragShaderStageInfo.stage = VK_SHADER_STAGE_FRAGMENT_BIT;
-  fragShaderStageInfo.module = fragShaderModule;
-  fragShaderStageInfo.pName = "main";
-
-  //Generacion de las stages del pipeline
-  VkPipelineShaderStageCreateInfo
-    shaderStages[] = { vertShaderStageInfo, geomShaderStageInfo, fragShaderStageInfo };
-
-  //Estas son todas las funciones fijas dentro del pipeline, que hay que
-  //configurarlas de manera explicita.
-
-  //Vertex Input: Espaceado de los vértices en los mallados a renderizar
-  //------------------------------------------------------
-  VkPipelineVertexInputStateCreateInfo vertexInputInfo = {};
-  vertexInputInfo.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_VERTEX_INPUT_STATE_CREATE_INFO;
-
-  //Bindings y attributes (hay que pasarlos como vectores de estructuras)
-  auto bindingDescription = Vertex::getBindingDescription ( );
-  auto attributeDescriptions = Vertex::getAttributeDescriptions ( );
-
-  vertexInputInfo.vertexBindingDescriptionCount = 1;
-  vertexInputInfo.vertexAttributeDescriptionCount = static_cast<uint32_t>(attributeDescriptions.size ( ));
-  vertexInputInfo.pVertexBindingDescriptions = &bindingDescription;
-  vertexInputInfo.pVertexAttributeDescriptions = attributeDescriptions.data ( );
-  //------------------------------------------------------
-  //Input assembly: Definición de topología
-  VkPipelineInputAssemblyStateCreateInfo inputAssembly = {};
-  inputAssembly.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_INPUT_ASSEMBLY_STATE_CREATE_INFO;
-  inputAssembly.topology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
-  inputAssembly.primitiveRestartEnable = VK_FALSE;
-
-  //El viewport (VkPipelineViewportStateCreateInfo) Se genera configurando el viewport y el scissor
-  VkViewport viewport = {};
-  viewport.x = 0.0f;
-  viewport.y = 0.0f;
-  viewport.width = ( float ) _swapChainExtent.width;
-  viewport.height = ( float ) _swapChainExtent.height;
-  viewport.minDepth = 0.0f;
-  viewport.maxDepth = 1.0f;
-
-  VkRect2D scissor = {};
-  scissor.offset = { 0, 0 };
-  scissor.extent = _swapChainExtent;
-
-  VkPipelineViewportStateCreateInfo viewportState = {};
-  viewportState.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_VIEWPORT_STATE_CREATE_INFO;
-  viewportState.viewportCount = 1;
-  viewportState.pViewports = &viewport;
-  viewportState.scissorCount = 1;
-  viewportState.pScissors = &scissor;
-
-  //Raster
-  VkPipelineRasterizationStateCreateInfo rasterizer = {};
-  rasterizer.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_RASTERIZATION_STATE_CREATE_INFO;
-  rasterizer.depthClampEnable = VK_FALSE;
-  rasterizer.rasterizerDiscardEnable = VK_FALSE;
-  rasterizer.polygonMode = VK_POLYGON_MODE_FILL;
-  rasterizer.lineWidth = 1.0f;
-  rasterizer.cullMode = VK_CULL_MODE_BACK_BIT;
-  rasterizer.frontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
-  rasterizer.depthBiasEnable = VK_FALSE;
-
-  //Multisample
-  VkPipelineMultisampleStateCreateInfo multisampling = {};
-  multisampling.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_MULTISAMPLE_STATE_CREATE_INFO;
-  multisampling.sampleShadingEnable = VK_FALSE;
-  multisampling.rasterizationSamples = VK_SAMPLE_COUNT_1_BIT;
-
-  //Deph and stencil
-  VkPipelineDepthStencilStateCreateInfo depthStencil = {};
-  depthStencil.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
-  depthStencil.depthTestEnable = VK_TRUE;
-  depthStencil.depthWriteEnable = VK_TRUE;
-  depthStencil.depthCompareOp = VK_COMPARE_OP_LESS;
-  depthStencil.depthBoundsTestEnable = VK_FALSE;
-  depthStencil.stencilTestEnable = VK_FALSE;
-
-
-  //Color blend (attachments and create info)
-  VkPipelineColorBlendAttachmentState colorBlendAttachment = {};
-  colorBlendAttachment.colorWriteMask =
-    VK_COLOR_COMPONENT_R_BIT | VK_COLOR_COMPONENT_G_BIT
-      | VK_COLOR_COMPONENT_B_BIT | VK_COLOR_COMPONENT_A_BIT;
-  colorBlendAttachment.blendEnable = VK_FALSE;
-
-  VkPipelineColorBlendStateCreateInfo colorBlending = {};
-  colorBlending.sType =
-    VK_STRUCTURE_TYPE_PIPELINE_COLOR_BLEND_STATE_CREATE_INFO;
-  colorBlending.logicOpEnable = VK_FALSE;
-  colorBlending.logicOp = VK_LOGIC_OP_COPY;
-  colorBlending.attachmentCount = 1;
-  colorBlending.pAttachments = &colorBlendAttachment;
-  colorBlending.blendConstants[0] = 0.0f;
-  colorBlending.blendConstants[1] = 0.0f;
-  colorBlending.blendConstants[2] = 0.0f;
-  colorBlending.blendConstants[3] = 0.0f;
-
+  //Ya están los shaders compilados (y cargados tras la primera vez)
+  ShaderModule vertShader = _shaderLibrary.load ( "./content/vk_shaders/geompassthrough/vert.spv" );
+  ShaderModule geomShader = _shaderLibrary.load ( "./content/vk_shaders/geompassthrough/geom.spv" );
+  ShaderModule fragShader = _shaderLibrary.load ( "./content/vk_shaders/geompassthrough/frag.spv" );
 
   //Layout -> Manejo de los uniforms de los shaders
   if (!alreadyCreatedDSL)
@@ -602,6 +842,15 @@ void vulkanApp::createGraphicsPipeline ( )
   pipelineLayoutInfo.setLayoutCount = 1;
   pipelineLayoutInfo.pSetLayouts = &_descriptorSetLayout;
 
+  //Transformación por objeto sin tocar memoria ni descriptores
+  VkPushConstantRange pushConstantRange = {};
+  pushConstantRange.stageFlags = VK_SHADER_STAGE_VERTEX_BIT;
+  pushConstantRange.offset = 0;
+  pushConstantRange.size = sizeof ( ObjectPushConstants );
+
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &pushConstantRange;
+
   if ( vkCreatePipelineLayout ( _device,
                                 &pipelineLayoutInfo,
                                 nullptr,
@@ -610,53 +859,231 @@ void vulkanApp::createGraphicsPipeline ( )
     throw std::runtime_error ( "failed to create pipeline layout!" );
   }
 
-  VkGraphicsPipelineCreateInfo pipelineInfo = {};
-  pipelineInfo.sType = VK_STRUCTURE_TYPE_GRAPHICS_PIPELINE_CREATE_INFO;
-  pipelineInfo.stageCount = 3;
-  pipelineInfo.pStages = shaderStages;
-  pipelineInfo.pVertexInputState = &vertexInputInfo;
-  pipelineInfo.pInputAssemblyState = &inputAssembly;
-  pipelineInfo.pViewportState = &viewportState;
-  pipelineInfo.pRasterizationState = &rasterizer;
-  pipelineInfo.pMultisampleState = &multisampling;
-  pipelineInfo.pDepthStencilState = &depthStencil;
-  pipelineInfo.pColorBlendState = &colorBlending;
-  pipelineInfo.layout = _pipelineLayout;
-  pipelineInfo.renderPass = _renderPass;
-  pipelineInfo.subpass = 0;
-  pipelineInfo.basePipelineHandle = VK_NULL_HANDLE;
+  //Stages del pipeline: se identifican por el contenido del SPIR-V
+  PipelineShaderStage vertStage;
+  vertStage._stage = VK_SHADER_STAGE_VERTEX_BIT;
+  vertStage._module = vertShader._module;
+  vertStage._codeHash = vertShader._codeHash;
+
+  PipelineShaderStage geomStage;
+  geomStage._stage = VK_SHADER_STAGE_GEOMETRY_BIT;
+  geomStage._module = geomShader._module;
+  geomStage._codeHash = geomShader._codeHash;
 
-  if ( vkCreateGraphicsPipelines ( _device,
-                                   VK_NULL_HANDLE,
-                                   1,
-                                   &pipelineInfo,
-                                   nullptr,
-                                   &_graphicsPipeline ) != VK_SUCCESS )
+  PipelineShaderStage fragStage;
+  fragStage._stage = VK_SHADER_STAGE_FRAGMENT_BIT;
+  fragStage._module = fragShader._module;
+  fragStage._codeHash = fragShader._codeHash;
+
+  //El resto de funciones fijas (topología, raster, depth LESS, sin blend,
+  //viewport y scissor dinámicos) son los valores por defecto de la
+  //descripción
+  GraphicsPipelineDesc sceneDesc;
+  sceneDesc._stages = { vertStage, geomStage, fragStage };
+
+  //Vertex Input: Espaceado de los vértices en los mallados a renderizar
+  auto attributeDescriptions = Vertex::getAttributeDescriptions ( );
+  sceneDesc._bindings = { Vertex::getBindingDescription ( ) };
+  sceneDesc._attributes.assign ( attributeDescriptions.begin ( ),
+                                 attributeDescriptions.end ( ));
+  sceneDesc._layout = _pipelineLayout;
+  sceneDesc._renderPass = _renderPass;
+  sceneDesc._subpass = 0;
+
+  //Variante indirecta: la constante de especialización 0 hace que el
+  //vertex shader lea la transformación del storage buffer
+  //Un vert.spv anterior a la constante dibujaría todo con la matriz del
+  //push constant: mejor fallar al arrancar
+  if ( !vertShader.hasSpecConstant ( 0 ))
   {
-    throw std::runtime_error ( "failed to create graphics pipeline!" );
+    throw std::runtime_error ( "failed to create indirect pipeline: vert.spv lacks USE_OBJECT_BUFFER, rebuild the shaders!" );
   }
+  GraphicsPipelineDesc indirectDesc = sceneDesc;
+  indirectDesc._stages[0]._specialization = {{ 0, VK_TRUE }};
+
+  //Las variantes se compilan en paralelo con la pipeline cache compartida
+  PipelineHandle sceneHandle = _pipelineRegistry.request ( sceneDesc );
+  PipelineHandle indirectHandle = _pipelineRegistry.request ( indirectDesc );
+
+  //Variante instanciada: segundo binding con la transformación y el color
+  //de cada instancia. Solo hay instancias con un InstanceUpdater, sin él
+  //ni se carga vert_instanced.spv
+  PipelineHandle instancedHandle = PipelineRegistry::NO_PIPELINE;
+  if ( _instanceUpdater )
+  {
+    ShaderModule instancedShader = _shaderLibrary.load ( "./content/vk_shaders/geompassthrough/vert_instanced.spv" );
+
+    GraphicsPipelineDesc instancedDesc = sceneDesc;
+    instancedDesc._stages[0]._module = instancedShader._module;
+    instancedDesc._stages[0]._codeHash = instancedShader._codeHash;
+    instancedDesc._bindings.push_back ( InstanceData::getBindingDescription ( ));
+    auto instanceAttributes = InstanceData::getAttributeDescriptions ( );
+    instancedDesc._attributes.insert ( instancedDesc._attributes.end ( ),
+                                       instanceAttributes.begin ( ),
+                                       instanceAttributes.end ( ));
+    instancedHandle = _pipelineRegistry.request ( instancedDesc );
+  }
+  _pipelineRegistry.compilePending ( );
 
-  vkDestroyShaderModule ( _device, fragShaderModule, nullptr );
-  vkDestroyShaderModule ( _device, geomShaderModule, nullptr );
-  vkDestroyShaderModule ( _device, vertShaderModule, nullptr );
+  _graphicsPipeline = _pipelineRegistry.resolve ( sceneHandle );
+  _indirectPipeline = _pipelineRegistry.resolve ( indirectHandle );
+  _instancedPipeline = instancedHandle != PipelineRegistry::NO_PIPELINE
+                       ? _pipelineRegistry.resolve ( instancedHandle )
+                       : VK_NULL_HANDLE;
 }
 
 
+//Hilo principal: entrada y simulación. Publica un FrameSnapshot por paso
+//sin esperar nunca al render
 void vulkanApp::mainLoop ( )
 {
-  while ( !glfwWindowShouldClose ( _window ))
+  _running = true;
+  std::thread renderThread ( &vulkanApp::renderLoop, this );
+  std::chrono::steady_clock::time_point startTime =
+    std::chrono::steady_clock::now ( );
+
+  //Si falla la simulación el hilo de render se para antes de salir
+  try
+  {
+    while ( _running && ( _headless || !glfwWindowShouldClose ( _window )))
+    {
+      //Despierta con cada evento o, como muy tarde, en cada paso
+      if ( _headless )
+      {
+        //Sin eventos: el hilo de render decide cuándo acabar
+        if ( _simulationStep > 0.0 )
+        {
+          std::this_thread::sleep_for (
+            std::chrono::duration < double > ( _simulationStep ));
+        }
+        else
+        {
+          std::this_thread::yield ( );
+        }
+      }
+      else if ( _simulationStep > 0.0 )
+      {
+        glfwWaitEventsTimeout ( _simulationStep );
+      }
+      else
+      {
+        glfwPollEvents ( );
+      }
+
+      //Con paso fijo el snapshot lo genera el propio hilo de render
+      if ( _fixedTimeStep > 0.0 )
+      {
+        continue;
+      }
+
+      FrameSnapshot& snapshot = _snapshots.writeBuffer ( );
+      snapshot._inputTime = std::chrono::steady_clock::now ( );
+      snapshot._time = std::chrono::duration < double > (
+        snapshot._inputTime - startTime ).count ( );
+      updateScene ( snapshot );
+      snapshot._sequence = ++_snapshotSequence;
+      _snapshots.publish ( );
+    }
+  }
+  catch ( ... )
   {
-    glfwPollEvents ( );
+    _running = false;
+    renderThread.join ( );
+    throw;
+  }
 
-    updateUniformBuffer ( );
-    drawFrame ( );
+  _running = false;
+  renderThread.join ( );
+
+  if ( _renderError )
+  {
+    std::rethrow_exception ( _renderError );
   }
+}
+
+//Hilo de render: todo el trabajo Vulkan del bucle ocurre aquí
+void vulkanApp::renderLoop ( )
+{
+  try
+  {
+    bool hasSnapshot = false;
+    while ( _running )
+    {
+      //El limitador duerme antes de tomar el snapshot: así el estado
+      //usado es el más reciente posible
+      _framePacer.wait ( );
+
+      //Subidas en streaming: se retiran sin bloquear el render
+      retireUploads ( );
+      pollReadbacks ( );
+      _graphicsTimeline.collectGarbage ( );
+      _transferTimeline.collectGarbage ( );
+
+      const FrameSnapshot* snapshot = &_fixedStepSnapshot;
+      if ( _fixedTimeStep > 0.0 )
+      {
+        //El tiempo avanza con los frames renderizados, no con el reloj
+        _fixedStepSnapshot._inputTime = std::chrono::steady_clock::now ( );
+        _fixedStepSnapshot._time = _framesRendered * _fixedTimeStep;
+        updateScene ( _fixedStepSnapshot );
+        _fixedStepSnapshot._sequence = _framesRendered + 1;
+      }
+      else
+      {
+        hasSnapshot = _snapshots.acquire ( ) || hasSnapshot;
+        if ( !hasSnapshot )
+        {
+          std::this_thread::yield ( );
+          continue;
+        }
+        snapshot = &_snapshots.readBuffer ( );
+      }
+
+      //Ventana minimizada: no hay swapchain posible
+      if ( _windowWidth == 0 || _windowHeight == 0 )
+      {
+        std::this_thread::sleep_for ( std::chrono::milliseconds ( 10 ));
+        continue;
+      }
+
+      drawFrame ( *snapshot );
+
+      //Pipelines compilados desde el último guardado (p.ej. tras un cambio
+      //de formato de la superficie). La escritura va en otro hilo
+      if ( !_pipelineCache.saveIfDue ( PIPELINE_CACHE_SAVE_INTERVAL,
+                                       _pipelineRegistry.compiledCount ( )))
+      {
+        std::cerr << "failed to save pipeline cache!" << std::endl;
+      }
+
+      if ( _frameLimit > 0 && _framesRendered >= _frameLimit )
+      {
+        _running = false;
+      }
+    }
 
-  vkDeviceWaitIdle ( _device );
+    vkDeviceWaitIdle ( _device );
+
+    drainGpuFrameTimes ( );
+    waitReadbacks ( );
+
+    std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+    for ( auto& batch : _pendingUploads )
+    {
+      waitUploadBatch ( batch );
+    }
+    _pendingUploads.clear ( );
+  }
+  catch ( ... )
+  {
+    _renderError = std::current_exception ( );
+    _running = false;
+  }
 }
 
 void vulkanApp::cleanupSwapChain ( )
 {
+  _imageTracker.forgetImage ( _depthImage );
   vkDestroyImageView ( _device, _depthImageView, nullptr );
   vkDestroyImage ( _device, _depthImage, nullptr );
   vkFreeMemory ( _device, _depthImageMemory, nullptr );
@@ -666,12 +1093,7 @@ void vulkanApp::cleanupSwapChain ( )
     vkDestroyFramebuffer ( _device, _swapChainFramebuffers[i], nullptr );
   }
 
-  vkFreeCommandBuffers ( _device,
-                         _commandPool,
-                         static_cast<uint32_t>(_commandBuffers.size ( )),
-                         _commandBuffers.data ( ));
-
-  vkDestroyPipeline ( _device, _graphicsPipeline, nullptr );
+  _pipelineRegistry.destroy ( );
   vkDestroyPipelineLayout ( _device, _pipelineLayout, nullptr );
   vkDestroyRenderPass ( _device, _renderPass, nullptr );
 
@@ -680,36 +1102,107 @@ void vulkanApp::cleanupSwapChain ( )
     vkDestroyImageView ( _device, _swapChainImageViews[i], nullptr );
   }
 
-  vkDestroySwapchainKHR ( _device, _swapChain, nullptr );
+  for ( VkImage image : _swapChainImages )
+  {
+    _imageTracker.forgetImage ( image );
+  }
+
+  for ( auto semaphore : _renderFinishedSemaphores )
+  {
+    vkDestroySemaphore ( _device, semaphore, nullptr );
+  }
+  _renderFinishedSemaphores.clear ( );
+
+  if ( _headless )
+  {
+    for ( size_t i = 0; i < _swapChainImages.size ( ); i++ )
+    {
+      vkDestroyImage ( _device, _swapChainImages[i], nullptr );
+      vkFreeMemory ( _device, _offscreenImageMemory[i], nullptr );
+    }
+    _swapChainImages.clear ( );
+    _offscreenImageMemory.clear ( );
+  }
+  else
+  {
+    vkDestroySwapchainKHR ( _device, _swapChain, nullptr );
+  }
 }
 
 void vulkanApp::cleanup ( )
 {
   cleanupSwapChain ( );
 
+  //Con el device parado no queda otra que destruirlas ya
+  for ( auto& retired : _retiredSwapChains )
+  {
+    retired._destroy ( );
+  }
+  _retiredSwapChains.clear ( );
+
   vkDestroySampler ( _device, _textureSampler, nullptr );
   vkDestroyImageView ( _device, _textureImageView, nullptr );
 
+  _imageTracker.forgetImage ( _textureImage );
   vkDestroyImage ( _device, _textureImage, nullptr );
   vkFreeMemory ( _device, _textureImageMemory, nullptr );
 
   vkDestroyDescriptorPool ( _device, _descriptorPool, nullptr );
 
   vkDestroyDescriptorSetLayout ( _device, _descriptorSetLayout, nullptr );
+  vkUnmapMemory ( _device, _uniformBufferMemory );
   vkDestroyBuffer ( _device, _uniformBuffer, nullptr );
   vkFreeMemory ( _device, _uniformBufferMemory, nullptr );
 
-  vkDestroyBuffer ( _device, _indexBuffer, nullptr );
-  vkFreeMemory ( _device, _indexBufferMemory, nullptr );
-
-  vkDestroyBuffer ( _device, _vertexBuffer, nullptr );
-  vkFreeMemory ( _device, _vertexBufferMemory, nullptr );
+  vkUnmapMemory ( _device, _objectBufferMemory );
+  vkDestroyBuffer ( _device, _objectBuffer, nullptr );
+  vkFreeMemory ( _device, _objectBufferMemory, nullptr );
+  vkUnmapMemory ( _device, _indirectBufferMemory );
+  vkDestroyBuffer ( _device, _indirectBuffer, nullptr );
+  vkFreeMemory ( _device, _indirectBufferMemory, nullptr );
 
-  vkDestroySemaphore ( _device, _renderFinishedSemaphore, nullptr );
-  vkDestroySemaphore ( _device, _imageAvailableSemaphore, nullptr );
+  if ( _instanceBuffer != VK_NULL_HANDLE )
+  {
+    vkUnmapMemory ( _device, _instanceBufferMemory );
+    vkDestroyBuffer ( _device, _instanceBuffer, nullptr );
+    vkFreeMemory ( _device, _instanceBufferMemory, nullptr );
+  }
+
+  if ( _drawPath == DRAW_GPU_CULLED )
+  {
+    destroyCullingResources ( );
+  }
+
+  vkDestroyBuffer ( _device, _indexBuffer, nullptr );
+  vkFreeMemory ( _device, _indexBufferMemory, nullptr );
+
+  vkDestroyBuffer ( _device, _vertexBuffer, nullptr );
+  vkFreeMemory ( _device, _vertexBufferMemory, nullptr );
+
+  for ( auto& frame : _frames )
+  {
+    vkDestroySemaphore ( _device, frame._imageAvailableSemaphore, nullptr );
+    vkDestroyCommandPool ( _device, frame._commandPool, nullptr );
+    for ( auto pool : frame._workerPools )
+    {
+      vkDestroyCommandPool ( _device, pool, nullptr );
+    }
+  }
+  _recordWorkers.stop ( );
+  _gpuProfiler.destroy ( );
+  _pipelineCache.destroy ( );
+  _shaderLibrary.destroy ( );
+  _frames.clear ( );
 
+  destroyReadbackRing ( );
+
+  vkDestroyCommandPool ( _device, _transferCommandPool, nullptr );
   vkDestroyCommandPool ( _device, _commandPool, nullptr );
 
+  //Espera lo pendiente y ejecuta las destrucciones diferidas
+  _transferTimeline.destroy ( );
+  _graphicsTimeline.destroy ( );
+
   vkDestroyDevice ( _device, nullptr );
   DestroyDebugReportCallbackEXT ( _instance, _callback, nullptr );
   vkDestroySurfaceKHR ( _instance, _surface, nullptr );
@@ -720,8 +1213,11 @@ void vulkanApp::cleanup ( )
   vkDestroyInstance ( _instance, nullptr );
 
   //Destroy glfw _window and events
-  glfwDestroyWindow ( _window );
-  glfwTerminate ( );
+  if ( !_headless )
+  {
+    glfwDestroyWindow ( _window );
+    glfwTerminate ( );
+  }
 }
 
 void vulkanApp::onWindowResized ( GLFWwindow* window,
@@ -729,32 +1225,140 @@ void vulkanApp::onWindowResized ( GLFWwindow* window,
                                    int height )
 
 {
-  if ( width == 0 || height == 0 )
-    return;
-
   vulkanApp* app =
     reinterpret_cast<vulkanApp*>(glfwGetWindowUserPointer (
       window ));
-  app->recreateSwapChain ( );
+
+  //Solo se anota: el hilo de render recrea la swapchain en su frame
+  app->_windowWidth = width;
+  app->_windowHeight = height;
+  app->_framebufferResized = true;
 }
 
 //Recrear la swapchain, por ejemplo, al resizear la ventana
 void vulkanApp::recreateSwapChain ( )
 {
-  //Terminar lo que este haciengo
-  vkDeviceWaitIdle ( _device );
+  //Sin vkDeviceWaitIdle: lo que depende del tamaño se entrega al timeline y
+  //se destruye cuando la GPU termine los frames que lo usan. El render pass,
+  //el pipeline y los command buffers no dependen del tamaño y se conservan
+  VkSwapchainKHR oldSwapChain = _swapChain;
+  VkFormat oldFormat = _swapChainImageFormat;
+
+  std::vector < VkImageView > oldImageViews;
+  std::vector < VkFramebuffer > oldFramebuffers;
+  std::vector < VkSemaphore > oldSemaphores;
+  oldImageViews.swap ( _swapChainImageViews );
+  oldFramebuffers.swap ( _swapChainFramebuffers );
+  oldSemaphores.swap ( _renderFinishedSemaphores );
+
+  VkImage oldDepthImage = _depthImage;
+  VkImageView oldDepthImageView = _depthImageView;
+  VkDeviceMemory oldDepthImageMemory = _depthImageMemory;
+
+  for ( VkImage image : _swapChainImages )
+  {
+    _imageTracker.forgetImage ( image );
+  }
+  _imageTracker.forgetImage ( _depthImage );
 
-  //
-  cleanupSwapChain ( );
+  createSwapChain ( oldSwapChain );
+
+  //La pirámide lee el depth viejo en los frames en vuelo
+  if ( _occlusionCulling )
+  {
+    _graphicsTimeline.deferDestroy ( _graphicsTimeline.lastSubmitted ( ),
+                                     releaseHiZResources ( ));
+  }
+
+  //Caso raro: la superficie cambia de formato (p.ej. al cambiar de monitor)
+  if ( _swapChainImageFormat != oldFormat )
+  {
+    _graphicsTimeline.waitIdle ( );
+    _pipelineRegistry.releaseRenderPass ( _renderPass );
+    vkDestroyPipelineLayout ( _device, _pipelineLayout, nullptr );
+    vkDestroyRenderPass ( _device, _renderPass, nullptr );
+    createRenderPass ( );
+    createGraphicsPipeline ( );
+  }
 
-  //Los creates iniciales. Recrear todo la swap chain y todo lo que depende de ella
-  //Incluido lo que depende de la ventana
-  createSwapChain ( );
-  createRenderPass ( );
-  createGraphicsPipeline ( );
   createDepthResources ( );
   createFramebuffers ( );
-  createCommandBuffers ( );
+  if ( _occlusionCulling )
+  {
+    createHiZResources ( );
+  }
+
+  //Los primarios grabados referencian los framebuffers viejos
+  _recordingGeneration++;
+
+  VkDevice device = _device;
+  _graphicsTimeline.deferDestroy ( _graphicsTimeline.lastSubmitted ( ),
+    [=] ( )
+    {
+      for ( auto framebuffer : oldFramebuffers )
+      {
+        vkDestroyFramebuffer ( device, framebuffer, nullptr );
+      }
+      for ( auto view : oldImageViews )
+      {
+        vkDestroyImageView ( device, view, nullptr );
+      }
+      vkDestroyImageView ( device, oldDepthImageView, nullptr );
+      vkDestroyImage ( device, oldDepthImage, nullptr );
+      vkFreeMemory ( device, oldDepthImageMemory, nullptr );
+    } );
+
+  //Los semáforos y la swapchain los sigue usando el motor de presentación
+  //después de que la GPU termine
+  RetiredSwapChain retired;
+  retired._presentsLeft = static_cast<uint32_t>(oldSemaphores.size ( ));
+  retired._destroy = [=] ( )
+  {
+    for ( auto semaphore : oldSemaphores )
+    {
+      vkDestroySemaphore ( device, semaphore, nullptr );
+    }
+    if ( oldSwapChain != VK_NULL_HANDLE )
+    {
+      vkDestroySwapchainKHR ( device, oldSwapChain, nullptr );
+    }
+  };
+
+  //En headless no hay presentación: basta con el timeline
+  if ( _headless )
+  {
+    _graphicsTimeline.deferDestroy ( _graphicsTimeline.lastSubmitted ( ),
+                                     retired._destroy );
+  }
+  else
+  {
+    _retiredSwapChains.push_back ( retired );
+  }
+}
+
+void vulkanApp::retireSwapChains ( )
+{
+  size_t kept = 0;
+  for ( size_t i = 0; i < _retiredSwapChains.size ( ); i++ )
+  {
+    RetiredSwapChain& retired = _retiredSwapChains[i];
+    if ( retired._presentsLeft > 0 )
+    {
+      retired._presentsLeft--;
+    }
+
+    //El último envío incluye el del present que acaba de cumplir la cuenta
+    if ( retired._presentsLeft == 0 )
+    {
+      _graphicsTimeline.deferDestroy ( _graphicsTimeline.lastSubmitted ( ),
+                                       retired._destroy );
+    }
+    else
+    {
+      _retiredSwapChains[kept++] = retired;
+    }
+  }
+  _retiredSwapChains.resize ( kept );
 }
 
 
@@ -812,23 +1416,39 @@ void vulkanApp::createCommandPool ( )
   VkCommandPoolCreateInfo poolInfo = {};
   poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
   poolInfo.queueFamilyIndex = queueFamilyIndices._graphicsFamily;
+  //Command buffers de un solo uso (copias y lecturas)
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
 
   if ( vkCreateCommandPool ( _device, &poolInfo, nullptr, &_commandPool )
     != VK_SUCCESS )
   {
     throw std::runtime_error ( "failed to create graphics command pool!" );
   }
+
+  //Pool para los command buffers de subida (vida corta)
+  poolInfo.queueFamilyIndex = queueFamilyIndices._transferFamily;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+  if ( vkCreateCommandPool ( _device,
+                             &poolInfo,
+                             nullptr,
+                             &_transferCommandPool ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create transfer command pool!" );
+  }
 }
 
 void vulkanApp::createDepthResources ( )
 {
   VkFormat depthFormat = findDepthFormat ( );
 
+  //Con oclusión el depth se muestrea para construir la pirámide HiZ
   createImage ( _swapChainExtent.width,
                 _swapChainExtent.height,
                 depthFormat,
                 VK_IMAGE_TILING_OPTIMAL,
-                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT,
+                VK_IMAGE_USAGE_DEPTH_STENCIL_ATTACHMENT_BIT
+                  | ( _occlusionCulling ? VK_IMAGE_USAGE_SAMPLED_BIT : 0 ),
                 VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
                 _depthImage,
                 _depthImageMemory );
@@ -837,10 +1457,11 @@ void vulkanApp::createDepthResources ( )
                       depthFormat,
                       VK_IMAGE_ASPECT_DEPTH_BIT );
 
-  transitionImageLayout ( _depthImage,
-                          depthFormat,
-                          VK_IMAGE_LAYOUT_UNDEFINED,
-                          VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL );
+  //Sin transición explícita: el render pass parte de UNDEFINED y lo deja
+  //en DEPTH_STENCIL_ATTACHMENT_OPTIMAL en cada frame
+  _imageTracker.assume ( _depthImage,
+                         ImageTracker::defaultUsage (
+                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL ));
 }
 
 VkFormat vulkanApp::findSupportedFormat ( const std::vector < VkFormat >& candidates,
@@ -876,6 +1497,7 @@ VkFormat vulkanApp::findDepthFormat ( )
       VK_FORMAT_D24_UNORM_S8_UINT },
     VK_IMAGE_TILING_OPTIMAL,
     VK_FORMAT_FEATURE_DEPTH_STENCIL_ATTACHMENT_BIT
+      | ( _occlusionCulling ? VK_FORMAT_FEATURE_SAMPLED_IMAGE_BIT : 0 )
   );
 }
 
@@ -885,7 +1507,7 @@ bool vulkanApp::hasStencilComponent ( VkFormat format )
     || format == VK_FORMAT_D24_UNORM_S8_UINT;
 }
 
-void vulkanApp::createTextureImage ( )
+void vulkanApp::createTextureImage ( UploadBatch& batch )
 {
   //###
   unsigned int texWidth, texHeight;//, texChannels;
@@ -903,19 +1525,8 @@ void vulkanApp::createTextureImage ( )
     throw std::runtime_error ( "failed to load texture image!" );
   }
 
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-  createBuffer ( imageSize,
-                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 stagingBuffer,
-                 stagingBufferMemory );
-
-  void* data;
-  vkMapMemory ( _device, stagingBufferMemory, 0, imageSize, 0, &data );
-  memcpy ( data, pixels, static_cast<size_t>(imageSize));
-  vkUnmapMemory ( _device, stagingBufferMemory );
+  VkBuffer stagingBuffer = stageUpload ( batch, pixels, imageSize );
+  delete[] pixels;
 
   createImage ( texWidth,
                 texHeight,
@@ -928,20 +1539,17 @@ void vulkanApp::createTextureImage ( )
                 _textureImageMemory );
 
   transitionImageLayout ( _textureImage,
-                          VK_FORMAT_R8G8B8A8_UNORM,
-                          VK_IMAGE_LAYOUT_UNDEFINED,
                           VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL );
-  copyBufferToImage ( stagingBuffer,
+  copyBufferToImage ( batch._commandBuffer,
+                      stagingBuffer,
                       _textureImage,
                       static_cast<uint32_t>(texWidth),
                       static_cast<uint32_t>(texHeight));
-  transitionImageLayout ( _textureImage,
-                          VK_FORMAT_R8G8B8A8_UNORM,
-                          VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
-                          VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL );
-
-  vkDestroyBuffer ( _device, stagingBuffer, nullptr );
-  vkFreeMemory ( _device, stagingBufferMemory, nullptr );
+  recordImageHandOff ( batch,
+                       _textureImage,
+                       VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL,
+                       VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT,
+                       VK_ACCESS_SHADER_READ_BIT );
 }
 
 void vulkanApp::createTextureImageView ( )
@@ -978,18 +1586,23 @@ void vulkanApp::createTextureSampler ( )
 //Creación de image views (para el swapchain, profundidad, texturas etc)
 VkImageView vulkanApp::createImageView ( VkImage image,
                                          VkFormat format,
-                                         VkImageAspectFlags aspectFlags )
+                                         VkImageAspectFlags aspectFlags,
+                                         uint32_t baseMipLevel,
+                                         uint32_t levelCount,
+                                         uint32_t baseArrayLayer,
+                                         uint32_t layerCount )
 {
   VkImageViewCreateInfo viewInfo = {};
   viewInfo.sType = VK_STRUCTURE_TYPE_IMAGE_VIEW_CREATE_INFO;
   viewInfo.image = image;
-  viewInfo.viewType = VK_IMAGE_VIEW_TYPE_2D;
+  viewInfo.viewType = layerCount > 1
+    ? VK_IMAGE_VIEW_TYPE_2D_ARRAY : VK_IMAGE_VIEW_TYPE_2D;
   viewInfo.format = format;
   viewInfo.subresourceRange.aspectMask = aspectFlags;
-  viewInfo.subresourceRange.baseMipLevel = 0;
-  viewInfo.subresourceRange.levelCount = 1;
-  viewInfo.subresourceRange.baseArrayLayer = 0;
-  viewInfo.subresourceRange.layerCount = 1;
+  viewInfo.subresourceRange.baseMipLevel = baseMipLevel;
+  viewInfo.subresourceRange.levelCount = levelCount;
+  viewInfo.subresourceRange.baseArrayLayer = baseArrayLayer;
+  viewInfo.subresourceRange.layerCount = layerCount;
 
   VkImageView imageView;
   if ( vkCreateImageView ( _device, &viewInfo, nullptr, &imageView )
@@ -1008,7 +1621,9 @@ void vulkanApp::createImage ( uint32_t width,
                               VkImageUsageFlags usage,
                               VkMemoryPropertyFlags properties,
                               VkImage& image,
-                              VkDeviceMemory& imageMemory )
+                              VkDeviceMemory& imageMemory,
+                              uint32_t mipLevels,
+                              uint32_t arrayLayers )
 {
   VkImageCreateInfo imageInfo = {};
   imageInfo.sType = VK_STRUCTURE_TYPE_IMAGE_CREATE_INFO;
@@ -1016,8 +1631,8 @@ void vulkanApp::createImage ( uint32_t width,
   imageInfo.extent.width = width;
   imageInfo.extent.height = height;
   imageInfo.extent.depth = 1;
-  imageInfo.mipLevels = 1;
-  imageInfo.arrayLayers = 1;
+  imageInfo.mipLevels = mipLevels;
+  imageInfo.arrayLayers = arrayLayers;
   imageInfo.format = format;
   imageInfo.tiling = tiling;
   imageInfo.initialLayout = VK_IMAGE_LAYOUT_UNDEFINED;
@@ -1047,97 +1662,38 @@ void vulkanApp::createImage ( uint32_t width,
   }
 
   vkBindImageMemory ( _device, image, imageMemory, 0 );
+
+  _imageTracker.registerImage ( image,
+                                aspectFlagsForFormat ( format ),
+                                mipLevels,
+                                arrayLayers );
 }
 
+//Transición de layout vía el tracker: el layout de origen, las etapas y
+//los accesos salen del último uso registrado de cada subrecurso. Solo se
+//encola; el comando que la consume hace el flush, así varias transiciones
+//seguidas comparten barrera
 void vulkanApp::transitionImageLayout ( VkImage image,
-                                        VkFormat format,
-                                        VkImageLayout oldLayout,
-                                        VkImageLayout newLayout )
+                                        VkImageLayout newLayout,
+                                        uint32_t baseMipLevel,
+                                        uint32_t levelCount,
+                                        uint32_t baseArrayLayer,
+                                        uint32_t layerCount )
 {
-  VkCommandBuffer commandBuffer = beginSingleTimeCommands ( );
-
-  VkImageMemoryBarrier barrier = {};
-  barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-  barrier.oldLayout = oldLayout;
-  barrier.newLayout = newLayout;
-  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
-  barrier.image = image;
-
-  if ( newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL )
-  {
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_DEPTH_BIT;
-
-    if ( hasStencilComponent ( format ))
-    {
-      barrier.subresourceRange.aspectMask |= VK_IMAGE_ASPECT_STENCIL_BIT;
-    }
-  }
-  else
-  {
-    barrier.subresourceRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-  }
-
-  barrier.subresourceRange.baseMipLevel = 0;
-  barrier.subresourceRange.levelCount = 1;
-  barrier.subresourceRange.baseArrayLayer = 0;
-  barrier.subresourceRange.layerCount = 1;
-
-  VkPipelineStageFlags sourceStage;
-  VkPipelineStageFlags destinationStage;
-
-  if ( oldLayout == VK_IMAGE_LAYOUT_UNDEFINED
-    && newLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL )
-  {
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-
-    sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    destinationStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-  }
-  else if ( oldLayout == VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL
-    && newLayout == VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL )
-  {
-    barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
-    barrier.dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
-
-    sourceStage = VK_PIPELINE_STAGE_TRANSFER_BIT;
-    destinationStage = VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
-  }
-  else if ( oldLayout == VK_IMAGE_LAYOUT_UNDEFINED
-    && newLayout == VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL )
-  {
-    barrier.srcAccessMask = 0;
-    barrier.dstAccessMask = VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_READ_BIT
-      | VK_ACCESS_DEPTH_STENCIL_ATTACHMENT_WRITE_BIT;
-
-    sourceStage = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-    destinationStage = VK_PIPELINE_STAGE_EARLY_FRAGMENT_TESTS_BIT;
-  }
-  else
-  {
-    throw std::invalid_argument ( "unsupported layout transition!" );
-  }
-
-  vkCmdPipelineBarrier (
-    commandBuffer,
-    sourceStage, destinationStage,
-    0,
-    0, nullptr,
-    0, nullptr,
-    1, &barrier
-  );
-
-  endSingleTimeCommands ( commandBuffer );
+  _imageTracker.require ( image,
+                          newLayout,
+                          baseMipLevel,
+                          levelCount,
+                          baseArrayLayer,
+                          layerCount );
 }
 
-void vulkanApp::copyBufferToImage ( VkBuffer buffer,
+void vulkanApp::copyBufferToImage ( VkCommandBuffer commandBuffer,
+                                    VkBuffer buffer,
                                     VkImage image,
                                     uint32_t width,
                                     uint32_t height )
 {
-  VkCommandBuffer commandBuffer = beginSingleTimeCommands ( );
-
   VkBufferImageCopy region = {};
   region.bufferOffset = 0;
   region.bufferRowLength = 0;
@@ -1153,14 +1709,13 @@ void vulkanApp::copyBufferToImage ( VkBuffer buffer,
     1
   };
 
+  _imageTracker.flush ( commandBuffer );
   vkCmdCopyBufferToImage ( commandBuffer,
                            buffer,
                            image,
                            VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL,
                            1,
                            &region );
-
-  endSingleTimeCommands ( commandBuffer );
 }
 
 void vulkanApp::loadModel ( )
@@ -1195,29 +1750,31 @@ void vulkanApp::loadModel ( )
     }
     _indices.push_back ( uniqueVertices[vertex] );
   }
+
+  //Esfera envolvente del mallado para el culling
+  glm::vec3 minPos = _vertices[0]._pos;
+  glm::vec3 maxPos = _vertices[0]._pos;
+  for ( const Vertex& vertex : _vertices )
+  {
+    minPos = glm::min ( minPos, vertex._pos );
+    maxPos = glm::max ( maxPos, vertex._pos );
+  }
+  glm::vec3 center = ( minPos + maxPos ) * 0.5f;
+  float radius = 0.0f;
+  for ( const Vertex& vertex : _vertices )
+  {
+    radius = std::max ( radius, glm::length ( vertex._pos - center ));
+  }
+  _meshBounds = glm::vec4 ( center, radius );
 }
 
 
-void vulkanApp::createVertexBuffer ( )
+void vulkanApp::createVertexBuffer ( UploadBatch& batch )
 {
   VkDeviceSize bufferSize = sizeof ( _vertices[0] )*_vertices.size ( );
 
-  //Creación de los staging buffers
-  //Visible desde CPU
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-  createBuffer ( bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 stagingBuffer,
-                 stagingBufferMemory );
-
-  //Se copian los datos
-  void* data;
-  vkMapMemory ( _device, stagingBufferMemory, 0, bufferSize, 0, &data );
-  memcpy ( data, _vertices.data ( ), ( size_t ) bufferSize );
-  vkUnmapMemory ( _device, stagingBufferMemory );
+  //Staging buffer visible desde CPU, vive hasta que acabe el lote
+  VkBuffer stagingBuffer = stageUpload ( batch, _vertices.data ( ), bufferSize );
 
   //Sólo visible desde la GPU
   createBuffer ( bufferSize,
@@ -1227,31 +1784,19 @@ void vulkanApp::createVertexBuffer ( )
                  _vertexBuffer,
                  _vertexBufferMemory );
 
-  //Se copia de un buffer a otro
-  copyBuffer ( stagingBuffer, _vertexBuffer, bufferSize );
-
-  //Se destruye el temporal usado para la CPU transfer
-  vkDestroyBuffer ( _device, stagingBuffer, nullptr );
-  vkFreeMemory ( _device, stagingBufferMemory, nullptr );
+  //Se graba la copia de un buffer a otro
+  copyBuffer ( batch._commandBuffer, stagingBuffer, _vertexBuffer, bufferSize );
+  recordBufferHandOff ( batch,
+                        _vertexBuffer,
+                        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                        VK_ACCESS_VERTEX_ATTRIBUTE_READ_BIT );
 }
 
-void vulkanApp::createIndexBuffer ( )
+void vulkanApp::createIndexBuffer ( UploadBatch& batch )
 {
   VkDeviceSize bufferSize = sizeof ( _indices[0] )*_indices.size ( );
 
-  VkBuffer stagingBuffer;
-  VkDeviceMemory stagingBufferMemory;
-  createBuffer ( bufferSize,
-                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
-                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
-                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
-                 stagingBuffer,
-                 stagingBufferMemory );
-
-  void* data;
-  vkMapMemory ( _device, stagingBufferMemory, 0, bufferSize, 0, &data );
-  memcpy ( data, _indices.data ( ), ( size_t ) bufferSize );
-  vkUnmapMemory ( _device, stagingBufferMemory );
+  VkBuffer stagingBuffer = stageUpload ( batch, _indices.data ( ), bufferSize );
 
   createBuffer ( bufferSize,
                  VK_BUFFER_USAGE_TRANSFER_DST_BIT
@@ -1260,79 +1805,650 @@ void vulkanApp::createIndexBuffer ( )
                  _indexBuffer,
                  _indexBufferMemory );
 
-  copyBuffer ( stagingBuffer, _indexBuffer, bufferSize );
-
-  vkDestroyBuffer ( _device, stagingBuffer, nullptr );
-  vkFreeMemory ( _device, stagingBufferMemory, nullptr );
+  copyBuffer ( batch._commandBuffer, stagingBuffer, _indexBuffer, bufferSize );
+  recordBufferHandOff ( batch,
+                        _indexBuffer,
+                        VK_PIPELINE_STAGE_VERTEX_INPUT_BIT,
+                        VK_ACCESS_INDEX_READ_BIT );
 }
 
 void vulkanApp::createUniformBuffer ( )
 {
-  VkDeviceSize bufferSize = sizeof ( UniformBufferObject );
+  //Cada tramo alineado para poder usarse como offset dinámico
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties ( _physicalDevice, &properties );
+  VkDeviceSize alignment =
+    std::max < VkDeviceSize > ( properties.limits
+                                  .minUniformBufferOffsetAlignment, 1 );
+  _uniformSliceSize = ( sizeof ( UniformBufferObject ) + alignment - 1 )
+    / alignment * alignment;
+
+  VkDeviceSize bufferSize = _uniformSliceSize * _framesInFlight;
   createBuffer ( bufferSize,
                  VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
                  VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
                    | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
                  _uniformBuffer,
                  _uniformBufferMemory );
+
+  //Mapeado durante toda la vida del buffer
+  vkMapMemory ( _device,
+                _uniformBufferMemory,
+                0,
+                bufferSize,
+                0,
+                &_uniformBufferMapped );
 }
 
-void vulkanApp::createDescriptorPool ( )
+//Buffers del camino indirecto, un tramo por frame en vuelo. Se crean
+//siempre: el binding 2 del descriptor set tiene que ser válido
+void vulkanApp::createIndirectBuffers ( )
+{
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties ( _physicalDevice, &properties );
+  VkDeviceSize alignment =
+    std::max < VkDeviceSize > ( properties.limits
+                                  .minStorageBufferOffsetAlignment, 16 );
+
+  VkDeviceSize objectSize = _maxIndirectDraws * sizeof ( ObjectGpuData );
+  _objectSliceSize = ( objectSize + alignment - 1 ) / alignment * alignment;
+
+  VkDeviceSize commandsSize = INDIRECT_COMMANDS_OFFSET
+    + _maxIndirectDraws * sizeof ( VkDrawIndexedIndirectCommand );
+  _indirectSliceSize = ( commandsSize + alignment - 1 )
+    / alignment * alignment;
+
+  createBuffer ( _objectSliceSize * _framesInFlight,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 _objectBuffer,
+                 _objectBufferMemory );
+
+  //También storage y destino de transferencia: el compute de culling
+  //escribe los comandos y el contador se pone a cero con vkCmdFillBuffer
+  createBuffer ( _indirectSliceSize * _framesInFlight,
+                 VK_BUFFER_USAGE_INDIRECT_BUFFER_BIT
+                   | VK_BUFFER_USAGE_STORAGE_BUFFER_BIT
+                   | VK_BUFFER_USAGE_TRANSFER_DST_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 _indirectBuffer,
+                 _indirectBufferMemory );
+
+  vkMapMemory ( _device,
+                _objectBufferMemory,
+                0,
+                _objectSliceSize * _framesInFlight,
+                0,
+                &_objectBufferMapped );
+  vkMapMemory ( _device,
+                _indirectBufferMemory,
+                0,
+                _indirectSliceSize * _framesInFlight,
+                0,
+                &_indirectBufferMapped );
+}
+
+//Pipelines, descriptores y buffers del culling en GPU. La pirámide HiZ va
+//aparte porque depende del tamaño del depth
+void vulkanApp::createCullingResources ( )
 {
+  //Set 0: parámetros, objetos de origen, objetos visibles y comandos, todos
+  //con el tramo del frame como offset dinámico
+  std::array < VkDescriptorSetLayoutBinding, 4 > cullBindings = {};
+  for ( uint32_t i = 0; i < cullBindings.size ( ); i++ )
+  {
+    cullBindings[i].binding = i;
+    cullBindings[i].descriptorCount = 1;
+    cullBindings[i].descriptorType = i == 0
+                                     ? VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC
+                                     : VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+    cullBindings[i].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  }
+
+  VkDescriptorSetLayoutCreateInfo layoutInfo = {};
+  layoutInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+  layoutInfo.bindingCount = static_cast<uint32_t>(cullBindings.size ( ));
+  layoutInfo.pBindings = cullBindings.data ( );
+  if ( vkCreateDescriptorSetLayout ( _device,
+                                     &layoutInfo,
+                                     nullptr,
+                                     &_cullSetLayout ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create culling descriptor set layout!" );
+  }
+
+  //Set 1: la pirámide HiZ
+  VkDescriptorSetLayoutBinding hiZBinding = {};
+  hiZBinding.binding = 0;
+  hiZBinding.descriptorCount = 1;
+  hiZBinding.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  hiZBinding.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  layoutInfo.bindingCount = 1;
+  layoutInfo.pBindings = &hiZBinding;
+  if ( vkCreateDescriptorSetLayout ( _device,
+                                     &layoutInfo,
+                                     nullptr,
+                                     &_cullHiZSetLayout ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create culling descriptor set layout!" );
+  }
+
+  //Reducción de un nivel: origen muestreado y destino como storage image
+  std::array < VkDescriptorSetLayoutBinding, 2 > reduceBindings = {};
+  reduceBindings[0].binding = 0;
+  reduceBindings[0].descriptorCount = 1;
+  reduceBindings[0].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  reduceBindings[0].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  reduceBindings[1].binding = 1;
+  reduceBindings[1].descriptorCount = 1;
+  reduceBindings[1].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  reduceBindings[1].stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+
+  layoutInfo.bindingCount = static_cast<uint32_t>(reduceBindings.size ( ));
+  layoutInfo.pBindings = reduceBindings.data ( );
+  if ( vkCreateDescriptorSetLayout ( _device,
+                                     &layoutInfo,
+                                     nullptr,
+                                     &_hiZSetLayout ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create hiz descriptor set layout!" );
+  }
+
+  std::array < VkDescriptorSetLayout, 2 > cullSetLayouts = {{ _cullSetLayout,
+                                                              _cullHiZSetLayout }};
+  VkPipelineLayoutCreateInfo pipelineLayoutInfo = {};
+  pipelineLayoutInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
+  pipelineLayoutInfo.setLayoutCount =
+    static_cast<uint32_t>(cullSetLayouts.size ( ));
+  pipelineLayoutInfo.pSetLayouts = cullSetLayouts.data ( );
+  if ( vkCreatePipelineLayout ( _device,
+                                &pipelineLayoutInfo,
+                                nullptr,
+                                &_cullPipelineLayout ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create culling pipeline layout!" );
+  }
+
+  //Tamaños de origen y destino del nivel
+  VkPushConstantRange reduceRange = {};
+  reduceRange.stageFlags = VK_SHADER_STAGE_COMPUTE_BIT;
+  reduceRange.offset = 0;
+  reduceRange.size = 4 * sizeof ( int32_t );
+
+  pipelineLayoutInfo.setLayoutCount = 1;
+  pipelineLayoutInfo.pSetLayouts = &_hiZSetLayout;
+  pipelineLayoutInfo.pushConstantRangeCount = 1;
+  pipelineLayoutInfo.pPushConstantRanges = &reduceRange;
+  if ( vkCreatePipelineLayout ( _device,
+                                &pipelineLayoutInfo,
+                                nullptr,
+                                &_hiZPipelineLayout ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create hiz pipeline layout!" );
+  }
+
+  ShaderModule cullShader = _shaderLibrary.load ( "./content/vk_shaders/culling/cull.spv" );
+  ShaderModule hiZShader = _shaderLibrary.load ( "./content/vk_shaders/culling/hiz.spv" );
+
+  //Sin drawIndirectCount no se compacta: el número de draws es fijo
+  VkBool32 compact = _drawIndirectCount ? VK_TRUE : VK_FALSE;
+  VkSpecializationMapEntry specializationEntry = {};
+  specializationEntry.constantID = 0;
+  specializationEntry.offset = 0;
+  specializationEntry.size = sizeof ( VkBool32 );
+
+  VkSpecializationInfo specializationInfo = {};
+  specializationInfo.mapEntryCount = 1;
+  specializationInfo.pMapEntries = &specializationEntry;
+  specializationInfo.dataSize = sizeof ( VkBool32 );
+  specializationInfo.pData = &compact;
+
+  std::array < VkComputePipelineCreateInfo, 2 > pipelineInfos = {};
+  pipelineInfos[0].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfos[0].stage.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineInfos[0].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineInfos[0].stage.module = cullShader._module;
+  pipelineInfos[0].stage.pName = "main";
+  pipelineInfos[0].stage.pSpecializationInfo = &specializationInfo;
+  pipelineInfos[0].layout = _cullPipelineLayout;
+
+  pipelineInfos[1].sType = VK_STRUCTURE_TYPE_COMPUTE_PIPELINE_CREATE_INFO;
+  pipelineInfos[1].stage.sType =
+    VK_STRUCTURE_TYPE_PIPELINE_SHADER_STAGE_CREATE_INFO;
+  pipelineInfos[1].stage.stage = VK_SHADER_STAGE_COMPUTE_BIT;
+  pipelineInfos[1].stage.module = hiZShader._module;
+  pipelineInfos[1].stage.pName = "main";
+  pipelineInfos[1].layout = _hiZPipelineLayout;
+
+  std::array < VkPipeline, 2 > pipelines = {};
+  if ( vkCreateComputePipelines ( _device,
+                                  _pipelineCache.handle ( ),
+                                  static_cast<uint32_t>(pipelineInfos.size ( )),
+                                  pipelineInfos.data ( ),
+                                  nullptr,
+                                  pipelines.data ( )) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create culling pipelines!" );
+  }
+  _cullPipeline = pipelines[0];
+  _hiZPipeline = pipelines[1];
+
+  //Solo el set del culling: los de la pirámide van en su propio pool
   std::array < VkDescriptorPoolSize, 2 > poolSizes = {};
-  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   poolSizes[0].descriptorCount = 1;
-  poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-  poolSizes[1].descriptorCount = 1;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  poolSizes[1].descriptorCount = 3;
 
   VkDescriptorPoolCreateInfo poolInfo = {};
   poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
   poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size ( ));
   poolInfo.pPoolSizes = poolSizes.data ( );
   poolInfo.maxSets = 1;
-
-  if (
-    vkCreateDescriptorPool ( _device, &poolInfo, nullptr, &_descriptorPool )
-      != VK_SUCCESS )
+  if ( vkCreateDescriptorPool ( _device,
+                                &poolInfo,
+                                nullptr,
+                                &_cullDescriptorPool ) != VK_SUCCESS )
   {
-    throw std::runtime_error ( "failed to create descriptor pool!" );
+    throw std::runtime_error ( "failed to create culling descriptor pool!" );
   }
-}
 
-void vulkanApp::createDescriptorSet ( )
-{
-  VkDescriptorSetLayout layouts[] = { _descriptorSetLayout };
+  //Origen: todos los objetos del frame, escritos por la CPU
+  createBuffer ( _objectSliceSize * _framesInFlight,
+                 VK_BUFFER_USAGE_STORAGE_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 _cullSourceBuffer,
+                 _cullSourceBufferMemory );
+  vkMapMemory ( _device,
+                _cullSourceBufferMemory,
+                0,
+                _objectSliceSize * _framesInFlight,
+                0,
+                &_cullSourceBufferMapped );
+
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties ( _physicalDevice, &properties );
+  VkDeviceSize alignment =
+    std::max < VkDeviceSize > ( properties.limits
+                                  .minUniformBufferOffsetAlignment, 1 );
+  _cullParamsSliceSize = ( sizeof ( CullParams ) + alignment - 1 )
+    / alignment * alignment;
+
+  createBuffer ( _cullParamsSliceSize * _framesInFlight,
+                 VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 _cullParamsBuffer,
+                 _cullParamsBufferMemory );
+  vkMapMemory ( _device,
+                _cullParamsBufferMemory,
+                0,
+                _cullParamsSliceSize * _framesInFlight,
+                0,
+                &_cullParamsBufferMapped );
 
   VkDescriptorSetAllocateInfo allocInfo = {};
   allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
-  allocInfo.descriptorPool = _descriptorPool;
+  allocInfo.descriptorPool = _cullDescriptorPool;
   allocInfo.descriptorSetCount = 1;
-  allocInfo.pSetLayouts = layouts;
-
-  //Aqui se genera el descriptor set
-  if ( vkAllocateDescriptorSets ( _device, &allocInfo, &_descriptorSet )
+  allocInfo.pSetLayouts = &_cullSetLayout;
+  if ( vkAllocateDescriptorSets ( _device, &allocInfo, &_cullSet )
     != VK_SUCCESS )
   {
-    throw std::runtime_error ( "failed to allocate descriptor set!" );
+    throw std::runtime_error ( "failed to allocate culling descriptor set!" );
   }
 
-  VkDescriptorBufferInfo bufferInfo = {};
-  bufferInfo.buffer = _uniformBuffer;
-  bufferInfo.offset = 0;
-  bufferInfo.range = sizeof ( UniformBufferObject );
-
-  VkDescriptorImageInfo imageInfo = {};
-  imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-  imageInfo.imageView = _textureImageView;
-  imageInfo.sampler = _textureSampler;
-
-  std::array < VkWriteDescriptorSet, 2 > descriptorWrites = {};
+  std::array < VkDescriptorBufferInfo, 4 > bufferInfos = {};
+  bufferInfos[0].buffer = _cullParamsBuffer;
+  bufferInfos[0].range = sizeof ( CullParams );
+  bufferInfos[1].buffer = _cullSourceBuffer;
+  bufferInfos[1].range = _maxIndirectDraws * sizeof ( ObjectGpuData );
+  bufferInfos[2].buffer = _objectBuffer;
+  bufferInfos[2].range = _maxIndirectDraws * sizeof ( ObjectGpuData );
+  bufferInfos[3].buffer = _indirectBuffer;
+  bufferInfos[3].range = INDIRECT_COMMANDS_OFFSET
+    + _maxIndirectDraws * sizeof ( VkDrawIndexedIndirectCommand );
+
+  std::array < VkWriteDescriptorSet, 4 > descriptorWrites = {};
+  for ( uint32_t i = 0; i < descriptorWrites.size ( ); i++ )
+  {
+    descriptorWrites[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrites[i].dstSet = _cullSet;
+    descriptorWrites[i].dstBinding = i;
+    descriptorWrites[i].descriptorCount = 1;
+    descriptorWrites[i].descriptorType = cullBindings[i].descriptorType;
+    descriptorWrites[i].pBufferInfo = &bufferInfos[i];
+  }
+  vkUpdateDescriptorSets ( _device,
+                           static_cast<uint32_t>(descriptorWrites.size ( )),
+                           descriptorWrites.data ( ),
+                           0,
+                           nullptr );
 
-  descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  //Muestreo exacto por texel, el shader elige el nivel
+  VkSamplerCreateInfo samplerInfo = {};
+  samplerInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+  samplerInfo.magFilter = VK_FILTER_NEAREST;
+  samplerInfo.minFilter = VK_FILTER_NEAREST;
+  samplerInfo.mipmapMode = VK_SAMPLER_MIPMAP_MODE_NEAREST;
+  samplerInfo.addressModeU = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeV = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.addressModeW = VK_SAMPLER_ADDRESS_MODE_CLAMP_TO_EDGE;
+  samplerInfo.minLod = 0.0f;
+  samplerInfo.maxLod = static_cast<float>(MAX_HIZ_LEVELS);
+  samplerInfo.unnormalizedCoordinates = VK_FALSE;
+  if ( vkCreateSampler ( _device, &samplerInfo, nullptr, &_hiZSampler )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create hiz sampler!" );
+  }
+
+  if ( _occlusionCulling )
+  {
+    createHiZResources ( );
+  }
+  else
+  {
+    //El set 1 tiene que ser válido aunque el shader no lo lea: apunta a
+    //la textura de la escena
+    allocInfo.pSetLayouts = &_cullHiZSetLayout;
+    if ( vkAllocateDescriptorSets ( _device, &allocInfo, &_cullHiZSet )
+      != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to allocate culling descriptor set!" );
+    }
+
+    VkDescriptorImageInfo imageInfo = {};
+    imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+    imageInfo.imageView = _textureImageView;
+    imageInfo.sampler = _hiZSampler;
+
+    VkWriteDescriptorSet descriptorWrite = {};
+    descriptorWrite.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    descriptorWrite.dstSet = _cullHiZSet;
+    descriptorWrite.dstBinding = 0;
+    descriptorWrite.descriptorCount = 1;
+    descriptorWrite.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    descriptorWrite.pImageInfo = &imageInfo;
+    vkUpdateDescriptorSets ( _device, 1, &descriptorWrite, 0, nullptr );
+  }
+}
+
+void vulkanApp::destroyCullingResources ( )
+{
+  if ( _occlusionCulling )
+  {
+    releaseHiZResources ( ) ( );
+  }
+
+  vkDestroySampler ( _device, _hiZSampler, nullptr );
+  vkDestroyDescriptorPool ( _device, _cullDescriptorPool, nullptr );
+
+  vkUnmapMemory ( _device, _cullParamsBufferMemory );
+  vkDestroyBuffer ( _device, _cullParamsBuffer, nullptr );
+  vkFreeMemory ( _device, _cullParamsBufferMemory, nullptr );
+  vkUnmapMemory ( _device, _cullSourceBufferMemory );
+  vkDestroyBuffer ( _device, _cullSourceBuffer, nullptr );
+  vkFreeMemory ( _device, _cullSourceBufferMemory, nullptr );
+
+  vkDestroyPipeline ( _device, _hiZPipeline, nullptr );
+  vkDestroyPipeline ( _device, _cullPipeline, nullptr );
+  vkDestroyPipelineLayout ( _device, _hiZPipelineLayout, nullptr );
+  vkDestroyPipelineLayout ( _device, _cullPipelineLayout, nullptr );
+  vkDestroyDescriptorSetLayout ( _device, _hiZSetLayout, nullptr );
+  vkDestroyDescriptorSetLayout ( _device, _cullHiZSetLayout, nullptr );
+  vkDestroyDescriptorSetLayout ( _device, _cullSetLayout, nullptr );
+}
+
+//Pirámide HiZ para el depth actual. El nivel 0 es la potencia de dos por
+//debajo del tamaño del depth; cada nivel guarda el máximo de su región
+void vulkanApp::createHiZResources ( )
+{
+  _hiZExtent.width = 1;
+  while ( _hiZExtent.width * 2 <= _swapChainExtent.width )
+  {
+    _hiZExtent.width *= 2;
+  }
+  _hiZExtent.height = 1;
+  while ( _hiZExtent.height * 2 <= _swapChainExtent.height )
+  {
+    _hiZExtent.height *= 2;
+  }
+
+  _hiZLevels = 1;
+  while ( _hiZLevels < MAX_HIZ_LEVELS
+    && ( _hiZExtent.width >> _hiZLevels
+      | _hiZExtent.height >> _hiZLevels ) != 0 )
+  {
+    _hiZLevels++;
+  }
+
+  createImage ( _hiZExtent.width,
+                _hiZExtent.height,
+                VK_FORMAT_R32_SFLOAT,
+                VK_IMAGE_TILING_OPTIMAL,
+                VK_IMAGE_USAGE_STORAGE_BIT | VK_IMAGE_USAGE_SAMPLED_BIT,
+                VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT,
+                _hiZImage,
+                _hiZImageMemory,
+                _hiZLevels,
+                1 );
+  _hiZView = createImageView ( _hiZImage,
+                               VK_FORMAT_R32_SFLOAT,
+                               VK_IMAGE_ASPECT_COLOR_BIT,
+                               0,
+                               _hiZLevels );
+  _hiZMipViews.resize ( _hiZLevels );
+  for ( uint32_t level = 0; level < _hiZLevels; level++ )
+  {
+    _hiZMipViews[level] = createImageView ( _hiZImage,
+                                            VK_FORMAT_R32_SFLOAT,
+                                            VK_IMAGE_ASPECT_COLOR_BIT,
+                                            level,
+                                            1 );
+  }
+
+  //Un set por nivel y el del culling, en un pool justo para esta pirámide
+  std::array < VkDescriptorPoolSize, 2 > poolSizes = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[0].descriptorCount = _hiZLevels + 1;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+  poolSizes[1].descriptorCount = _hiZLevels;
+
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size ( ));
+  poolInfo.pPoolSizes = poolSizes.data ( );
+  poolInfo.maxSets = _hiZLevels + 1;
+  if ( vkCreateDescriptorPool ( _device,
+                                &poolInfo,
+                                nullptr,
+                                &_hiZDescriptorPool ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create hiz descriptor pool!" );
+  }
+
+  std::vector < VkDescriptorSetLayout > layouts ( _hiZLevels, _hiZSetLayout );
+  layouts.push_back ( _cullHiZSetLayout );
+  std::vector < VkDescriptorSet > sets ( layouts.size ( ));
+
+  VkDescriptorSetAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorPool = _hiZDescriptorPool;
+  allocInfo.descriptorSetCount = static_cast<uint32_t>(layouts.size ( ));
+  allocInfo.pSetLayouts = layouts.data ( );
+  if ( vkAllocateDescriptorSets ( _device, &allocInfo, sets.data ( ))
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to allocate hiz descriptor sets!" );
+  }
+  _cullHiZSet = sets.back ( );
+  sets.pop_back ( );
+  _hiZSets = sets;
+
+  //Toda la pirámide en GENERAL: se escribe como storage y se muestrea
+  std::vector < VkDescriptorImageInfo > imageInfos ( 2 * _hiZLevels + 1 );
+  std::vector < VkWriteDescriptorSet > descriptorWrites;
+  for ( uint32_t level = 0; level < _hiZLevels; level++ )
+  {
+    VkDescriptorImageInfo& sourceInfo = imageInfos[2 * level];
+    sourceInfo.sampler = _hiZSampler;
+    if ( level == 0 )
+    {
+      sourceInfo.imageView = _depthImageView;
+      sourceInfo.imageLayout =
+        VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+    }
+    else
+    {
+      sourceInfo.imageView = _hiZMipViews[level - 1];
+      sourceInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+    }
+
+    VkDescriptorImageInfo& destinationInfo = imageInfos[2 * level + 1];
+    destinationInfo.imageView = _hiZMipViews[level];
+    destinationInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+    VkWriteDescriptorSet write = {};
+    write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+    write.dstSet = _hiZSets[level];
+    write.dstBinding = 0;
+    write.descriptorCount = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+    write.pImageInfo = &sourceInfo;
+    descriptorWrites.push_back ( write );
+
+    write.dstBinding = 1;
+    write.descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+    write.pImageInfo = &destinationInfo;
+    descriptorWrites.push_back ( write );
+  }
+
+  VkDescriptorImageInfo& pyramidInfo = imageInfos.back ( );
+  pyramidInfo.sampler = _hiZSampler;
+  pyramidInfo.imageView = _hiZView;
+  pyramidInfo.imageLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+  VkWriteDescriptorSet write = {};
+  write.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  write.dstSet = _cullHiZSet;
+  write.dstBinding = 0;
+  write.descriptorCount = 1;
+  write.descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  write.pImageInfo = &pyramidInfo;
+  descriptorWrites.push_back ( write );
+
+  vkUpdateDescriptorSets ( _device,
+                           static_cast<uint32_t>(descriptorWrites.size ( )),
+                           descriptorWrites.data ( ),
+                           0,
+                           nullptr );
+
+  //Sin contenido hasta que la construya el primer frame
+  _hiZValid = false;
+}
+
+//Saca la pirámide actual de la aplicación y devuelve su destrucción, para
+//ejecutarla ya o cuando la GPU termine los frames que la usan
+std::function < void ( ) > vulkanApp::releaseHiZResources ( )
+{
+  _imageTracker.forgetImage ( _hiZImage );
+
+  VkDevice device = _device;
+  VkDescriptorPool pool = _hiZDescriptorPool;
+  VkImage image = _hiZImage;
+  VkDeviceMemory memory = _hiZImageMemory;
+  VkImageView view = _hiZView;
+  std::vector < VkImageView > mipViews;
+  mipViews.swap ( _hiZMipViews );
+  _hiZSets.clear ( );
+
+  _hiZDescriptorPool = VK_NULL_HANDLE;
+  _hiZImage = VK_NULL_HANDLE;
+  _hiZValid = false;
+
+  return [=] ( )
+  {
+    //Libera todos los sets de la pirámide
+    vkDestroyDescriptorPool ( device, pool, nullptr );
+    for ( auto mipView : mipViews )
+    {
+      vkDestroyImageView ( device, mipView, nullptr );
+    }
+    vkDestroyImageView ( device, view, nullptr );
+    vkDestroyImage ( device, image, nullptr );
+    vkFreeMemory ( device, memory, nullptr );
+  };
+}
+
+void vulkanApp::createDescriptorPool ( )
+{
+  std::array < VkDescriptorPoolSize, 3 > poolSizes = {};
+  poolSizes[0].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+  poolSizes[0].descriptorCount = 1;
+  poolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+  poolSizes[1].descriptorCount = 1;
+  poolSizes[2].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  poolSizes[2].descriptorCount = 1;
+
+  VkDescriptorPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+  poolInfo.poolSizeCount = static_cast<uint32_t>(poolSizes.size ( ));
+  poolInfo.pPoolSizes = poolSizes.data ( );
+  poolInfo.maxSets = 1;
+
+  if (
+    vkCreateDescriptorPool ( _device, &poolInfo, nullptr, &_descriptorPool )
+      != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to create descriptor pool!" );
+  }
+}
+
+void vulkanApp::createDescriptorSet ( )
+{
+  VkDescriptorSetLayout layouts[] = { _descriptorSetLayout };
+
+  VkDescriptorSetAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+  allocInfo.descriptorPool = _descriptorPool;
+  allocInfo.descriptorSetCount = 1;
+  allocInfo.pSetLayouts = layouts;
+
+  //Aqui se genera el descriptor set
+  if ( vkAllocateDescriptorSets ( _device, &allocInfo, &_descriptorSet )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to allocate descriptor set!" );
+  }
+
+  VkDescriptorBufferInfo bufferInfo = {};
+  bufferInfo.buffer = _uniformBuffer;
+  bufferInfo.offset = 0;
+  bufferInfo.range = sizeof ( UniformBufferObject );
+
+  VkDescriptorImageInfo imageInfo = {};
+  imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+  imageInfo.imageView = _textureImageView;
+  imageInfo.sampler = _textureSampler;
+
+  VkDescriptorBufferInfo objectInfo = {};
+  objectInfo.buffer = _objectBuffer;
+  objectInfo.offset = 0;
+  objectInfo.range = _maxIndirectDraws * sizeof ( ObjectGpuData );
+
+  std::array < VkWriteDescriptorSet, 3 > descriptorWrites = {};
+
+  descriptorWrites[0].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
   descriptorWrites[0].dstSet = _descriptorSet;
   descriptorWrites[0].dstBinding = 0;
   descriptorWrites[0].dstArrayElement = 0;
-  descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+  descriptorWrites[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
   descriptorWrites[0].descriptorCount = 1;
   descriptorWrites[0].pBufferInfo = &bufferInfo;
 
@@ -1344,6 +2460,14 @@ void vulkanApp::createDescriptorSet ( )
   descriptorWrites[1].descriptorCount = 1;
   descriptorWrites[1].pImageInfo = &imageInfo;
 
+  descriptorWrites[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+  descriptorWrites[2].dstSet = _descriptorSet;
+  descriptorWrites[2].dstBinding = 2;
+  descriptorWrites[2].dstArrayElement = 0;
+  descriptorWrites[2].descriptorType = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+  descriptorWrites[2].descriptorCount = 1;
+  descriptorWrites[2].pBufferInfo = &objectInfo;
+
   vkUpdateDescriptorSets ( _device,
                            static_cast<uint32_t>(descriptorWrites
                              .size ( )),
@@ -1388,167 +2512,1806 @@ void vulkanApp::createBuffer ( VkDeviceSize size,
   vkBindBufferMemory ( _device, buffer, bufferMemory, 0 );
 }
 
-VkCommandBuffer vulkanApp::beginSingleTimeCommands ( )
+//Abre un lote de subidas: las copias se graban en un único command buffer
+//de la cola de transferencia; lo que necesite etapas gráficas va en
+//_graphicsCommandBuffer
+void vulkanApp::beginUploadBatch ( UploadBatch& batch )
 {
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  batch._ownershipTransfer = _queueFamilyIndices._transferFamily
+    != _queueFamilyIndices._graphicsFamily;
+  batch._separateQueue = _transferQueue != _graphicsQueue;
+
   VkCommandBufferAllocateInfo allocInfo = {};
   allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
   allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocInfo.commandPool = _commandPool;
+  allocInfo.commandPool = _transferCommandPool;
   allocInfo.commandBufferCount = 1;
 
-  VkCommandBuffer commandBuffer;
-  vkAllocateCommandBuffers ( _device, &allocInfo, &commandBuffer );
+  if ( vkAllocateCommandBuffers ( _device, &allocInfo, &batch._commandBuffer )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to allocate upload command buffer!" );
+  }
+
+  allocInfo.commandPool = _commandPool;
+  if ( vkAllocateCommandBuffers ( _device,
+                                  &allocInfo,
+                                  &batch._graphicsCommandBuffer )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to allocate upload command buffer!" );
+  }
+
+  batch._transferTicket = 0;
+  batch._ticket = 0;
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  vkBeginCommandBuffer ( batch._commandBuffer, &beginInfo );
+  vkBeginCommandBuffer ( batch._graphicsCommandBuffer, &beginInfo );
+  batch._state = UploadBatch::RECORDING;
+}
+
+//Crea un staging buffer con los datos dados. El lote es su propietario y
+//lo libera cuando la GPU termina la copia
+VkBuffer vulkanApp::stageUpload ( UploadBatch& batch,
+                                  const void* data,
+                                  VkDeviceSize size )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  VkBuffer stagingBuffer;
+  VkDeviceMemory stagingBufferMemory;
+  createBuffer ( size,
+                 VK_BUFFER_USAGE_TRANSFER_SRC_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 stagingBuffer,
+                 stagingBufferMemory );
+
+  void* mapped;
+  vkMapMemory ( _device, stagingBufferMemory, 0, size, 0, &mapped );
+  memcpy ( mapped, data, static_cast<size_t>(size));
+  vkUnmapMemory ( _device, stagingBufferMemory );
+
+  batch._stagingBuffers.push_back ( stagingBuffer );
+  batch._stagingBuffersMemory.push_back ( stagingBufferMemory );
+
+  return stagingBuffer;
+}
+
+//Entrega una imagen recién copiada a la cola gráfica. Solo se apunta: las
+//barreras de todo el lote se graban juntas en recordHandOffs
+void vulkanApp::recordImageHandOff ( UploadBatch& batch,
+                                     VkImage image,
+                                     VkImageLayout newLayout,
+                                     VkPipelineStageFlags dstStage,
+                                     VkAccessFlags dstAccess )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  ImageUsage usage;
+  usage._layout = newLayout;
+  usage._stage = dstStage;
+  usage._access = dstAccess;
+
+  batch._imageHandOffs.emplace_back ( image, usage );
+  batch._handOffStages |= dstStage;
+}
+
+void vulkanApp::recordBufferHandOff ( UploadBatch& batch,
+                                      VkBuffer buffer,
+                                      VkPipelineStageFlags dstStage,
+                                      VkAccessFlags dstAccess )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.buffer = buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = dstAccess;
+
+  batch._bufferHandOffs.push_back ( barrier );
+  batch._handOffStages |= dstStage;
+}
+
+//Graba las entregas del lote. Con familias distintas va un release con
+//todas en la cola de transferencia y un acquire con todas en la gráfica;
+//si no, basta una barrera en la parte gráfica, emitida por el tracker
+void vulkanApp::recordHandOffs ( UploadBatch& batch )
+{
+  if ( batch._imageHandOffs.empty ( ) && batch._bufferHandOffs.empty ( ))
+  {
+    return;
+  }
+
+  if ( !batch._ownershipTransfer )
+  {
+    for ( const auto& handOff : batch._imageHandOffs )
+    {
+      _imageTracker.require ( handOff.first, handOff.second );
+    }
+    VkAccessFlags bufferAccess = 0;
+    for ( const VkBufferMemoryBarrier& barrier : batch._bufferHandOffs )
+    {
+      bufferAccess |= barrier.dstAccessMask;
+    }
+    if ( bufferAccess != 0 )
+    {
+      _imageTracker.requireMemory ( VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                    VK_ACCESS_TRANSFER_WRITE_BIT,
+                                    batch._handOffStages,
+                                    bufferAccess );
+    }
+    _imageTracker.flush ( batch._graphicsCommandBuffer );
+  }
+  else
+  {
+    std::vector < VkImageMemoryBarrier > imageBarriers;
+    for ( const auto& handOff : batch._imageHandOffs )
+    {
+      VkImage image = handOff.first;
+      VkImageMemoryBarrier barrier = {};
+      barrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+      barrier.oldLayout = _imageTracker.usage ( image )._layout;
+      barrier.newLayout = handOff.second._layout;
+      barrier.image = image;
+      barrier.subresourceRange.aspectMask = _imageTracker.aspectMask ( image );
+      barrier.subresourceRange.baseMipLevel = 0;
+      barrier.subresourceRange.levelCount = VK_REMAINING_MIP_LEVELS;
+      barrier.subresourceRange.baseArrayLayer = 0;
+      barrier.subresourceRange.layerCount = VK_REMAINING_ARRAY_LAYERS;
+      barrier.srcQueueFamilyIndex = _queueFamilyIndices._transferFamily;
+      barrier.dstQueueFamilyIndex = _queueFamilyIndices._graphicsFamily;
+      barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+      barrier.dstAccessMask = 0;
+      imageBarriers.push_back ( barrier );
+
+      //El cambio de familia no pasa por el tracker
+      _imageTracker.assume ( image, handOff.second );
+    }
+
+    std::vector < VkBufferMemoryBarrier > bufferBarriers ( batch._bufferHandOffs );
+    for ( VkBufferMemoryBarrier& barrier : bufferBarriers )
+    {
+      barrier.srcQueueFamilyIndex = _queueFamilyIndices._transferFamily;
+      barrier.dstQueueFamilyIndex = _queueFamilyIndices._graphicsFamily;
+      barrier.dstAccessMask = 0;
+    }
+
+    //Release
+    vkCmdPipelineBarrier ( batch._commandBuffer,
+                           VK_PIPELINE_STAGE_TRANSFER_BIT,
+                           VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT,
+                           0,
+                           0, nullptr,
+                           static_cast<uint32_t>(bufferBarriers.size ( )),
+                           bufferBarriers.data ( ),
+                           static_cast<uint32_t>(imageBarriers.size ( )),
+                           imageBarriers.data ( ));
+
+    //Acquire
+    for ( size_t i = 0; i < imageBarriers.size ( ); i++ )
+    {
+      imageBarriers[i].srcAccessMask = 0;
+      imageBarriers[i].dstAccessMask = batch._imageHandOffs[i].second._access;
+    }
+    for ( size_t i = 0; i < bufferBarriers.size ( ); i++ )
+    {
+      bufferBarriers[i].srcAccessMask = 0;
+      bufferBarriers[i].dstAccessMask = batch._bufferHandOffs[i].dstAccessMask;
+    }
+    vkCmdPipelineBarrier ( batch._graphicsCommandBuffer,
+                           batch._handOffStages,
+                           batch._handOffStages,
+                           0,
+                           0, nullptr,
+                           static_cast<uint32_t>(bufferBarriers.size ( )),
+                           bufferBarriers.data ( ),
+                           static_cast<uint32_t>(imageBarriers.size ( )),
+                           imageBarriers.data ( ));
+  }
+
+  batch._imageHandOffs.clear ( );
+  batch._bufferHandOffs.clear ( );
+  batch._handOffStages = 0;
+}
+
+//Cierra y envía el lote. No bloquea: con cola de transferencia propia la
+//parte gráfica se envía cuando la copia termina (ver pollUploadBatch)
+void vulkanApp::submitUploadBatch ( UploadBatch& batch )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  recordHandOffs ( batch );
+
+  if ( vkEndCommandBuffer ( batch._commandBuffer ) != VK_SUCCESS
+    || vkEndCommandBuffer ( batch._graphicsCommandBuffer ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to record upload command buffer!" );
+  }
+
+  GpuSubmission submission;
+  submission._commandBuffers.push_back ( batch._commandBuffer );
+
+  //Misma cola: ambas partes en un único envío y en orden
+  GpuTimeline& timeline =
+    batch._separateQueue ? _transferTimeline : _graphicsTimeline;
+  if ( !batch._separateQueue )
+  {
+    submission._commandBuffers.push_back ( batch._graphicsCommandBuffer );
+  }
+
+  batch._transferTicket = timeline.submit ( submission );
+
+  //Los staging solo los lee la copia: se liberan en cuanto termina
+  std::vector < VkBuffer > stagingBuffers;
+  std::vector < VkDeviceMemory > stagingBuffersMemory;
+  stagingBuffers.swap ( batch._stagingBuffers );
+  stagingBuffersMemory.swap ( batch._stagingBuffersMemory );
+  VkDevice device = _device;
+  timeline.deferDestroy ( batch._transferTicket,
+                          [ device, stagingBuffers, stagingBuffersMemory ] ( )
+                          {
+                            for ( size_t i = 0; i < stagingBuffers.size ( ); i++ )
+                            {
+                              vkDestroyBuffer ( device,
+                                                stagingBuffers[i],
+                                                nullptr );
+                              vkFreeMemory ( device,
+                                             stagingBuffersMemory[i],
+                                             nullptr );
+                            }
+                          } );
+
+  if ( !batch._separateQueue )
+  {
+    batch._ticket = batch._transferTicket;
+    batch._state = UploadBatch::GRAPHICS_PENDING;
+    return;
+  }
+
+  batch._state = UploadBatch::TRANSFER_PENDING;
+}
+
+//Parte gráfica del lote (acquire de ownership y transiciones). Espera al
+//ticket de la copia en el timeline de transferencia.
+void vulkanApp::submitUploadGraphicsPart ( UploadBatch& batch )
+{
+  GpuSubmission submission;
+  submission.waitTicket ( _transferTimeline,
+                          batch._transferTicket,
+                          VK_PIPELINE_STAGE_ALL_COMMANDS_BIT );
+  submission._commandBuffers.push_back ( batch._graphicsCommandBuffer );
+
+  batch._ticket = _graphicsTimeline.submit ( submission );
+  batch._state = UploadBatch::GRAPHICS_PENDING;
+}
+
+//Envía el lote y lo deja en vuelo; el renderLoop lo retira al completarse
+//sin detener el render. El lote pasado no debe reutilizarse.
+void vulkanApp::streamUploadBatch ( UploadBatch& batch )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  submitUploadBatch ( batch );
+  _pendingUploads.push_back ( batch );
+}
+
+void vulkanApp::retireUploads ( )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  for ( auto it = _pendingUploads.begin ( ); it != _pendingUploads.end ( ); )
+  {
+    if ( pollUploadBatch ( *it ))
+    {
+      it = _pendingUploads.erase ( it );
+    }
+    else
+    {
+      ++it;
+    }
+  }
+}
+
+//Devuelve true (y libera los recursos del lote) si la GPU ya ha terminado
+bool vulkanApp::pollUploadBatch ( UploadBatch& batch )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  if ( batch._state == UploadBatch::TRANSFER_PENDING )
+  {
+    //La copia ya terminó: el acquire no hará esperar a la cola gráfica
+    if ( !_transferTimeline.isComplete ( batch._transferTicket ))
+    {
+      return false;
+    }
+
+    submitUploadGraphicsPart ( batch );
+  }
+
+  if ( batch._state != UploadBatch::GRAPHICS_PENDING
+    || !_graphicsTimeline.isComplete ( batch._ticket ))
+  {
+    return false;
+  }
+
+  releaseUploadBatch ( batch );
+  return true;
+}
+
+void vulkanApp::waitUploadBatch ( UploadBatch& batch )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  if ( batch._state == UploadBatch::RECORDING )
+  {
+    submitUploadBatch ( batch );
+  }
+
+  if ( batch._state == UploadBatch::TRANSFER_PENDING )
+  {
+    submitUploadGraphicsPart ( batch );
+  }
+
+  if ( batch._state != UploadBatch::GRAPHICS_PENDING )
+  {
+    return;
+  }
+
+  _graphicsTimeline.wait ( batch._ticket );
+
+  releaseUploadBatch ( batch );
+}
+
+void vulkanApp::releaseUploadBatch ( UploadBatch& batch )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  vkFreeCommandBuffers ( _device,
+                         _transferCommandPool,
+                         1,
+                         &batch._commandBuffer );
+  vkFreeCommandBuffers ( _device,
+                         _commandPool,
+                         1,
+                         &batch._graphicsCommandBuffer );
+
+  batch._commandBuffer = VK_NULL_HANDLE;
+  batch._graphicsCommandBuffer = VK_NULL_HANDLE;
+  batch._state = UploadBatch::RELEASED;
+
+  if ( batch._onComplete )
+  {
+    batch._onComplete ( );
+  }
+}
+
+void vulkanApp::copyBuffer ( VkCommandBuffer commandBuffer,
+                             VkBuffer srcBuffer,
+                             VkBuffer dstBuffer,
+                             VkDeviceSize size )
+{
+  VkBufferCopy copyRegion = {};
+  copyRegion.size = size;
+  vkCmdCopyBuffer ( commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion );
+}
+
+uint32_t vulkanApp::findMemoryType ( uint32_t typeFilter,
+                                     VkMemoryPropertyFlags properties )
+{
+  VkPhysicalDeviceMemoryProperties memProperties;
+  vkGetPhysicalDeviceMemoryProperties ( _physicalDevice, &memProperties );
+
+  for ( uint32_t i = 0; i < memProperties.memoryTypeCount; i++ )
+  {
+    if (( typeFilter & ( 1 << i ))
+      && ( memProperties.memoryTypes[i].propertyFlags & properties )
+        == properties )
+    {
+      return i;
+    }
+  }
+
+  throw std::runtime_error ( "failed to find suitable memory type!" );
+}
+
+void vulkanApp::createReadbackRing ( uint32_t slotCount )
+{
+  //Los buffers se crean bajo demanda con el tamaño de la primera lectura
+  _readbackSlots.resize ( slotCount );
+}
+
+void vulkanApp::destroyReadbackRing ( )
+{
+  for ( auto& slot : _readbackSlots )
+  {
+    if ( slot._buffer != VK_NULL_HANDLE )
+    {
+      vkUnmapMemory ( _device, slot._memory );
+      vkDestroyBuffer ( _device, slot._buffer, nullptr );
+      vkFreeMemory ( _device, slot._memory, nullptr );
+    }
+  }
+  _readbackSlots.clear ( );
+}
+
+//Hueco libre con al menos size bytes y su command buffer ya abierto.
+//nullptr si todos están en vuelo: quien llama decide si reintenta.
+//El hueco se reserva bajo _readbackMutex; el resto ya es solo suyo
+ReadbackSlot* vulkanApp::acquireReadbackSlot ( VkDeviceSize size )
+{
+  ReadbackSlot* slot = nullptr;
+  {
+    std::lock_guard < std::mutex > lock ( _readbackMutex );
+    for ( auto& candidate : _readbackSlots )
+    {
+      if ( candidate._state == ReadbackSlot::FREE )
+      {
+        slot = &candidate;
+        slot->_state = ReadbackSlot::RECORDED;
+        break;
+      }
+    }
+  }
+
+  if ( !slot )
+  {
+    return nullptr;
+  }
+
+  if ( slot->_capacity < size )
+  {
+    if ( slot->_buffer != VK_NULL_HANDLE )
+    {
+      vkUnmapMemory ( _device, slot->_memory );
+      vkDestroyBuffer ( _device, slot->_buffer, nullptr );
+      vkFreeMemory ( _device, slot->_memory, nullptr );
+    }
+
+    VkBufferCreateInfo bufferInfo = {};
+    bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+    bufferInfo.size = size;
+    bufferInfo.usage = VK_BUFFER_USAGE_TRANSFER_DST_BIT;
+    bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+    if ( vkCreateBuffer ( _device, &bufferInfo, nullptr, &slot->_buffer )
+      != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to create readback buffer!" );
+    }
+
+    VkMemoryRequirements memRequirements;
+    vkGetBufferMemoryRequirements ( _device, slot->_buffer, &memRequirements );
+
+    //Host-cached para que la CPU lea rápido; si no hay, coherente
+    VkPhysicalDeviceMemoryProperties memProperties;
+    vkGetPhysicalDeviceMemoryProperties ( _physicalDevice, &memProperties );
+
+    VkMemoryPropertyFlags cached = VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+      | VK_MEMORY_PROPERTY_HOST_CACHED_BIT;
+    bool hasCached = false;
+    for ( uint32_t i = 0; i < memProperties.memoryTypeCount; i++ )
+    {
+      if (( memRequirements.memoryTypeBits & ( 1 << i ))
+        && ( memProperties.memoryTypes[i].propertyFlags & cached ) == cached )
+      {
+        hasCached = true;
+      }
+    }
+
+    uint32_t memoryType = findMemoryType (
+      memRequirements.memoryTypeBits,
+      hasCached ? cached
+                : VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                  | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT );
+    slot->_coherent = ( memProperties.memoryTypes[memoryType].propertyFlags
+      & VK_MEMORY_PROPERTY_HOST_COHERENT_BIT ) != 0;
+
+    VkMemoryAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+    allocInfo.allocationSize = memRequirements.size;
+    allocInfo.memoryTypeIndex = memoryType;
+
+    if ( vkAllocateMemory ( _device, &allocInfo, nullptr, &slot->_memory )
+      != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to allocate readback memory!" );
+    }
+
+    vkBindBufferMemory ( _device, slot->_buffer, slot->_memory, 0 );
+    vkMapMemory ( _device, slot->_memory, 0, VK_WHOLE_SIZE, 0, &slot->_mapped );
+    slot->_capacity = size;
+  }
+
+  VkCommandBufferAllocateInfo allocInfo = {};
+  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+  allocInfo.commandPool = _commandPool;
+  allocInfo.commandBufferCount = 1;
+
+  if ( vkAllocateCommandBuffers ( _device, &allocInfo, &slot->_commandBuffer )
+    != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to allocate readback command buffer!" );
+  }
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  vkBeginCommandBuffer ( slot->_commandBuffer, &beginInfo );
+
+  slot->_result = ReadbackResult ( );
+  slot->_result._size = size;
+
+  return slot;
+}
+
+//Graba la copia de una imagen de color al hueco. La imagen vuelve a su
+//layout anterior al terminar la copia
+ReadbackSlot* vulkanApp::recordImageReadback ( VkImage image,
+                                               VkFormat format,
+                                               VkExtent2D extent,
+                                               ReadbackCallback callback )
+{
+  uint32_t rowPitch = extent.width * formatTexelSize ( format );
+  ReadbackSlot* slot =
+    acquireReadbackSlot ( static_cast<VkDeviceSize>(rowPitch) * extent.height );
+  if ( !slot )
+  {
+    return nullptr;
+  }
+
+  ImageUsage previous = _imageTracker.usage ( image );
+  _imageTracker.require ( image, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL );
+  _imageTracker.flush ( slot->_commandBuffer );
+
+  VkBufferImageCopy region = {};
+  region.bufferOffset = 0;
+  region.bufferRowLength = 0;
+  region.bufferImageHeight = 0;
+  region.imageSubresource.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
+  region.imageSubresource.mipLevel = 0;
+  region.imageSubresource.baseArrayLayer = 0;
+  region.imageSubresource.layerCount = 1;
+  region.imageOffset = { 0, 0, 0 };
+  region.imageExtent = { extent.width, extent.height, 1 };
+
+  vkCmdCopyImageToBuffer ( slot->_commandBuffer,
+                           image,
+                           VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL,
+                           slot->_buffer,
+                           1,
+                           &region );
+
+  if ( previous._layout != VK_IMAGE_LAYOUT_UNDEFINED )
+  {
+    _imageTracker.require ( image, previous );
+    _imageTracker.flush ( slot->_commandBuffer );
+  }
+
+  slot->_result._width = extent.width;
+  slot->_result._height = extent.height;
+  slot->_result._rowPitch = rowPitch;
+  slot->_result._format = format;
+  slot->_callback = callback;
+
+  return slot;
+}
+
+//Cierra el command buffer del hueco; la escritura de la copia se hace
+//visible al host
+void vulkanApp::submitReadback ( ReadbackSlot& slot )
+{
+  VkBufferMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_BUFFER_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+  barrier.srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+  barrier.buffer = slot._buffer;
+  barrier.offset = 0;
+  barrier.size = VK_WHOLE_SIZE;
+
+  vkCmdPipelineBarrier ( slot._commandBuffer,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         VK_PIPELINE_STAGE_HOST_BIT,
+                         0,
+                         0, nullptr,
+                         1, &barrier,
+                         0, nullptr );
+
+  if ( vkEndCommandBuffer ( slot._commandBuffer ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to record readback command buffer!" );
+  }
+}
+
+//Lectura de una imagen offscreen. No bloquea: el callback se invoca desde
+//pollReadbacks cuando la GPU termina. false si no hay hueco libre
+bool vulkanApp::readbackImage ( VkImage image,
+                                VkFormat format,
+                                VkExtent2D extent,
+                                ReadbackCallback callback )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  ReadbackSlot* slot = recordImageReadback ( image, format, extent, callback );
+  if ( !slot )
+  {
+    return false;
+  }
+
+  submitReadback ( *slot );
+
+  GpuSubmission submission;
+  submission._commandBuffers.push_back ( slot->_commandBuffer );
+  markReadbackPending ( *slot, _graphicsTimeline.submit ( submission ));
+
+  return true;
+}
+
+//Lectura de un buffer. Se espera a cualquier escritura previa en la cola
+bool vulkanApp::readbackBuffer ( VkBuffer buffer,
+                                 VkDeviceSize offset,
+                                 VkDeviceSize size,
+                                 ReadbackCallback callback )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  ReadbackSlot* slot = acquireReadbackSlot ( size );
+  if ( !slot )
+  {
+    return false;
+  }
+
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_MEMORY_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+  vkCmdPipelineBarrier ( slot->_commandBuffer,
+                         VK_PIPELINE_STAGE_ALL_COMMANDS_BIT,
+                         VK_PIPELINE_STAGE_TRANSFER_BIT,
+                         0,
+                         1, &barrier,
+                         0, nullptr,
+                         0, nullptr );
+
+  VkBufferCopy copyRegion = {};
+  copyRegion.srcOffset = offset;
+  copyRegion.dstOffset = 0;
+  copyRegion.size = size;
+  vkCmdCopyBuffer ( slot->_commandBuffer, buffer, slot->_buffer, 1, &copyRegion );
+
+  slot->_callback = callback;
+  submitReadback ( *slot );
+
+  GpuSubmission submission;
+  submission._commandBuffers.push_back ( slot->_commandBuffer );
+  markReadbackPending ( *slot, _graphicsTimeline.submit ( submission ));
+
+  return true;
+}
+
+void vulkanApp::markReadbackPending ( ReadbackSlot& slot, GpuTicket ticket )
+{
+  std::lock_guard < std::mutex > lock ( _readbackMutex );
+  slot._ticket = ticket;
+  slot._state = ReadbackSlot::PENDING;
+}
+
+//Captura el próximo frame presentado. La copia va en el mismo envío que
+//el frame, justo antes de la presentación
+bool vulkanApp::readbackSwapChain ( ReadbackCallback callback )
+{
+  if ( !_swapChainReadable )
+  {
+    return false;
+  }
+
+  std::lock_guard < std::mutex > lock ( _swapChainReadbackMutex );
+  _swapChainReadback = callback;
+  return true;
+}
+
+//Entrega las lecturas que ya han terminado en la GPU. Los callbacks se
+//ejecutan en el hilo de render
+void vulkanApp::pollReadbacks ( )
+{
+  //Los callbacks se llaman sin el lock: pueden pedir otra lectura
+  std::vector < ReadbackSlot* > completed;
+  {
+    std::lock_guard < std::mutex > lock ( _readbackMutex );
+    for ( auto& slot : _readbackSlots )
+    {
+      if ( slot._state == ReadbackSlot::PENDING
+        && _graphicsTimeline.isComplete ( slot._ticket ))
+      {
+        completed.push_back ( &slot );
+      }
+    }
+  }
+
+  for ( ReadbackSlot* slot : completed )
+  {
+    completeReadback ( *slot );
+  }
+}
+
+void vulkanApp::waitReadbacks ( )
+{
+  std::vector < ReadbackSlot* > pending;
+  {
+    std::lock_guard < std::mutex > lock ( _readbackMutex );
+    for ( auto& slot : _readbackSlots )
+    {
+      if ( slot._state == ReadbackSlot::PENDING )
+      {
+        pending.push_back ( &slot );
+      }
+    }
+  }
+
+  for ( ReadbackSlot* slot : pending )
+  {
+    _graphicsTimeline.wait ( slot->_ticket );
+    completeReadback ( *slot );
+  }
+}
+
+void vulkanApp::completeReadback ( ReadbackSlot& slot )
+{
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  if ( !slot._coherent )
+  {
+    VkMappedMemoryRange range = {};
+    range.sType = VK_STRUCTURE_TYPE_MAPPED_MEMORY_RANGE;
+    range.memory = slot._memory;
+    range.offset = 0;
+    range.size = VK_WHOLE_SIZE;
+    vkInvalidateMappedMemoryRanges ( _device, 1, &range );
+  }
+
+  vkFreeCommandBuffers ( _device, _commandPool, 1, &slot._commandBuffer );
+  slot._commandBuffer = VK_NULL_HANDLE;
+
+  //El hueco sigue ocupado durante el callback: si pide otra lectura no
+  //puede reutilizar (ni redimensionar) este buffer
+  ReadbackCallback callback;
+  callback.swap ( slot._callback );
+  ReadbackResult result = slot._result;
+  result._data = slot._mapped;
+
+  if ( callback )
+  {
+    callback ( result );
+  }
+
+  std::lock_guard < std::mutex > lock ( _readbackMutex );
+  slot._state = ReadbackSlot::FREE;
+}
+
+//Creación de los command buffers
+void vulkanApp::createCommandBuffers ( )
+{
+  //Un pool transitorio por frame en vuelo. Sin reutilización tiene un
+  //solo primario y se reinicia entero cada frame. Con reutilización hay un
+  //primario por imagen que se regraba por separado (o se reenvía si no
+  //cambia nada), así que el pool no se puede reiniciar entero. Un frame en
+  //vuelo no se solapa consigo mismo: no hace falta SIMULTANEOUS_USE
+  VkCommandPoolCreateInfo poolInfo = {};
+  poolInfo.sType = VK_STRUCTURE_TYPE_COMMAND_POOL_CREATE_INFO;
+  poolInfo.queueFamilyIndex = _queueFamilyIndices._graphicsFamily;
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+  if ( _commandBufferReuse )
+  {
+    poolInfo.flags |= VK_COMMAND_POOL_CREATE_RESET_COMMAND_BUFFER_BIT;
+  }
+
+  for ( auto& frame : _frames )
+  {
+    if ( vkCreateCommandPool ( _device,
+                               &poolInfo,
+                               nullptr,
+                               &frame._commandPool ) != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to create frame command pool!" );
+    }
+  }
+
+  //Los secundarios se regraban juntos: sus pools sí se reinician enteros
+  poolInfo.flags = VK_COMMAND_POOL_CREATE_TRANSIENT_BIT;
+
+  //Sin workers de grabación (se arrancan en initVulkan)
+  if ( _recordWorkers.workerCount ( ) < 2 )
+  {
+    return;
+  }
+
+  //Un pool por worker y frame; se reinician junto al del frame
+  for ( auto& frame : _frames )
+  {
+    frame._workerPools.resize ( _recordWorkers.workerCount ( ));
+    frame._secondaryBuffers.resize ( _recordWorkers.workerCount ( ));
+
+    for ( size_t i = 0; i < frame._workerPools.size ( ); i++ )
+    {
+      if ( vkCreateCommandPool ( _device,
+                                 &poolInfo,
+                                 nullptr,
+                                 &frame._workerPools[i] ) != VK_SUCCESS )
+      {
+        throw std::runtime_error ( "failed to create worker command pool!" );
+      }
+
+      VkCommandBufferAllocateInfo allocInfo = {};
+      allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+      allocInfo.commandPool = frame._workerPools[i];
+      allocInfo.level = VK_COMMAND_BUFFER_LEVEL_SECONDARY;
+      allocInfo.commandBufferCount = 1;
+
+      if ( vkAllocateCommandBuffers ( _device,
+                                      &allocInfo,
+                                      &frame._secondaryBuffers[i] )
+        != VK_SUCCESS )
+      {
+        throw std::runtime_error ( "failed to allocate command buffers!" );
+      }
+    }
+  }
+}
+
+//Grabación del frame: tramo del UBO del frame y transformaciones por
+//objeto como push constants. Los datos que van en buffers mapeados se
+//escriben siempre; si la huella de lo que se grabaría coincide con la del
+//primario de la imagen, este se reenvía sin regrabar
+void vulkanApp::recordCommandBuffer ( uint32_t frameIndex,
+                                      uint32_t imageIndex,
+                                      const FrameSnapshot& snapshot )
+{
+  //drawFrame ya ha esperado el último envío del frame
+  FrameData& frame = _frames[frameIndex];
+
+  //Camino indirecto: la lista entera se escribe en el tramo del frame y
+  //se dibuja con una llamada. Con culling en GPU los comandos los genera
+  //el compute antes del render pass
+  bool indirect = _drawPath != DRAW_DIRECT;
+  uint32_t indirectCount = 0;
+
+  //Con culling en CPU solo se graban los visibles
+  const std::vector < ObjectPushConstants >& objects =
+    _cpuCulling && _drawPath != DRAW_GPU_CULLED
+    ? cullObjects ( snapshot._objects )
+    : snapshot._objects;
+  if ( _drawPath == DRAW_GPU_CULLED )
+  {
+    indirectCount = writeCullInput ( frameIndex, snapshot );
+  }
+  else if ( indirect )
+  {
+    indirectCount = writeIndirectDraws ( frameIndex, objects );
+  }
+
+  //Las instancias no pasan por el culling
+  uint32_t instanceCount = writeInstances ( frameIndex, snapshot._instances );
+
+  //Lo que no cabe en el buffer indirecto va por el camino directo,
+  //ordenado para ahorrar cambios de estado
+  buildRenderQueue ( snapshot, objects, indirectCount, instanceCount );
+
+  //Muchos draws directos: se reparten entre los workers en secundarios
+  bool parallel = !indirect && !frame._secondaryBuffers.empty ( )
+    && _renderQueue.size ( ) >= _parallelRecordThreshold;
+
+  RecordedCommandBuffer& recorded = recordedCommandBuffer ( frame, imageIndex );
+  frame._commandBuffer = recorded._commandBuffer;
+
+  //Con oclusión la grabación actualiza el seguimiento de layouts y la
+  //viewProj de la pirámide: se regraba siempre
+  bool reusable = _commandBufferReuse && !_occlusionCulling;
+  uint64_t fingerprint = reusable
+    ? drawListFingerprint ( imageIndex,
+                            objects,
+                            indirectCount,
+                            instanceCount,
+                            parallel )
+    : 0;
+  if ( reusable && recorded._valid && recorded._fingerprint == fingerprint )
+  {
+    _gpuProfiler.resubmitFrame ( frameIndex, recorded._profilerScopes );
+    reportRecording ( recorded, true );
+    return;
+  }
+
+  //Los secundarios se regraban: los primarios que los ejecutan dejan de
+  //valer
+  if ( parallel )
+  {
+    for ( auto& other : frame._recorded )
+    {
+      other._valid = other._valid && !other._usesSecondaries;
+    }
+    for ( auto pool : frame._workerPools )
+    {
+      vkResetCommandPool ( _device, pool, 0 );
+    }
+  }
+
+  //drawFrame ya ha esperado el último envío del frame: sin reutilización
+  //el pool entero se reinicia de una vez. Con ella vkBeginCommandBuffer
+  //reinicia solo el primario de la imagen
+  if ( !_commandBufferReuse )
+  {
+    vkResetCommandPool ( _device, frame._commandPool, 0 );
+  }
+  recorded._valid = false;
+  VkCommandBuffer commandBuffer = recorded._commandBuffer;
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = reusable ? 0 : VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+
+  vkBeginCommandBuffer ( commandBuffer, &beginInfo );
+
+  _gpuProfiler.beginFrame ( commandBuffer, frameIndex );
+  uint32_t frameScope = _gpuProfiler.beginScope ( commandBuffer, "frame" );
+
+  if ( _drawPath == DRAW_GPU_CULLED )
+  {
+    uint32_t cullScope = _gpuProfiler.beginScope ( commandBuffer, "culling" );
+    recordCulling ( commandBuffer, frameIndex, indirectCount );
+    _gpuProfiler.endScope ( commandBuffer, cullScope );
+  }
+
+  VkRenderPassBeginInfo renderPassInfo = {};
+  renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
+  renderPassInfo.renderPass = _renderPass;
+  renderPassInfo.framebuffer = _swapChainFramebuffers[imageIndex];
+  renderPassInfo.renderArea.offset = { 0, 0 };
+  renderPassInfo.renderArea.extent = _swapChainExtent;
+
+  //Color de limpiado
+  std::array < VkClearValue, 2 > clearValues = {};
+  clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+
+  //Efecto tormenta, el _color de limpiado es diferente en cada frambuffer se aprecia que no es regular el render
+  //if (i%2==0) clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+  //else        clearValues[0].color = { 1.0f, 1.0f, 1.0f, 1.0f };
+
+  clearValues[1].depthStencil = { 1.0f, 0 };
+
+  renderPassInfo.clearValueCount =
+    static_cast<uint32_t>(clearValues.size ( ));
+  renderPassInfo.pClearValues = clearValues.data ( );
+
+  //Coste del pase, incluido el geometry shader passthrough. Fuera del
+  //render pass: con contenido secundario el primario solo puede ejecutar
+  uint32_t passScope =
+    _gpuProfiler.beginScope ( commandBuffer,
+                              "geometry pass",
+                              !parallel || _inheritedQueries );
+
+  vkCmdBeginRenderPass ( commandBuffer,
+                         &renderPassInfo,
+                         parallel
+                         ? VK_SUBPASS_CONTENTS_SECONDARY_COMMAND_BUFFERS
+                         : VK_SUBPASS_CONTENTS_INLINE );
+
+  RenderQueueStats queueStats;
+  if ( parallel )
+  {
+    queueStats = recordDrawsParallel ( frameIndex,
+                                       imageIndex,
+                                       objects,
+                                       instanceCount );
+  }
+  else
+  {
+    if ( indirect )
+    {
+      recordIndirectDraws ( commandBuffer, frameIndex, indirectCount );
+    }
+    queueStats = recordQueue ( commandBuffer,
+                               frameIndex,
+                               objects,
+                               instanceCount,
+                               0,
+                               _renderQueue.size ( ));
+  }
+
+  vkCmdEndRenderPass ( commandBuffer );
+  _gpuProfiler.endScope ( commandBuffer, passScope );
+
+  //Pirámide para el culling del frame siguiente
+  if ( _occlusionCulling )
+  {
+    uint32_t hiZScope = _gpuProfiler.beginScope ( commandBuffer, "hiz pyramid" );
+    recordHiZBuild ( commandBuffer );
+    _gpuProfiler.endScope ( commandBuffer, hiZScope );
+  }
+
+  _gpuProfiler.endScope ( commandBuffer, frameScope );
+
+  if ( vkEndCommandBuffer ( commandBuffer ) != VK_SUCCESS )
+  {
+    throw std::runtime_error ( "failed to record command buffer!" );
+  }
+
+  recorded._valid = reusable;
+  recorded._fingerprint = fingerprint;
+  recorded._usesSecondaries = parallel;
+  recorded._queueStats = queueStats;
+  recorded._profilerScopes = _gpuProfiler.frameScopes ( frameIndex );
+  reportRecording ( recorded, false );
+}
+
+//Primario de la imagen (o del frame, sin reutilización) en el pool del
+//frame: se reserva la primera vez
+RecordedCommandBuffer& vulkanApp::recordedCommandBuffer ( FrameData& frame,
+                                                          uint32_t imageIndex )
+{
+  //Sin reutilización no hay nada que guardar por imagen: un primario por
+  //frame
+  uint32_t slot = _commandBufferReuse ? imageIndex : 0;
+  if ( frame._recorded.size ( ) <= slot )
+  {
+    frame._recorded.resize ( slot + 1 );
+  }
+
+  RecordedCommandBuffer& recorded = frame._recorded[slot];
+  if ( recorded._commandBuffer == VK_NULL_HANDLE )
+  {
+    VkCommandBufferAllocateInfo allocInfo = {};
+    allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+    allocInfo.commandPool = frame._commandPool;
+    allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+    allocInfo.commandBufferCount = 1;
+
+    if ( vkAllocateCommandBuffers ( _device,
+                                    &allocInfo,
+                                    &recorded._commandBuffer ) != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to allocate command buffers!" );
+    }
+  }
+
+  return recorded;
+}
+
+//Estadísticas de la cola del primario enviado y aciertos de la caché
+void vulkanApp::reportRecording ( const RecordedCommandBuffer& recorded,
+                                  bool reused )
+{
+  std::lock_guard < std::mutex > lock ( _frameTimingMutex );
+  _frameTiming._drawCalls = recorded._queueStats._draws;
+  _frameTiming._stateBinds = recorded._queueStats._binds;
+  _frameTiming._elidedBinds = recorded._queueStats._elidedBinds;
+  if ( reused )
+  {
+    _frameTiming._commandBufferHits++;
+  }
+  else
+  {
+    _frameTiming._commandBufferRecords++;
+  }
+}
+
+//Culling de frustum en CPU: esfera del mallado transformada por objeto y
+//prueba SIMD por tramos en los workers. Devuelve la lista compacta de los
+//visibles, en el orden original
+const std::vector < ObjectPushConstants >& vulkanApp::cullObjects (
+  const std::vector < ObjectPushConstants >& objects )
+{
+  _frustumCuller.resize ( objects.size ( ));
+
+  //Los objetos nuevos empiezan con matriz nula y escala 0, que es coherente
+  _cullLinear.resize ( objects.size ( ), glm::mat3 ( 0.0f ));
+  _cullScale.resize ( objects.size ( ), 0.0f );
+
+  glm::vec4 center ( glm::vec3 ( _meshBounds ), 1.0f );
+  _recordWorkers.parallelFor ( objects.size ( ),
+                               4096,
+    [&] ( size_t begin, size_t end, uint32_t )
+    {
+      for ( size_t i = begin; i < end; i++ )
+      {
+        const glm::mat4& model = objects[i]._model;
+        glm::vec4 position = model * center;
+
+        //Si gira o escala: una sola raíz sobre la mayor de las columnas
+        glm::mat3 linear ( model );
+        if ( linear != _cullLinear[i] )
+        {
+          _cullLinear[i] = linear;
+          _cullScale[i] = std::sqrt ( std::max ( std::max ( glm::dot ( linear[0], linear[0] ),
+                                                            glm::dot ( linear[1], linear[1] )),
+                                                 glm::dot ( linear[2], linear[2] )));
+        }
+        _frustumCuller.setSphere ( i,
+                                   position.x,
+                                   position.y,
+                                   position.z,
+                                   _meshBounds.w * _cullScale[i] );
+      }
+    } );
+
+  _frustumCuller.setFrustum ( &_frameViewProj[0][0] );
+  const std::vector < uint32_t >& visible =
+    _frustumCuller.cull ( CULL_SPHERES, &_recordWorkers );
+
+  _visibleObjects.resize ( visible.size ( ));
+  for ( size_t i = 0; i < visible.size ( ); i++ )
+  {
+    _visibleObjects[i] = objects[visible[i]];
+  }
+  return _visibleObjects;
+}
+
+//Claves de la cola de draws: todo va en el pase opaco y de momento hay un
+//solo material y un solo mallado
+enum QueuePipeline
+{
+  QUEUE_PIPELINE_SCENE,     //_graphicsPipeline, push constants por objeto
+  QUEUE_PIPELINE_INSTANCED  //_instancedPipeline, un draw para las instancias
+};
+static const uint32_t QUEUE_PASS_OPAQUE = 0;
+static const uint32_t QUEUE_MATERIAL_SCENE = 0;
+static const uint32_t QUEUE_MESH_SCENE = 0;
+
+//Cola del frame: objetos del camino directo a partir de first, de delante
+//a atrás, y el draw instanciado
+void vulkanApp::buildRenderQueue ( const FrameSnapshot& snapshot,
+                                   const std::vector < ObjectPushConstants >& objects,
+                                   size_t first,
+                                   uint32_t instanceCount )
+{
+  _renderQueue.clear ( );
+  _renderQueue.reserve ( objects.size ( ) - std::min ( first, objects.size ( )) + 1 );
+
+  float invFar = snapshot._farPlane > 0.0f ? 1.0f / snapshot._farPlane : 0.0f;
+  for ( size_t i = first; i < objects.size ( ); i++ )
+  {
+    glm::vec4 viewPosition = snapshot._view * objects[i]._model[3];
+    uint32_t depth = RenderQueue::quantizeDepth ( -viewPosition.z * invFar );
+    _renderQueue.push ( RenderQueue::makeKey ( QUEUE_PASS_OPAQUE,
+                                               QUEUE_PIPELINE_SCENE,
+                                               QUEUE_MATERIAL_SCENE,
+                                               QUEUE_MESH_SCENE,
+                                               depth ),
+                        static_cast<uint32_t>(i));
+  }
+
+  if ( instanceCount > 0 && _instancedPipeline != VK_NULL_HANDLE )
+  {
+    _renderQueue.push ( RenderQueue::makeKey ( QUEUE_PASS_OPAQUE,
+                                               QUEUE_PIPELINE_INSTANCED,
+                                               QUEUE_MATERIAL_SCENE,
+                                               QUEUE_MESH_SCENE,
+                                               0 ),
+                        0 );
+  }
+
+  _renderQueue.sort ( &_recordWorkers );
+}
+
+//Huella de todo lo que acaba dentro del primario: claves de la cola, push
+//constants, contadores, buffers, descriptor sets y pipelines. La
+//generación cubre los handles que se reutilizan al recrear recursos
+uint64_t vulkanApp::drawListFingerprint ( uint32_t imageIndex,
+                                          const std::vector < ObjectPushConstants >& objects,
+                                          uint32_t indirectCount,
+                                          uint32_t instanceCount,
+                                          bool parallel ) const
+{
+  uint64_t hash = hashCombine ( 0, _recordingGeneration );
+  hash = hashCombine ( hash, imageIndex );
+  hash = hashCombine ( hash, _drawPath );
+  hash = hashCombine ( hash, indirectCount );
+  hash = hashCombine ( hash, instanceCount );
+  hash = hashCombine ( hash, parallel ? 1 : 0 );
+  hash = hashCombine ( hash, _indices.size ( ));
+
+  hash = hashHandle ( hash, _swapChainFramebuffers[imageIndex] );
+  hash = hashHandle ( hash, _graphicsPipeline );
+  hash = hashHandle ( hash, _indirectPipeline );
+  hash = hashHandle ( hash, _instancedPipeline );
+  hash = hashHandle ( hash, _vertexBuffer );
+  hash = hashHandle ( hash, _indexBuffer );
+  hash = hashHandle ( hash, _instanceBuffer );
+  hash = hashHandle ( hash, _indirectBuffer );
+  hash = hashHandle ( hash, _descriptorSet );
+  if ( _drawPath == DRAW_GPU_CULLED )
+  {
+    hash = hashHandle ( hash, _cullPipeline );
+    hash = hashHandle ( hash, _cullSet );
+    hash = hashHandle ( hash, _cullHiZSet );
+  }
+
+  for ( const RenderItem& item : _renderQueue.items ( ))
+  {
+    hash = hashCombine ( hash, item._key );
+    if ( RenderQueue::pipeline ( item._key ) == QUEUE_PIPELINE_SCENE )
+    {
+      hash = hashBytes ( hash,
+                         &objects[item._object],
+                         sizeof ( ObjectPushConstants ));
+    }
+  }
+
+  return hash;
+}
+
+//Draws [begin, end) de la cola ordenada. Cada campo de la clave solo se
+//vincula cuando cambia respecto al draw anterior. Vale para el primario y
+//para los secundarios (no heredan estado)
+RenderQueueStats vulkanApp::recordQueue ( VkCommandBuffer commandBuffer,
+                                          uint32_t frameIndex,
+                                          const std::vector < ObjectPushConstants >& objects,
+                                          uint32_t instanceCount,
+                                          size_t begin,
+                                          size_t end )
+{
+  RenderQueueStats stats;
+  if ( begin >= end )
+  {
+    return stats;
+  }
+
+  setDynamicState ( commandBuffer );
+
+  const std::vector < RenderItem >& items = _renderQueue.items ( );
+  uint64_t first = items[begin]._key;
+  uint32_t pipeline = ~RenderQueue::pipeline ( first );
+  uint32_t material = ~RenderQueue::material ( first );
+  uint32_t mesh = ~RenderQueue::mesh ( first );
+
+  for ( size_t i = begin; i < end; i++ )
+  {
+    uint64_t key = items[i]._key;
+
+    if ( RenderQueue::pipeline ( key ) != pipeline )
+    {
+      pipeline = RenderQueue::pipeline ( key );
+      vkCmdBindPipeline ( commandBuffer,
+                          VK_PIPELINE_BIND_POINT_GRAPHICS,
+                          pipeline == QUEUE_PIPELINE_INSTANCED
+                          ? _instancedPipeline
+                          : _graphicsPipeline );
+      stats._binds++;
+    }
+    else
+    {
+      stats._elidedBinds++;
+    }
+
+    //Layout compartido: los descriptores sobreviven al cambio de pipeline
+    if ( RenderQueue::material ( key ) != material )
+    {
+      material = RenderQueue::material ( key );
+      bindMaterial ( commandBuffer, frameIndex );
+      stats._binds++;
+    }
+    else
+    {
+      stats._elidedBinds++;
+    }
+
+    if ( RenderQueue::mesh ( key ) != mesh )
+    {
+      mesh = RenderQueue::mesh ( key );
+      bindMesh ( commandBuffer );
+      stats._binds++;
+    }
+    else
+    {
+      stats._elidedBinds++;
+    }
+
+    if ( pipeline == QUEUE_PIPELINE_INSTANCED )
+    {
+      //Todas las copias del mallado: el binding 1 avanza una vez por
+      //instancia
+      VkDeviceSize offset = frameIndex * _instanceSliceSize;
+      vkCmdBindVertexBuffers ( commandBuffer, 1, 1, &_instanceBuffer, &offset );
+
+      vkCmdDrawIndexed ( commandBuffer,
+                         static_cast<uint32_t>(_indices.size ( )),
+                         instanceCount,
+                         0,
+                         0,
+                         0 );
+    }
+    else
+    {
+      vkCmdPushConstants ( commandBuffer,
+                           _pipelineLayout,
+                           VK_SHADER_STAGE_VERTEX_BIT,
+                           0,
+                           sizeof ( ObjectPushConstants ),
+                           &objects[items[i]._object] );
+
+      vkCmdDrawIndexed ( commandBuffer,
+                         static_cast<uint32_t>(_indices.size ( )),
+                         1,
+                         0,
+                         0,
+                         0 );
+    }
+    stats._draws++;
+  }
+
+  return stats;
+}
 
-  VkCommandBufferBeginInfo beginInfo = {};
-  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+//Estado común a los caminos indirectos: dinámico, pipeline, geometría
+//compartida y descriptores con los tramos del frame
+void vulkanApp::bindSceneState ( VkCommandBuffer commandBuffer,
+                                 uint32_t frameIndex,
+                                 VkPipeline pipeline )
+{
+  setDynamicState ( commandBuffer );
 
-  vkBeginCommandBuffer ( commandBuffer, &beginInfo );
+  vkCmdBindPipeline ( commandBuffer,
+                      VK_PIPELINE_BIND_POINT_GRAPHICS,
+                      pipeline );
 
-  return commandBuffer;
+  bindMesh ( commandBuffer );
+  bindMaterial ( commandBuffer, frameIndex );
 }
 
-void vulkanApp::endSingleTimeCommands ( VkCommandBuffer commandBuffer )
+//Viewport y scissor: dinámicos en todos los pipelines gráficos
+void vulkanApp::setDynamicState ( VkCommandBuffer commandBuffer )
 {
-  vkEndCommandBuffer ( commandBuffer );
+  VkViewport viewport = {};
+  viewport.x = 0.0f;
+  viewport.y = 0.0f;
+  viewport.width = ( float ) _swapChainExtent.width;
+  viewport.height = ( float ) _swapChainExtent.height;
+  viewport.minDepth = 0.0f;
+  viewport.maxDepth = 1.0f;
+  vkCmdSetViewport ( commandBuffer, 0, 1, &viewport );
 
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &commandBuffer;
+  VkRect2D scissor = {};
+  scissor.offset = { 0, 0 };
+  scissor.extent = _swapChainExtent;
+  vkCmdSetScissor ( commandBuffer, 0, 1, &scissor );
+}
 
-  vkQueueSubmit ( _graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE );
-  vkQueueWaitIdle ( _graphicsQueue );
+//Geometría compartida por todos los draws
+void vulkanApp::bindMesh ( VkCommandBuffer commandBuffer )
+{
+  VkBuffer vertexBuffers[] = { _vertexBuffer };
+  VkDeviceSize offsets[] = { 0 };
+  vkCmdBindVertexBuffers ( commandBuffer,
+                           0,
+                           1,
+                           vertexBuffers,
+                           offsets );
 
-  vkFreeCommandBuffers ( _device, _commandPool, 1, &commandBuffer );
+  vkCmdBindIndexBuffer ( commandBuffer,
+                         _indexBuffer,
+                         0,
+                         VK_INDEX_TYPE_UINT32 );
 }
 
-void vulkanApp::copyBuffer ( VkBuffer srcBuffer,
-                             VkBuffer dstBuffer,
-                             VkDeviceSize size )
+//Descriptores de la escena con los tramos del frame
+void vulkanApp::bindMaterial ( VkCommandBuffer commandBuffer,
+                               uint32_t frameIndex )
 {
-  VkCommandBuffer commandBuffer = beginSingleTimeCommands ( );
+  //En orden de binding: UBO (0) y datos de objeto (2)
+  std::array < uint32_t, 2 > dynamicOffsets =
+    {{ static_cast<uint32_t>(frameIndex * _uniformSliceSize ),
+       static_cast<uint32_t>(frameIndex * _objectSliceSize ) }};
+  vkCmdBindDescriptorSets ( commandBuffer,
+                            VK_PIPELINE_BIND_POINT_GRAPHICS,
+                            _pipelineLayout,
+                            0,
+                            1,
+                            &_descriptorSet,
+                            static_cast<uint32_t>(dynamicOffsets.size ( )),
+                            dynamicOffsets.data ( ));
+}
 
-  VkBufferCopy copyRegion = {};
-  copyRegion.size = size;
-  vkCmdCopyBuffer ( commandBuffer, srcBuffer, dstBuffer, 1, &copyRegion );
+//Rellena el tramo del frame: datos de objeto y un comando por objeto que
+//lo selecciona con firstInstance (gl_InstanceIndex en el shader)
+uint32_t vulkanApp::writeIndirectDraws ( uint32_t frameIndex,
+                                         const std::vector < ObjectPushConstants >& objects )
+{
+  uint32_t drawCount =
+    static_cast<uint32_t>(std::min < size_t > ( objects.size ( ),
+                                                _maxIndirectDraws ));
+
+  ObjectGpuData* objectData = reinterpret_cast<ObjectGpuData*>(
+    static_cast<char*>(_objectBufferMapped)
+      + frameIndex * _objectSliceSize );
+  char* slice = static_cast<char*>(_indirectBufferMapped)
+    + frameIndex * _indirectSliceSize;
+  VkDrawIndexedIndirectCommand* commands =
+    reinterpret_cast<VkDrawIndexedIndirectCommand*>(slice
+      + INDIRECT_COMMANDS_OFFSET );
+
+  uint32_t indexCount = static_cast<uint32_t>(_indices.size ( ));
+  for ( uint32_t i = 0; i < drawCount; i++ )
+  {
+    objectData[i]._model = objects[i]._model;
+    objectData[i]._objectIndex = objects[i]._objectIndex;
+
+    commands[i].indexCount = indexCount;
+    commands[i].instanceCount = 1;
+    commands[i].firstIndex = 0;
+    commands[i].vertexOffset = 0;
+    commands[i].firstInstance = i;
+  }
+  std::memcpy ( slice, &drawCount, sizeof ( drawCount ));
 
-  endSingleTimeCommands ( commandBuffer );
+  return drawCount;
 }
 
-uint32_t vulkanApp::findMemoryType ( uint32_t typeFilter,
-                                     VkMemoryPropertyFlags properties )
+//Con drawIndirectCount el número de draws se lee del buffer (lo podrá
+//escribir la GPU); si no, multidraw o un draw indirecto por comando
+void vulkanApp::recordIndirectDraws ( VkCommandBuffer commandBuffer,
+                                      uint32_t frameIndex,
+                                      uint32_t drawCount )
 {
-  VkPhysicalDeviceMemoryProperties memProperties;
-  vkGetPhysicalDeviceMemoryProperties ( _physicalDevice, &memProperties );
+  bindSceneState ( commandBuffer, frameIndex, _indirectPipeline );
 
-  for ( uint32_t i = 0; i < memProperties.memoryTypeCount; i++ )
+  VkDeviceSize countOffset = frameIndex * _indirectSliceSize;
+  VkDeviceSize commandsOffset = countOffset + INDIRECT_COMMANDS_OFFSET;
+  uint32_t stride = sizeof ( VkDrawIndexedIndirectCommand );
+
+  if ( _drawIndirectCount )
   {
-    if (( typeFilter & ( 1 << i ))
-      && ( memProperties.memoryTypes[i].propertyFlags & properties )
-        == properties )
+    vkCmdDrawIndexedIndirectCount ( commandBuffer,
+                                    _indirectBuffer,
+                                    commandsOffset,
+                                    _indirectBuffer,
+                                    countOffset,
+                                    drawCount,
+                                    stride );
+  }
+  else if ( _multiDrawIndirect )
+  {
+    vkCmdDrawIndexedIndirect ( commandBuffer,
+                               _indirectBuffer,
+                               commandsOffset,
+                               drawCount,
+                               stride );
+  }
+  else
+  {
+    for ( uint32_t i = 0; i < drawCount; i++ )
     {
-      return i;
+      vkCmdDrawIndexedIndirect ( commandBuffer,
+                                 _indirectBuffer,
+                                 commandsOffset + i * stride,
+                                 1,
+                                 stride );
     }
   }
-
-  throw std::runtime_error ( "failed to find suitable memory type!" );
 }
 
-//Creación de los command buffers
-void vulkanApp::createCommandBuffers ( )
+//Buffer de instancias: un tramo por frame en vuelo. Crece al doble y el
+//anterior se libera cuando la GPU termina con los frames que lo leen
+void vulkanApp::ensureInstanceCapacity ( size_t instanceCount )
 {
-  //Tantos command buffers como framebuffers en el swapchain!!!
-  _commandBuffers.resize ( _swapChainFramebuffers.size ( ));
+  if ( instanceCount <= _instanceCapacity )
+  {
+    return;
+  }
 
-  VkCommandBufferAllocateInfo allocInfo = {};
-  allocInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-  allocInfo.commandPool = _commandPool;
-  allocInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-  allocInfo.commandBufferCount = ( uint32_t ) _commandBuffers.size ( );
+  if ( _instanceBuffer != VK_NULL_HANDLE )
+  {
+    VkDevice device = _device;
+    VkBuffer oldBuffer = _instanceBuffer;
+    VkDeviceMemory oldMemory = _instanceBufferMemory;
+    _graphicsTimeline.deferDestroy ( _graphicsTimeline.lastSubmitted ( ),
+      [ device, oldBuffer, oldMemory ] ( )
+      {
+        vkUnmapMemory ( device, oldMemory );
+        vkDestroyBuffer ( device, oldBuffer, nullptr );
+        vkFreeMemory ( device, oldMemory, nullptr );
+      } );
+  }
 
-  if (
-    vkAllocateCommandBuffers ( _device,
-                               &allocInfo,
-                               _commandBuffers.data ( ))
-      != VK_SUCCESS )
+  _recordingGeneration++;
+  _instanceCapacity = std::max < size_t > ( instanceCount,
+                                            _instanceCapacity * 2 );
+  _instanceSliceSize = _instanceCapacity * sizeof ( InstanceData );
+
+  createBuffer ( _instanceSliceSize * _framesInFlight,
+                 VK_BUFFER_USAGE_VERTEX_BUFFER_BIT,
+                 VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT
+                   | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT,
+                 _instanceBuffer,
+                 _instanceBufferMemory );
+
+  vkMapMemory ( _device,
+                _instanceBufferMemory,
+                0,
+                _instanceSliceSize * _framesInFlight,
+                0,
+                &_instanceBufferMapped );
+}
+
+//Copia las instancias del snapshot al tramo del frame
+uint32_t vulkanApp::writeInstances ( uint32_t frameIndex,
+                                     const std::vector < InstanceData >& instances )
+{
+  if ( instances.empty ( ))
   {
-    throw std::runtime_error ( "failed to allocate command buffers!" );
+    return 0;
   }
 
-  for ( size_t i = 0; i < _commandBuffers.size ( ); i++ )
+  ensureInstanceCapacity ( instances.size ( ));
+  std::memcpy ( static_cast<char*>(_instanceBufferMapped)
+                  + frameIndex * _instanceSliceSize,
+                instances.data ( ),
+                instances.size ( ) * sizeof ( InstanceData ));
+
+  return static_cast<uint32_t>(instances.size ( ));
+}
+
+//Tramo de origen del culling (todos los objetos) y parámetros del frame
+uint32_t vulkanApp::writeCullInput ( uint32_t frameIndex,
+                                     const FrameSnapshot& snapshot )
+{
+  uint32_t objectCount =
+    static_cast<uint32_t>(std::min < size_t > ( snapshot._objects.size ( ),
+                                                _maxIndirectDraws ));
+
+  ObjectGpuData* objects = reinterpret_cast<ObjectGpuData*>(
+    static_cast<char*>(_cullSourceBufferMapped)
+      + frameIndex * _objectSliceSize );
+  for ( uint32_t i = 0; i < objectCount; i++ )
   {
-    VkCommandBufferBeginInfo beginInfo = {};
-    beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-    beginInfo.flags = VK_COMMAND_BUFFER_USAGE_SIMULTANEOUS_USE_BIT;
+    objects[i]._model = snapshot._objects[i]._model;
+    objects[i]._objectIndex = snapshot._objects[i]._objectIndex;
+  }
 
-    vkBeginCommandBuffer ( _commandBuffers[i], &beginInfo );
+  //Planos a partir de las filas de la viewProj (profundidad en [0, 1])
+  glm::mat4 rows = glm::transpose ( _frameViewProj );
+  CullParams params = {};
+  params._frustumPlanes[0] = rows[3] + rows[0];
+  params._frustumPlanes[1] = rows[3] - rows[0];
+  params._frustumPlanes[2] = rows[3] + rows[1];
+  params._frustumPlanes[3] = rows[3] - rows[1];
+  params._frustumPlanes[4] = rows[2];
+  params._frustumPlanes[5] = rows[3] - rows[2];
+  for ( glm::vec4& plane : params._frustumPlanes )
+  {
+    plane /= glm::length ( glm::vec3 ( plane ));
+  }
 
-    VkRenderPassBeginInfo renderPassInfo = {};
-    renderPassInfo.sType = VK_STRUCTURE_TYPE_RENDER_PASS_BEGIN_INFO;
-    renderPassInfo.renderPass = _renderPass;
-    renderPassInfo.framebuffer = _swapChainFramebuffers[i];
-    renderPassInfo.renderArea.offset = { 0, 0 };
-    renderPassInfo.renderArea.extent = _swapChainExtent;
+  params._hiZViewProj = _hiZViewProj;
+  params._meshBounds = _meshBounds;
+  params._objectCount = objectCount;
+  params._indexCount = static_cast<uint32_t>(_indices.size ( ));
+  params._occlusion = _hiZValid ? 1 : 0;
+  params._hiZLevels = _hiZLevels;
+  params._hiZSize = glm::vec2 ( _hiZExtent.width, _hiZExtent.height );
 
-    //Color de limpiado
-    std::array < VkClearValue, 2 > clearValues = {};
-    clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
+  std::memcpy ( static_cast<char*>(_cullParamsBufferMapped)
+                  + frameIndex * _cullParamsSliceSize,
+                &params,
+                sizeof ( params ));
 
-    //Efecto tormenta, el _color de limpiado es diferente en cada frambuffer se aprecia que no es regular el render
-    //if (i%2==0) clearValues[0].color = { 0.0f, 0.0f, 0.0f, 1.0f };
-    //else        clearValues[0].color = { 1.0f, 1.0f, 1.0f, 1.0f };
+  return objectCount;
+}
 
-    clearValues[1].depthStencil = { 1.0f, 0 };
+//Compute de culling: escribe los objetos visibles y sus comandos en los
+//tramos del frame del camino indirecto
+void vulkanApp::recordCulling ( VkCommandBuffer commandBuffer,
+                                uint32_t frameIndex,
+                                uint32_t objectCount )
+{
+  VkDeviceSize countOffset = frameIndex * _indirectSliceSize;
 
-    renderPassInfo.clearValueCount =
-      static_cast<uint32_t>(clearValues.size ( ));
-    renderPassInfo.pClearValues = clearValues.data ( );
+  //Compactando, el contador se acumula con atomicAdd
+  if ( _drawIndirectCount )
+  {
+    vkCmdFillBuffer ( commandBuffer,
+                      _indirectBuffer,
+                      countOffset,
+                      sizeof ( uint32_t ),
+                      0 );
+
+    _imageTracker.requireMemory ( VK_PIPELINE_STAGE_TRANSFER_BIT,
+                                  VK_ACCESS_TRANSFER_WRITE_BIT,
+                                  VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                                  VK_ACCESS_SHADER_READ_BIT
+                                    | VK_ACCESS_SHADER_WRITE_BIT );
+  }
 
-    vkCmdBeginRenderPass ( _commandBuffers[i],
-                           &renderPassInfo,
-                           VK_SUBPASS_CONTENTS_INLINE );
+  if ( _hiZValid )
+  {
+    ImageUsage pyramidRead;
+    pyramidRead._layout = VK_IMAGE_LAYOUT_GENERAL;
+    pyramidRead._stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+    pyramidRead._access = VK_ACCESS_SHADER_READ_BIT;
+    _imageTracker.require ( _hiZImage, pyramidRead );
+  }
 
-    vkCmdBindPipeline ( _commandBuffers[i],
-                        VK_PIPELINE_BIND_POINT_GRAPHICS,
-                        _graphicsPipeline );
+  //El contador y la pirámide comparten barrera
+  _imageTracker.flush ( commandBuffer );
+
+  vkCmdBindPipeline ( commandBuffer,
+                      VK_PIPELINE_BIND_POINT_COMPUTE,
+                      _cullPipeline );
+
+  //En orden de binding: parámetros, origen, visibles y comandos
+  std::array < uint32_t, 4 > dynamicOffsets =
+    {{ static_cast<uint32_t>(frameIndex * _cullParamsSliceSize ),
+       static_cast<uint32_t>(frameIndex * _objectSliceSize ),
+       static_cast<uint32_t>(frameIndex * _objectSliceSize ),
+       static_cast<uint32_t>(countOffset ) }};
+  std::array < VkDescriptorSet, 2 > sets = {{ _cullSet, _cullHiZSet }};
+  vkCmdBindDescriptorSets ( commandBuffer,
+                            VK_PIPELINE_BIND_POINT_COMPUTE,
+                            _cullPipelineLayout,
+                            0,
+                            static_cast<uint32_t>(sets.size ( )),
+                            sets.data ( ),
+                            static_cast<uint32_t>(dynamicOffsets.size ( )),
+                            dynamicOffsets.data ( ));
+
+  vkCmdDispatch ( commandBuffer,
+                  ( objectCount + CULL_GROUP_SIZE - 1 ) / CULL_GROUP_SIZE,
+                  1,
+                  1 );
+
+  //Los comandos se leen como indirectos y los objetos en el vertex shader
+  VkMemoryBarrier barrier = {};
+  barrier.sType = VK_STRUCTURE_TYPE_MEMORY_BARRIER;
+  barrier.srcAccessMask = VK_ACCESS_SHADER_WRITE_BIT;
+  barrier.dstAccessMask = VK_ACCESS_INDIRECT_COMMAND_READ_BIT
+    | VK_ACCESS_SHADER_READ_BIT;
+  vkCmdPipelineBarrier ( commandBuffer,
+                         VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT,
+                         VK_PIPELINE_STAGE_DRAW_INDIRECT_BIT
+                           | VK_PIPELINE_STAGE_VERTEX_SHADER_BIT,
+                         0,
+                         1,
+                         &barrier,
+                         0,
+                         nullptr,
+                         0,
+                         nullptr );
+}
 
-    VkBuffer vertexBuffers[] = { _vertexBuffer };
-    VkDeviceSize offsets[] = { 0 };
-    vkCmdBindVertexBuffers ( _commandBuffers[i],
-                             0,
-                             1,
-                             vertexBuffers,
-                             offsets );
+//Reduce el depth recién renderizado nivel a nivel. El culling del frame
+//siguiente la proyecta con la viewProj de este frame
+void vulkanApp::recordHiZBuild ( VkCommandBuffer commandBuffer )
+{
+  //El render pass deja el depth como attachment
+  _imageTracker.assume ( _depthImage,
+                         ImageTracker::defaultUsage (
+                           VK_IMAGE_LAYOUT_DEPTH_STENCIL_ATTACHMENT_OPTIMAL ));
+
+  ImageUsage depthRead;
+  depthRead._layout = VK_IMAGE_LAYOUT_DEPTH_STENCIL_READ_ONLY_OPTIMAL;
+  depthRead._stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  depthRead._access = VK_ACCESS_SHADER_READ_BIT;
+  _imageTracker.require ( _depthImage, depthRead );
+
+  ImageUsage levelRead;
+  levelRead._layout = VK_IMAGE_LAYOUT_GENERAL;
+  levelRead._stage = VK_PIPELINE_STAGE_COMPUTE_SHADER_BIT;
+  levelRead._access = VK_ACCESS_SHADER_READ_BIT;
+
+  ImageUsage levelWrite = levelRead;
+  levelWrite._access = VK_ACCESS_SHADER_WRITE_BIT;
+
+  vkCmdBindPipeline ( commandBuffer,
+                      VK_PIPELINE_BIND_POINT_COMPUTE,
+                      _hiZPipeline );
+
+  std::array < int32_t, 4 > sizes =
+    {{ static_cast<int32_t>(_swapChainExtent.width),
+       static_cast<int32_t>(_swapChainExtent.height),
+       0,
+       0 }};
+  for ( uint32_t level = 0; level < _hiZLevels; level++ )
+  {
+    if ( level > 0 )
+    {
+      _imageTracker.require ( _hiZImage, levelRead, level - 1, 1 );
+    }
+    _imageTracker.require ( _hiZImage, levelWrite, level, 1 );
+    _imageTracker.flush ( commandBuffer );
 
-    vkCmdBindIndexBuffer ( _commandBuffers[i],
-                           _indexBuffer,
-                           0,
-                           VK_INDEX_TYPE_UINT32 );
+    sizes[2] = static_cast<int32_t>(std::max ( _hiZExtent.width >> level, 1u ));
+    sizes[3] = static_cast<int32_t>(std::max ( _hiZExtent.height >> level, 1u ));
 
-    vkCmdBindDescriptorSets ( _commandBuffers[i],
-                              VK_PIPELINE_BIND_POINT_GRAPHICS,
-                              _pipelineLayout,
+    vkCmdBindDescriptorSets ( commandBuffer,
+                              VK_PIPELINE_BIND_POINT_COMPUTE,
+                              _hiZPipelineLayout,
                               0,
                               1,
-                              &_descriptorSet,
+                              &_hiZSets[level],
                               0,
                               nullptr );
+    vkCmdPushConstants ( commandBuffer,
+                         _hiZPipelineLayout,
+                         VK_SHADER_STAGE_COMPUTE_BIT,
+                         0,
+                         sizeof ( sizes ),
+                         sizes.data ( ));
+    vkCmdDispatch ( commandBuffer,
+                    ( sizes[2] + 7 ) / 8,
+                    ( sizes[3] + 7 ) / 8,
+                    1 );
+
+    sizes[0] = sizes[2];
+    sizes[1] = sizes[3];
+  }
+
+  _hiZViewProj = _frameViewProj;
+  _hiZValid = true;
+}
 
-    vkCmdDrawIndexed ( _commandBuffers[i],
-                       static_cast<uint32_t>(_indices.size ( )),
-                       1,
-                       0,
-                       0,
-                       0 );
+//Cada worker graba su tramo de la cola en su secundario (de su propio
+//pool) y el primario los ejecuta en orden
+RenderQueueStats vulkanApp::recordDrawsParallel ( uint32_t frameIndex,
+                                      uint32_t imageIndex,
+                                      const std::vector < ObjectPushConstants >& objects,
+                                      uint32_t instanceCount )
+{
+  FrameData& frame = _frames[frameIndex];
+
+  VkCommandBufferInheritanceInfo inheritanceInfo = {};
+  inheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
+  inheritanceInfo.renderPass = _renderPass;
+  inheritanceInfo.subpass = 0;
+  inheritanceInfo.framebuffer = _swapChainFramebuffers[imageIndex];
+  inheritanceInfo.pipelineStatistics =
+    _inheritedQueries ? _gpuProfiler.statisticsFlags ( ) : 0;
+
+  VkCommandBufferBeginInfo beginInfo = {};
+  beginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+  beginInfo.flags = VK_COMMAND_BUFFER_USAGE_RENDER_PASS_CONTINUE_BIT;
+  beginInfo.pInheritanceInfo = &inheritanceInfo;
+  //El primario que los ejecuta se puede reenviar
+  if ( !_commandBufferReuse )
+  {
+    beginInfo.flags |= VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+  }
+
+  std::vector < uint8_t > recorded ( frame._secondaryBuffers.size ( ), 0 );
+  std::vector < RenderQueueStats > workerStats ( frame._secondaryBuffers.size ( ));
 
-    vkCmdEndRenderPass ( _commandBuffers[i] );
+  _recordWorkers.parallelFor ( _renderQueue.size ( ),
+                               _parallelRecordThreshold / 4,
+    [&] ( size_t begin, size_t end, uint32_t worker )
+    {
+      VkCommandBuffer secondary = frame._secondaryBuffers[worker];
+      vkBeginCommandBuffer ( secondary, &beginInfo );
+      workerStats[worker] = recordQueue ( secondary,
+                                          frameIndex,
+                                          objects,
+                                          instanceCount,
+                                          begin,
+                                          end );
+      if ( vkEndCommandBuffer ( secondary ) != VK_SUCCESS )
+      {
+        throw std::runtime_error ( "failed to record secondary command buffer!" );
+      }
+      recorded[worker] = 1;
+    } );
 
-    if ( vkEndCommandBuffer ( _commandBuffers[i] ) != VK_SUCCESS )
+  RenderQueueStats stats;
+  std::vector < VkCommandBuffer > secondaries;
+  for ( size_t i = 0; i < recorded.size ( ); i++ )
+  {
+    if ( recorded[i] )
     {
-      throw std::runtime_error ( "failed to record command buffer!" );
+      secondaries.push_back ( frame._secondaryBuffers[i] );
+      stats += workerStats[i];
     }
   }
+
+  vkCmdExecuteCommands ( frame._commandBuffer,
+                         static_cast<uint32_t>(secondaries.size ( )),
+                         secondaries.data ( ));
+
+  return stats;
 }
 
 void vulkanApp::createSemaphores ( )
@@ -1556,97 +4319,246 @@ void vulkanApp::createSemaphores ( )
   VkSemaphoreCreateInfo semaphoreInfo = {};
   semaphoreInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
 
-  if ( vkCreateSemaphore ( _device,
-                           &semaphoreInfo,
-                           nullptr,
-                           &_imageAvailableSemaphore ) != VK_SUCCESS ||
-    vkCreateSemaphore ( _device,
-                        &semaphoreInfo,
-                        nullptr,
-                        &_renderFinishedSemaphore ) != VK_SUCCESS )
+  _frames.resize ( _framesInFlight );
+  _currentFrame = 0;
+
+  for ( auto& frame : _frames )
+  {
+    if ( vkCreateSemaphore ( _device,
+                             &semaphoreInfo,
+                             nullptr,
+                             &frame._imageAvailableSemaphore ) != VK_SUCCESS )
+    {
+      throw std::runtime_error ( "failed to create semaphores!" );
+    }
+  }
+}
+
+//Llamar después de esperar el ticket del frame. El primer scope es el
+//frame completo. true si había resultados nuevos
+bool vulkanApp::collectGpuFrameTime ( uint32_t frameIndex )
+{
+  if ( !_gpuProfiler.collect ( frameIndex ))
+  {
+    return false;
+  }
+
+  std::vector < GpuScopeResult > scopes = _gpuProfiler.results ( );
+
+  std::lock_guard < std::mutex > lock ( _frameTimingMutex );
+  _frameTiming._gpuFrameTimeMs = scopes[0]._timeMs;
+  _frameTiming._gpuFrameCount++;
+  return true;
+}
+
+//Tras vkDeviceWaitIdle: los últimos frames en vuelo nunca se recogen al
+//reutilizar su hueco. Se recogen del más antiguo al más reciente y se
+//notifican sin cambiar _frameCount
+void vulkanApp::drainGpuFrameTimes ( )
+{
+  for ( size_t i = 0; i < _frames.size ( ); i++ )
   {
+    uint32_t frameIndex =
+      static_cast<uint32_t>(( _currentFrame + i ) % _frames.size ( ));
+    if ( !collectGpuFrameTime ( frameIndex ) || !_frameStatsCallback )
+    {
+      continue;
+    }
 
-    throw std::runtime_error ( "failed to create semaphores!" );
+    std::unique_lock < std::mutex > lock ( _frameTimingMutex );
+    FrameTimingStats stats = _frameTiming;
+    lock.unlock ( );
+    _frameStatsCallback ( stats );
   }
 }
 
-void vulkanApp::updateUniformBuffer ( )
+//Hilo principal: cámara y transformaciones del frame
+void vulkanApp::updateScene ( FrameSnapshot& snapshot )
 {
-  static auto startTime = std::chrono::high_resolution_clock::now ( );
+  float time = static_cast<float>(snapshot._time);
 
-  auto currentTime = std::chrono::high_resolution_clock::now ( );
-  float time = std::chrono::duration_cast < std::chrono::milliseconds > (
-    currentTime - startTime ).count ( )/1000.0f;
+  if ( _cameraPath )
+  {
+    snapshot._view = _cameraPath ( snapshot._time );
+  }
+  else
+  {
+    snapshot._view = glm::lookAt ( glm::vec3 ( 2.0f, 2.0f, 2.0f ),
+                                   glm::vec3 ( 0.0f, 0.0f, 0.0f ),
+                                   glm::vec3 ( 0.0f, 0.0f, 1.0f ));
+  }
+  snapshot._fovY = glm::radians ( 45.0f );
+  snapshot._nearPlane = 0.1f;
+  snapshot._farPlane = 10.0f;
+
+  //Por objeto: va en push constants al grabar el frame
+  snapshot._objects.resize ( 1 );
+  snapshot._objects[0]._model = glm::rotate ( glm::mat4 ( 1.0f ),
+                                              time*glm::radians ( 90.0f ),
+                                              glm::vec3 ( 0.0f, 0.0f, 1.0f ));
+  snapshot._objects[0]._objectIndex = 0;
+
+  if ( _instanceUpdater )
+  {
+    _instanceUpdater ( snapshot._time, snapshot._instances );
+  }
+  else
+  {
+    snapshot._instances.clear ( );
+  }
+}
 
+//Hilo de render: la proyección depende de la swapchain actual
+void vulkanApp::updateUniformBuffer ( const FrameSnapshot& snapshot )
+{
   UniformBufferObject ubo = {};
-  ubo._model = glm::rotate ( glm::mat4 ( 1.0f ),
-                            time*glm::radians ( 90.0f ),
-                            glm::vec3 ( 0.0f, 0.0f, 1.0f ));
-  ubo._view = glm::lookAt ( glm::vec3 ( 2.0f, 2.0f, 2.0f ),
-                           glm::vec3 ( 0.0f, 0.0f, 0.0f ),
-                           glm::vec3 ( 0.0f, 0.0f, 1.0f ));
-  ubo._proj = glm::perspective ( glm::radians ( 45.0f ),
+  ubo._view = snapshot._view;
+  ubo._proj = glm::perspective ( snapshot._fovY,
                                 _swapChainExtent.width
                                   /( float ) _swapChainExtent.height,
-                                0.1f,
-                                10.0f );
+                                snapshot._nearPlane,
+                                snapshot._farPlane );
   ubo._proj[1][1] *= -1; // switching from OGL to Vulkan sys. coord.
 
-  void* data;
-  vkMapMemory ( _device,
-                _uniformBufferMemory,
-                0,
-                sizeof ( ubo ),
-                0,
-                &data );
-  memcpy ( data, &ubo, sizeof ( ubo ));
-  vkUnmapMemory ( _device, _uniformBufferMemory );
+  //Para los planos del frustum del culling en GPU
+  _frameViewProj = ubo._proj * ubo._view;
+
+  //Tramo del frame actual: la GPU ya no lo está leyendo (ver drawFrame)
+  char* slice = static_cast<char*>(_uniformBufferMapped)
+    + _currentFrame * _uniformSliceSize;
+  memcpy ( slice, &ubo, sizeof ( ubo ));
 }
 
-void vulkanApp::drawFrame ( )
+void vulkanApp::drawFrame ( const FrameSnapshot& snapshot )
 {
-  uint32_t imageIndex;
-  VkResult result = vkAcquireNextImageKHR ( _device,
-                                            _swapChain,
-                                            std::numeric_limits < uint64_t >::max ( ),
-                                            _imageAvailableSemaphore,
-                                            VK_NULL_HANDLE,
-                                            &imageIndex );
-
-  if ( result == VK_ERROR_OUT_OF_DATE_KHR )
+  std::lock_guard < std::recursive_mutex > commandLock ( _commandMutex );
+  //Resize o cambio de política (el modo de presentación es de la
+  //swapchain): una sola reconstrucción por frame
+  bool resized = _framebufferResized.exchange ( false );
+  if ( _headless )
+  {
+    //Sin swapchain la política solo afecta al limitador
+    if ( _presentPolicyChanged )
+    {
+      applyPresentPolicy ( );
+    }
+  }
+  else if ( resized || _presentPolicyChanged )
   {
     recreateSwapChain ( );
-    return;
   }
-  else if ( result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR )
+
+  FrameData& frame = _frames[_currentFrame];
+
+  //La CPU no se adelanta más de _framesInFlight frames a la GPU
+  _graphicsTimeline.wait ( frame._ticket );
+  collectGpuFrameTime ( _currentFrame );
+
+  //En headless cada frame en vuelo tiene su imagen offscreen
+  uint32_t imageIndex = _currentFrame;
+  if ( !_headless )
+  {
+    VkResult result = vkAcquireNextImageKHR ( _device,
+                                              _swapChain,
+                                              std::numeric_limits < uint64_t >::max ( ),
+                                              frame._imageAvailableSemaphore,
+                                              VK_NULL_HANDLE,
+                                              &imageIndex );
+
+    if ( result == VK_ERROR_OUT_OF_DATE_KHR )
+    {
+      recreateSwapChain ( );
+      return;
+    }
+    else if ( result != VK_SUCCESS && result != VK_SUBOPTIMAL_KHR )
+    {
+      throw std::runtime_error ( "failed to acquire swap chain image!" );
+    }
+  }
+
+  //La imagen puede seguir en uso por otro frame en vuelo (el orden de
+  //adquisición no tiene por qué ser circular)
+  _graphicsTimeline.wait ( _imagesInFlight[imageIndex] );
+
+  updateUniformBuffer ( snapshot );
+  recordCommandBuffer ( _currentFrame, imageIndex, snapshot );
+
+  //Captura pedida con readbackSwapChain: si no hay hueco se reintenta en
+  //el siguiente frame
+  std::vector < ReadbackSlot* > frameReadbacks;
+  std::unique_lock < std::mutex > readbackLock ( _swapChainReadbackMutex );
+  if ( _swapChainReadback )
   {
-    throw std::runtime_error ( "failed to acquire swap chain image!" );
+    ReadbackSlot* slot = recordFrameReadback ( imageIndex, _swapChainReadback );
+    if ( slot )
+    {
+      frameReadbacks.push_back ( slot );
+      _swapChainReadback = nullptr;
+    }
   }
+  readbackLock.unlock ( );
 
-  VkSemaphore waitSemaphores[]      = { _imageAvailableSemaphore };
-  VkSemaphore signalSemaphores[]    = { _renderFinishedSemaphore };
-  VkPipelineStageFlags waitStages[] = { VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT };
+  //Volcado a disco en headless: no se salta ningún frame, si el anillo
+  //está lleno se espera a las lecturas pendientes
+  if ( _headless && !_frameOutputPrefix.empty ( ))
+  {
+    char suffix[32];
+    snprintf ( suffix, sizeof ( suffix ), "_%06llu.ppm",
+               static_cast<unsigned long long>(_framesRendered ));
+    std::string filename = _frameOutputPrefix + suffix;
+    ReadbackCallback writeFrame = [filename] ( const ReadbackResult& result )
+    {
+      if ( !writePPM ( filename, result ))
+      {
+        std::cerr << "failed to write " << filename << std::endl;
+      }
+    };
 
-  VkSubmitInfo submitInfo = {};
-  submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-  submitInfo.waitSemaphoreCount = 1;
-  submitInfo.pWaitSemaphores = waitSemaphores;
+    ReadbackSlot* slot = recordFrameReadback ( imageIndex, writeFrame );
+    if ( !slot )
+    {
+      waitReadbacks ( );
+      slot = recordFrameReadback ( imageIndex, writeFrame );
+    }
+    if ( slot )
+    {
+      frameReadbacks.push_back ( slot );
+    }
+  }
 
-  submitInfo.signalSemaphoreCount = 1;
-  submitInfo.pSignalSemaphores = signalSemaphores;
+  GpuSubmission submission;
+  if ( !_headless )
+  {
+    submission.waitBinary ( frame._imageAvailableSemaphore,
+                            VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT );
+    submission._signalSemaphores.push_back (
+      _renderFinishedSemaphores[imageIndex] );
+  }
+  submission._commandBuffers.push_back ( frame._commandBuffer );
+  for ( auto slot : frameReadbacks )
+  {
+    submission._commandBuffers.push_back ( slot->_commandBuffer );
+  }
 
-  submitInfo.pWaitDstStageMask = waitStages;
-  submitInfo.commandBufferCount = 1;
-  submitInfo.pCommandBuffers = &_commandBuffers[imageIndex];
+  _lastFrameTicket = _graphicsTimeline.submit ( submission );
+  frame._ticket = _lastFrameTicket;
+  _imagesInFlight[imageIndex] = _lastFrameTicket;
 
+  for ( auto slot : frameReadbacks )
+  {
+    markReadbackPending ( *slot, _lastFrameTicket );
+  }
 
-  if ( vkQueueSubmit ( _graphicsQueue, 1, &submitInfo, VK_NULL_HANDLE )
-    != VK_SUCCESS )
+  if ( _headless )
   {
-    throw std::runtime_error ( "failed to submit draw command buffer!" );
+    recordPresentTiming ( snapshot );
+    _framesRendered++;
+    _currentFrame = ( _currentFrame + 1 ) % _framesInFlight;
+    return;
   }
 
   //Aquí es donde se envía para su presentacion
+  VkSemaphore signalSemaphores[] = { _renderFinishedSemaphores[imageIndex] };
   VkPresentInfoKHR presentInfo = {};
   presentInfo.sType = VK_STRUCTURE_TYPE_PRESENT_INFO_KHR;
   presentInfo.waitSemaphoreCount = 1;
@@ -1657,37 +4569,127 @@ void vulkanApp::drawFrame ( )
   presentInfo.pSwapchains = swapChains;
   presentInfo.pImageIndices = &imageIndex;
 
-  result = vkQueuePresentKHR ( _presentQueue, &presentInfo );
+  VkResult result;
+  {
+    //La cola de presentación puede ser la gráfica
+    std::lock_guard < std::mutex > lock ( _graphicsTimeline.queueMutex ( ));
+    result = vkQueuePresentKHR ( _presentQueue, &presentInfo );
+  }
+
+  //Solo cuentan los presents encolados
+  if ( result == VK_SUCCESS || result == VK_SUBOPTIMAL_KHR )
+  {
+    retireSwapChains ( );
+  }
 
+  //Se aplaza al siguiente frame y se junta con un posible resize pendiente
   if ( result == VK_ERROR_OUT_OF_DATE_KHR || result == VK_SUBOPTIMAL_KHR )
   {
-    recreateSwapChain ( );
+    _framebufferResized = true;
   }
   else if ( result != VK_SUCCESS )
   {
     throw std::runtime_error ( "failed to present swap chain image!" );
   }
 
-  vkQueueWaitIdle ( _presentQueue );
+  recordPresentTiming ( snapshot );
+  _framesRendered++;
+
+  _currentFrame = ( _currentFrame + 1 ) % _framesInFlight;
+}
+
+//Graba (sin enviar) la copia de la imagen que acaba de renderizar el frame
+ReadbackSlot* vulkanApp::recordFrameReadback ( uint32_t imageIndex,
+                                               ReadbackCallback callback )
+{
+  //El render pass deja la imagen lista para presentar (o para copiar)
+  ImageUsage rendered;
+  rendered._layout = renderedColorLayout ( );
+  rendered._stage = VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT;
+  rendered._access = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+  _imageTracker.assume ( _swapChainImages[imageIndex], rendered );
+
+  ReadbackSlot* slot = recordImageReadback ( _swapChainImages[imageIndex],
+                                             _swapChainImageFormat,
+                                             _swapChainExtent,
+                                             callback );
+  if ( slot )
+  {
+    submitReadback ( *slot );
+  }
+  return slot;
 }
 
-//Generacion de los shader modules a pasarle al pipeline
-VkShaderModule vulkanApp::createShaderModule ( const std::vector < char >& code )
+bool vulkanApp::writePPM ( const std::string& filename,
+                           const ReadbackResult& result )
 {
-  VkShaderModuleCreateInfo createInfo = {};
-  createInfo.sType = VK_STRUCTURE_TYPE_SHADER_MODULE_CREATE_INFO;
-  createInfo.codeSize = code.size ( );
-  createInfo.pCode = (const uint32_t*)( code.data ( ) );
+  bool bgra = result._format == VK_FORMAT_B8G8R8A8_UNORM
+    || result._format == VK_FORMAT_B8G8R8A8_SRGB;
+  bool rgba = result._format == VK_FORMAT_R8G8B8A8_UNORM
+    || result._format == VK_FORMAT_R8G8B8A8_SRGB;
+  if ( !( bgra || rgba ) || !result._data )
+  {
+    return false;
+  }
 
-  VkShaderModule shaderModule;
-  if (
-    vkCreateShaderModule ( _device, &createInfo, nullptr, &shaderModule )
-      != VK_SUCCESS )
+  std::ofstream file ( filename, std::ios::binary );
+  if ( !file )
+  {
+    return false;
+  }
+
+  file << "P6\n" << result._width << " " << result._height << "\n255\n";
+
+  const char* data = static_cast<const char*>(result._data);
+  std::vector < char > row ( result._width * 3 );
+  for ( uint32_t y = 0; y < result._height; y++ )
+  {
+    const char* src = data + static_cast<size_t>(y) * result._rowPitch;
+    for ( uint32_t x = 0; x < result._width; x++ )
+    {
+      row[3 * x + 0] = src[4 * x + ( bgra ? 2 : 0 )];
+      row[3 * x + 1] = src[4 * x + 1];
+      row[3 * x + 2] = src[4 * x + ( bgra ? 0 : 2 )];
+    }
+    file.write ( row.data ( ), row.size ( ));
+  }
+
+  return file.good ( );
+}
+
+//Latencia desde la lectura de la entrada hasta la entrega a la cola de
+//presentación (lado CPU; el compositor puede añadir más)
+void vulkanApp::recordPresentTiming ( const FrameSnapshot& snapshot )
+{
+  std::chrono::steady_clock::time_point now =
+    std::chrono::steady_clock::now ( );
+  double latency = std::chrono::duration < double, std::milli > (
+    now - snapshot._inputTime ).count ( );
+
+  std::unique_lock < std::mutex > lock ( _frameTimingMutex );
+  _frameTiming._latencyMs = latency;
+  _frameTiming._maxLatencyMs = std::max ( _frameTiming._maxLatencyMs, latency );
+  if ( _frameTiming._frameCount == 0 )
+  {
+    _frameTiming._averageLatencyMs = latency;
+  }
+  else
   {
-    throw std::runtime_error ( "failed to create shader module!" );
+    _frameTiming._averageLatencyMs =
+      0.95 * _frameTiming._averageLatencyMs + 0.05 * latency;
+    _frameTiming._frameTimeMs = std::chrono::duration < double, std::milli > (
+      now - _lastPresentTime ).count ( );
   }
 
-  return shaderModule;
+  _lastPresentTime = now;
+  _frameTiming._frameCount++;
+
+  if ( _frameStatsCallback )
+  {
+    FrameTimingStats stats = _frameTiming;
+    lock.unlock ( );
+    _frameStatsCallback ( stats );
+  }
 }
 
 VkSurfaceFormatKHR vulkanApp::chooseSwapSurfaceFormat ( const std::vector <
@@ -1715,21 +4717,34 @@ VkSurfaceFormatKHR vulkanApp::chooseSwapSurfaceFormat ( const std::vector <
 VkPresentModeKHR vulkanApp::chooseSwapPresentMode ( const std::vector <
   VkPresentModeKHR > availablePresentModes )
 {
-  VkPresentModeKHR bestMode = VK_PRESENT_MODE_FIFO_KHR;
+  //FIFO siempre está disponible
+  std::vector < VkPresentModeKHR > preferred;
+  switch ( _presentPolicy )
+  {
+    case PRESENT_VSYNC:
+      break;
+    case PRESENT_LOW_LATENCY:
+    case PRESENT_FRAME_CAP:
+      preferred = { VK_PRESENT_MODE_MAILBOX_KHR,
+                    VK_PRESENT_MODE_IMMEDIATE_KHR };
+      break;
+    case PRESENT_UNCAPPED:
+      preferred = { VK_PRESENT_MODE_IMMEDIATE_KHR,
+                    VK_PRESENT_MODE_MAILBOX_KHR };
+      break;
+  }
 
-  for ( const auto& availablePresentMode : availablePresentModes )
+  for ( VkPresentModeKHR mode : preferred )
   {
-    if ( availablePresentMode == VK_PRESENT_MODE_MAILBOX_KHR )
-    {
-      return availablePresentMode;
-    }
-    else if ( availablePresentMode == VK_PRESENT_MODE_IMMEDIATE_KHR )
+    if ( std::find ( availablePresentModes.begin ( ),
+                     availablePresentModes.end ( ),
+                     mode ) != availablePresentModes.end ( ))
     {
-      bestMode = availablePresentMode;
+      return mode;
     }
   }
 
-  return bestMode;
+  return VK_PRESENT_MODE_FIFO_KHR;
 }
 
 
@@ -1744,7 +4759,9 @@ VkExtent2D vulkanApp::chooseSwapExtent ( const VkSurfaceCapabilitiesKHR& capabil
   else
   {
     int width, height;
-    glfwGetWindowSize ( _window, &width, &height );
+    //Puede ejecutarse en el hilo de render: no se llama a GLFW
+    width = _windowWidth;
+    height = _windowHeight;
 
     VkExtent2D actualExtent = {
       static_cast<uint32_t>(width),
@@ -1817,7 +4834,7 @@ bool vulkanApp::isDeviceSuitable ( VkPhysicalDevice ldevice )
 
   bool extensionsSupported = checkDeviceExtensionSupport ( ldevice );
 
-  if ( extensionsSupported )
+  if ( extensionsSupported && !_headless )
   {
     SwapChainSupportDetails
       swapChainSupport = querySwapChainSupport ( ldevice );
@@ -1828,14 +4845,40 @@ bool vulkanApp::isDeviceSuitable ( VkPhysicalDevice ldevice )
   VkPhysicalDeviceFeatures supportedFeatures;
   vkGetPhysicalDeviceFeatures ( ldevice, &supportedFeatures );
 
+  //Timeline semaphores: hace falta Vulkan 1.2. No se admite 1.1 con
+  //VK_KHR_timeline_semaphore: drawIndirectCount también se pide como 1.2
+  VkPhysicalDeviceProperties properties;
+  vkGetPhysicalDeviceProperties ( ldevice, &properties );
+
+  VkPhysicalDeviceVulkan12Features features12 = {};
+  features12.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_VULKAN_1_2_FEATURES;
+  VkPhysicalDeviceFeatures2 features2 = {};
+  features2.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2;
+  features2.pNext = &features12;
+  if ( properties.apiVersion >= VK_API_VERSION_1_2 )
+  {
+    vkGetPhysicalDeviceFeatures2 ( ldevice, &features2 );
+  }
+
   return  lindices.isComplete ( )
           && extensionsSupported
           && supportedFeatures.samplerAnisotropy
           && supportedFeatures.geometryShader
+          && features12.timelineSemaphore
           ;
 }
 
 
+//Sin swapchain no hace falta ninguna extensión de dispositivo
+std::vector < const char* > vulkanApp::getRequiredDeviceExtensions ( ) const
+{
+  if ( _headless )
+  {
+    return std::vector < const char* > ( );
+  }
+  return deviceExtensions;
+}
+
 bool vulkanApp::checkDeviceExtensionSupport ( VkPhysicalDevice ldevice )
 {
   uint32_t extensionCount;
@@ -1853,8 +4896,9 @@ bool vulkanApp::checkDeviceExtensionSupport ( VkPhysicalDevice ldevice )
 
 
   //Esta parte hay que revisarla un poco ####
+  std::vector < const char* > extensions = getRequiredDeviceExtensions ( );
   std::set < std::string > requiredExtensions
-    ( deviceExtensions.begin ( ), deviceExtensions.end ( ));
+    ( extensions.begin ( ), extensions.end ( ));
 
   for ( const auto& extension : availableExtensions )
   {
@@ -1886,33 +4930,57 @@ QueueFamilyIndices vulkanApp::findQueueFamilies ( VkPhysicalDevice ldevice )
   for ( const auto& queueFamily : queueFamilies )
   {
     //Es una cola grafica?
-    if ( queueFamily.queueCount > 0
+    if ( lindices._graphicsFamily < 0
+      && queueFamily.queueCount > 0
       && queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT )
     {
       lindices._graphicsFamily = i;
     }
 
     //Para determinar si esta cola posee capacidad de presentacion
+    //(headless: no hay superficie, se presenta "desde" la gráfica)
     VkBool32 presentSupport = false;
-    vkGetPhysicalDeviceSurfaceSupportKHR ( ldevice,
-                                           i,
-                                           _surface,
-                                           &presentSupport );
+    if ( _headless )
+    {
+      presentSupport = ( queueFamily.queueFlags & VK_QUEUE_GRAPHICS_BIT ) != 0;
+    }
+    else
+    {
+      vkGetPhysicalDeviceSurfaceSupportKHR ( ldevice,
+                                             i,
+                                             _surface,
+                                             &presentSupport );
+    }
 
     //Posee capacidades de presentacion?
-    if ( queueFamily.queueCount > 0 && presentSupport )
+    if ( lindices._presentFamily < 0
+      && queueFamily.queueCount > 0 && presentSupport )
     {
       lindices._presentFamily = i;
     }
 
-    if ( lindices.isComplete ( ))
+    //Familia exclusiva de transferencia (motor DMA)?
+    if ( lindices._transferFamily < 0
+      && queueFamily.queueCount > 0
+      && ( queueFamily.queueFlags & VK_QUEUE_TRANSFER_BIT )
+      && !( queueFamily.queueFlags
+        & ( VK_QUEUE_GRAPHICS_BIT | VK_QUEUE_COMPUTE_BIT )))
     {
-      break;
+      lindices._transferFamily = i;
     }
 
     i++;
   }
 
+  //Sin familia dedicada: segunda cola de la familia gráfica si existe, si
+  //no se comparte la propia cola gráfica
+  if ( lindices._transferFamily < 0 && lindices._graphicsFamily >= 0 )
+  {
+    lindices._transferFamily = lindices._graphicsFamily;
+    lindices._transferQueueIndex =
+      queueFamilies[lindices._graphicsFamily].queueCount > 1 ? 1 : 0;
+  }
+
   return lindices;
 }
 
@@ -1921,14 +4989,18 @@ std::vector < const char* > vulkanApp::getRequiredExtensions ( )
 {
   std::vector < const char* > extensions;
 
-  unsigned int glfwExtensionCount = 0;
-  const char** glfwExtensions;
-  glfwExtensions =
-    glfwGetRequiredInstanceExtensions ( &glfwExtensionCount );
-
-  for ( unsigned int i = 0; i < glfwExtensionCount; i++ )
+  //Headless: sin extensiones de superficie (GLFW ni siquiera se inicializa)
+  if ( !_headless )
   {
-    extensions.push_back ( glfwExtensions[i] );
+    unsigned int glfwExtensionCount = 0;
+    const char** glfwExtensions;
+    glfwExtensions =
+      glfwGetRequiredInstanceExtensions ( &glfwExtensionCount );
+
+    for ( unsigned int i = 0; i < glfwExtensionCount; i++ )
+    {
+      extensions.push_back ( glfwExtensions[i] );
+    }
   }
 
   if ( enableValidationLayers )
@@ -1962,29 +5034,6 @@ bool vulkanApp::checkValidationLayerSupport ( )
   return false;
 }
 
-std::vector < char > vulkanApp::readFile ( const std::string& filename )
-{
-  std::ifstream file ( filename, std::ios::ate | std::ios::binary );
-
-  if ( !file.is_open ( ))
-  {
-    throw std::runtime_error ( "failed to open file!" );
-  }
-
-  //Empezamos por el final para tener la longitud del fichero
-  size_t fileSize = ( size_t ) file.tellg ( );
-  std::vector < char > buffer ( fileSize );
-
-  //Reposicionamos la principio y leemos del tiron
-  file.seekg ( 0 );
-  file.read ( buffer.data ( ), fileSize );
-
-  file.close ( );
-
-  return buffer;
-}
-
-
 VKAPI_ATTR VkBool32
 VKAPI_CALL vulkanApp::debugCallback ( VkDebugReportFlagsEXT flags,
                                       VkDebugReportObjectTypeEXT objType,
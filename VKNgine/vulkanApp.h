@@ -33,6 +33,13 @@
 #include <array>
 #include <set>
 #include <unordered_map>
+#include <functional>
+#include <list>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <cstdio>
 
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
@@ -44,6 +51,17 @@
 #include <glm/gtc/matrix_transform.hpp>
 #include <glm/gtx/hash.hpp>
 
+#include "vkGpuTimeline.h"
+#include "vkImageTracker.h"
+#include "vkFramePacer.h"
+#include "vkTripleBuffer.h"
+#include "vkGpuProfiler.h"
+#include "vkWorkerPool.h"
+#include "vkFrustumCuller.h"
+#include "vkRenderQueue.h"
+#include "vkPipelineCache.h"
+#include "vkPipelineRegistry.h"
+#include "vkShaderLibrary.h"
 #include "vkBaseTypes.hpp"
 #include "vkDebuger.hpp"
 #include "vkHelper.hpp"
@@ -53,7 +71,16 @@ class vulkanApp
 
   private:
     //Ventana de renderizado de GLFW
-    GLFWwindow *_window;
+    GLFWwindow *_window = nullptr;
+
+    //Sin ventana, superficie ni swapchain: se renderiza en imágenes propias
+    //(una por frame en vuelo) que ocupan el lugar de las de la swapchain
+    bool _headless = false;
+    std::vector < VkDeviceMemory > _offscreenImageMemory;
+    //Prefijo de los PPM volcados en headless (vacío: no se escribe nada)
+    std::string _frameOutputPrefix;
+    uint64_t _frameLimit = 0;
+    uint64_t _framesRendered = 0;
 
     //Instancia
     VkInstance _instance;
@@ -69,8 +96,12 @@ class vulkanApp
     VkQueue _graphicsQueue;
     VkQueue _presentQueue;
 
+    //Cola para las subidas asíncronas (puede coincidir con la gráfica)
+    VkQueue _transferQueue;
+    QueueFamilyIndices _queueFamilyIndices;
+
     //Superficie de renderizado
-    VkSurfaceKHR _surface;
+    VkSurfaceKHR _surface = VK_NULL_HANDLE;
 
     //Toda la configuracion de la swapchain
     VkSwapchainKHR _swapChain;
@@ -91,12 +122,19 @@ class vulkanApp
     VkDescriptorSetLayout _descriptorSetLayout;
     VkPipelineLayout _pipelineLayout;
     VkPipeline _graphicsPipeline;
+    //Misma configuración, transformaciones leídas del storage buffer
+    VkPipeline _indirectPipeline;
+    //Segundo binding por instancia (transformación y color)
+    VkPipeline _instancedPipeline;
 
     //Image eand texture management
     VkImage _depthImage;
     VkDeviceMemory _depthImageMemory;
     VkImageView _depthImageView;
 
+    //Layout y último acceso de cada imagen para generar las barreras
+    ImageTracker _imageTracker;
+
     VkImage _textureImage;
     VkDeviceMemory _textureImageMemory;
     VkImageView _textureImageView;
@@ -110,36 +148,301 @@ class vulkanApp
     VkBuffer _indexBuffer;
     VkDeviceMemory _indexBufferMemory;
 
-    //UBOS
+    //UBOS: anillo mapeado de forma persistente, un tramo por frame en vuelo
+    //seleccionado con offset dinámico
     VkBuffer _uniformBuffer;
     VkDeviceMemory _uniformBufferMemory;
+    void *_uniformBufferMapped = nullptr;
+    VkDeviceSize _uniformSliceSize = 0;
+
+    //Draws indirectos: por frame en vuelo, un tramo de datos de objeto
+    //(SSBO con offset dinámico) y otro con el contador de draws seguido de
+    //los VkDrawIndexedIndirectCommand
+    DrawPath _drawPath = DRAW_DIRECT;
+    uint32_t _maxIndirectDraws = 16384;
+    VkBuffer _objectBuffer;
+    VkDeviceMemory _objectBufferMemory;
+    void *_objectBufferMapped = nullptr;
+    VkDeviceSize _objectSliceSize = 0;
+    VkBuffer _indirectBuffer;
+    VkDeviceMemory _indirectBufferMemory;
+    void *_indirectBufferMapped = nullptr;
+    VkDeviceSize _indirectSliceSize = 0;
+    //Soporte del dispositivo: contador en buffer (1.2) y multidraw
+    bool _drawIndirectCount = false;
+    bool _multiDrawIndirect = false;
+
+    //Instancias: vertex buffer mapeado, un tramo por frame en vuelo
+    VkBuffer _instanceBuffer = VK_NULL_HANDLE;
+    VkDeviceMemory _instanceBufferMemory = VK_NULL_HANDLE;
+    void *_instanceBufferMapped = nullptr;
+    size_t _instanceCapacity = 0;
+    VkDeviceSize _instanceSliceSize = 0;
+
+    //Culling en GPU (DRAW_GPU_CULLED): el compute lee todos los objetos del
+    //tramo de origen y escribe los visibles en los tramos del camino
+    //indirecto. Opcionalmente descarta contra la pirámide HiZ construida
+    //con el depth del frame anterior
+    bool _occlusionCulling = false;
+    glm::vec4 _meshBounds;
+    glm::mat4 _frameViewProj;
+    VkDescriptorSetLayout _cullSetLayout;
+    VkDescriptorSetLayout _cullHiZSetLayout;
+    VkPipelineLayout _cullPipelineLayout;
+    VkPipeline _cullPipeline;
+    VkDescriptorPool _cullDescriptorPool;
+    VkDescriptorSet _cullSet;
+    VkBuffer _cullSourceBuffer;
+    VkDeviceMemory _cullSourceBufferMemory;
+    void *_cullSourceBufferMapped = nullptr;
+    VkBuffer _cullParamsBuffer;
+    VkDeviceMemory _cullParamsBufferMemory;
+    void *_cullParamsBufferMapped = nullptr;
+    VkDeviceSize _cullParamsSliceSize = 0;
+
+    //Pirámide HiZ (máximo de profundidad por nivel). Depende del tamaño del
+    //depth: se recrea con la swapchain
+    VkDescriptorSetLayout _hiZSetLayout;
+    VkPipelineLayout _hiZPipelineLayout;
+    VkPipeline _hiZPipeline;
+    VkSampler _hiZSampler;
+    VkImage _hiZImage = VK_NULL_HANDLE;
+    VkDeviceMemory _hiZImageMemory;
+    VkImageView _hiZView;
+    std::vector < VkImageView > _hiZMipViews;
+    std::vector < VkDescriptorSet > _hiZSets;
+    VkDescriptorSet _cullHiZSet;
+    //Un pool por pirámide: se destruye con ella, así que no importa
+    //cuántas generaciones sigan en vuelo tras varios resize seguidos
+    VkDescriptorPool _hiZDescriptorPool = VK_NULL_HANDLE;
+    VkExtent2D _hiZExtent = { 0, 0 };
+    uint32_t _hiZLevels = 0;
+    //La pirámide tiene contenido (al menos un frame tras crearla)
+    bool _hiZValid = false;
+    glm::mat4 _hiZViewProj;
+
+    //Culling de frustum en CPU para los caminos directo e indirecto: solo
+    //se graban los objetos visibles
+    bool _cpuCulling = false;
+    FrustumCuller _frustumCuller;
+    //Escala máxima de cada objeto, válida mientras no cambie la parte
+    //lineal de su transformación (solo la traslación, lo más habitual)
+    std::vector < glm::mat3 > _cullLinear;
+    std::vector < float > _cullScale;
+    std::vector < ObjectPushConstants > _visibleObjects;
+
+    //Draws del camino directo ordenados por clave (pase, pipeline,
+    //material, mallado y profundidad) para no repetir binds
+    RenderQueue _renderQueue;
+
+    //Reutilización de command buffers: si la huella de la lista de draws
+    //coincide con la de la última grabación de la imagen se reenvía sin
+    //regrabar. La generación cambia al recrear recursos referenciados.
+    //Desactivada por defecto: la huella recorre todos los draws en cada
+    //frame y solo compensa con escenas estáticas
+    bool _commandBufferReuse = false;
+    uint64_t _recordingGeneration = 0;
 
     //Descriptores
     VkDescriptorPool _descriptorPool;
     VkDescriptorSet _descriptorSet;
 
-    //Command buffers
+    //Pools de los command buffers de un solo uso (subidas y lecturas). Los
+    //de frame van en FrameData
     VkCommandPool _commandPool;
-    std::vector < VkCommandBuffer > _commandBuffers;
+    VkCommandPool _transferCommandPool;
+
+
+    //Subidas en vuelo durante la sesión, se retiran en el renderLoop
+    std::list < UploadBatch > _pendingUploads;
+
+    //Estado compartido entre el hilo de render y las llamadas externas:
+    //_commandPool, _transferCommandPool, _imageTracker y _pendingUploads.
+    //drawFrame lo mantiene durante todo el frame, así que el orden de
+    //grabación sigue siendo el de envío. Recursivo: la API de subidas se
+    //llama a sí misma y los callbacks de lectura pueden pedir otra
+    std::recursive_mutex _commandMutex;
+
+    //Seguimiento del trabajo GPU por cola (timeline semaphores)
+    GpuTimeline _graphicsTimeline;
+    GpuTimeline _transferTimeline;
+    GpuTicket _lastFrameTicket = 0;
+
+    //Frames en vuelo: la CPU prepara el frame N+1 mientras la GPU
+    //renderiza el N
+    uint32_t _framesInFlight = 2;
+    uint32_t _currentFrame = 0;
+    std::vector < FrameData > _frames;
+    //Ticket del último frame que usó cada imagen de la swapchain
+    std::vector < GpuTicket > _imagesInFlight;
+
+    //Lecturas GPU -> CPU: anillo de buffers, se entregan desde el renderLoop
+    std::vector < ReadbackSlot > _readbackSlots;
+    //Estado de los huecos: se piden desde cualquier hilo
+    std::mutex _readbackMutex;
+    //La swapchain admite TRANSFER_SRC
+    bool _swapChainReadable = false;
+    //Captura pendiente del próximo frame presentado
+    ReadbackCallback _swapChainReadback;
+    std::mutex _swapChainReadbackMutex;
+
+    //Presentación y ritmo de frames
+    //Política activa (hilo de render) y la pedida desde fuera
+    PresentPolicy _presentPolicy = PRESENT_LOW_LATENCY;
+    std::atomic < PresentPolicy > _requestedPolicy { PRESENT_LOW_LATENCY };
+    std::atomic < double > _requestedMaxFps { 0.0 };
+    //La swapchain se recrea en el siguiente frame
+    std::atomic < bool > _presentPolicyChanged { false };
+    FramePacer _framePacer;
+    FrameTimingStats _frameTiming;
+    mutable std::mutex _frameTimingMutex;
+    std::chrono::steady_clock::time_point _lastPresentTime;
+    FrameStatsCallback _frameStatsCallback;
+
+    //Scopes GPU con timestamps (y estadísticas de pipeline si se piden)
+    GpuProfiler _gpuProfiler;
+
+    //Compartida por todos los pipelines; se guarda al salir y cada cierto
+    //tiempo
+    PipelineCache _pipelineCache;
+    std::string _pipelineCachePath = "./pipeline_cache.bin";
+    //Pipelines gráficos deduplicados por estado; compila con _recordWorkers,
+    //así que resolve y compilePending solo desde el hilo de render
+    PipelineRegistry _pipelineRegistry;
+    //Shader modules vivos mientras exista el device
+    ShaderLibrary _shaderLibrary;
+    bool _gpuStatistics = false;
+    //Consultas activas mientras se ejecutan secundarios
+    bool _inheritedQueries = false;
+
+    //Grabación de draws en paralelo (secundarios) a partir de este número
+    //de draws. El hilo de render es el worker 0
+    WorkerPool _recordWorkers;
+    int _recordThreads = -1;
+    size_t _parallelRecordThreshold = 512;
+
+    //Hilos: el principal lee la entrada y simula, el de render consume el
+    //último FrameSnapshot publicado
+    TripleBuffer < FrameSnapshot > _snapshots;
+    uint64_t _snapshotSequence = 0;
+    double _simulationStep = 1.0 / 240.0;
+    //Paso fijo: el hilo de render genera un snapshot por frame con tiempo
+    //simulado, así dos ejecuciones renderizan los mismos frames
+    double _fixedTimeStep = 0.0;
+    FrameSnapshot _fixedStepSnapshot;
+    CameraPath _cameraPath;
+    InstanceUpdater _instanceUpdater;
+    std::atomic < bool > _running { false };
+    std::exception_ptr _renderError;
+
+    //El callback de resize solo deja constancia; se recrea en el render
+    std::atomic < bool > _framebufferResized { false };
+    std::atomic < int > _windowWidth { 0 };
+    std::atomic < int > _windowHeight { 0 };
 
     //Sincronización
-    //Imagen adquirida y preparada para renderizarse.
-    VkSemaphore _imageAvailableSemaphore;
-
-    //Renderizado acabado, ya se puede presentar.
-    VkSemaphore _renderFinishedSemaphore;
+    //Renderizado acabado, ya se puede presentar. Uno por imagen de la
+    //swapchain: solo se reutiliza al volver a adquirir esa imagen
+    std::vector < VkSemaphore > _renderFinishedSemaphores;
+    //Swapchains viejas pendientes de destruir (ver RetiredSwapChain)
+    std::vector < RetiredSwapChain > _retiredSwapChains;
 
     bool alreadyCreatedDSL=false;
 
   public:
+    //El modo headless se elige al construir; width y height son el tamaño
+    //inicial de la ventana o el de las imágenes offscreen
+    explicit vulkanApp ( bool headless = false,
+                         uint32_t width = 800,
+                         uint32_t height = 600 );
+
     void run ( );
 
+    bool isHeadless ( ) const;
+
+    //Solo headless: vuelca cada frame a <prefix>_NNNNNN.ppm
+    void setFrameOutput ( const std::string &prefix );
+
+    //run ( ) termina tras renderizar este número de frames (0: sin límite)
+    void setFrameLimit ( uint64_t frames );
+
+    //Se puede llamar desde cualquier hilo
+    void requestStop ( );
+
+    //PPM binario (P6) de una lectura RGBA8/BGRA8
+    static bool writePPM ( const std::string &filename,
+                           const ReadbackResult &result );
+
+    //Antes de run ( )
+    void setFramesInFlight ( uint32_t count );
+
+    //maxFps solo se usa con PRESENT_FRAME_CAP
+    void setPresentPolicy ( PresentPolicy policy, double maxFps = 0.0 );
+
+    PresentPolicy presentPolicy ( ) const;
+
+    FrameTimingStats frameTimingStats ( ) const;
+
+    //Frecuencia de actualización del hilo principal
+    void setSimulationRate ( double hz );
+
+    //Antes de run ( ). 0: tiempo real
+    void setFixedTimeStep ( double seconds );
+
+    //Antes de run ( ). Sin camino se usa la cámara fija por defecto
+    void setCameraPath ( CameraPath path );
+
+    //Antes de run ( ). Copias instanciadas del mallado en cada frame; sin
+    //updater no se crea el pipeline instanciado
+    void setInstanceUpdater ( InstanceUpdater updater );
+
+    //Antes de run ( ). Se invoca en el hilo de render tras cada frame
+    void setFrameStatsCallback ( FrameStatsCallback callback );
+
+    //Antes de run ( ). Hilos extra que graban draws en secundarios
+    //(-1: según los núcleos disponibles; 0: todo en el hilo de render)
+    void setRecordThreads ( int threads );
+
+    //Antes de run ( ). Invocaciones de vertex y geometry shader y
+    //primitivas tras el clipping, si el dispositivo lo soporta
+    void setGpuStatistics ( bool enable );
+
+    //Antes de run ( ). Con DRAW_INDIRECT caben maxDraws objetos por frame
+    //en el buffer; el resto se dibuja por el camino directo
+    void setDrawPath ( DrawPath path, uint32_t maxDraws = 16384 );
+
+    //Antes de run ( ). Con DRAW_GPU_CULLED, descarta también lo oculto por
+    //la profundidad del frame anterior
+    void setOcclusionCulling ( bool enable );
+
+    //Antes de run ( ). Descarta en CPU (SIMD, en paralelo con los workers
+    //de grabación) lo que queda fuera del frustum. No aplica a
+    //DRAW_GPU_CULLED
+    void setCpuCulling ( bool enable );
+
+    //Antes de run ( ). Reenvía el command buffer de la imagen sin regrabar
+    //mientras la lista de draws no cambie (la cámara va en el UBO). No
+    //aplica con culling de oclusión. Por defecto desactivada
+    void setCommandBufferReuse ( bool enable );
+
+    //Antes de run ( ). Fichero de la pipeline cache (vacío: sin disco)
+    void setPipelineCachePath ( const std::string &path );
+
+    //Scopes del último frame leído (llega con _framesInFlight de retraso)
+    std::vector < GpuScopeResult > gpuProfile ( ) const;
+
     void initWindow ( );
 
     void initVulkan ( );
 
     void mainLoop ( );
 
+    void renderLoop ( );
+
+    void updateScene ( FrameSnapshot &snapshot );
+
+    void applyPresentPolicy ( );
+
     void cleanupSwapChain ( );
 
     void cleanup ( );
@@ -149,6 +452,10 @@ class vulkanApp
 
     void recreateSwapChain ( );
 
+    //Tras cada present: entrega al timeline las swapchains viejas que ya
+    //han cumplido sus presents
+    void retireSwapChains ( );
+
     void createInstance ( );
 
     void setupDebugCallback ( );
@@ -159,7 +466,9 @@ class vulkanApp
 
     void createLogicalDevice ( );
 
-    void createSwapChain ( );
+    void createSwapChain ( VkSwapchainKHR oldSwapChain = VK_NULL_HANDLE );
+
+    void createOffscreenTargets ( );
 
     void createImageViews ( );
 
@@ -183,7 +492,7 @@ class vulkanApp
 
     bool hasStencilComponent ( VkFormat format );
 
-    void createTextureImage ( );
+    void createTextureImage ( UploadBatch &batch );
 
     void createTextureImageView ( );
 
@@ -191,7 +500,11 @@ class vulkanApp
 
     VkImageView createImageView ( VkImage image,
                                   VkFormat format,
-                                  VkImageAspectFlags aspectFlags );
+                                  VkImageAspectFlags aspectFlags,
+                                  uint32_t baseMipLevel = 0,
+                                  uint32_t levelCount = 1,
+                                  uint32_t baseArrayLayer = 0,
+                                  uint32_t layerCount = 1 );
 
     void createImage ( uint32_t width,
                        uint32_t height,
@@ -200,26 +513,43 @@ class vulkanApp
                        VkImageUsageFlags usage,
                        VkMemoryPropertyFlags properties,
                        VkImage &image,
-                       VkDeviceMemory &imageMemory );
+                       VkDeviceMemory &imageMemory,
+                       uint32_t mipLevels = 1,
+                       uint32_t arrayLayers = 1 );
 
+    //Solo encola la transición; se emite en el siguiente flush del tracker
     void transitionImageLayout ( VkImage image,
-                                 VkFormat format,
-                                 VkImageLayout oldLayout,
-                                 VkImageLayout newLayout );
-
-    void copyBufferToImage ( VkBuffer buffer,
+                                 VkImageLayout newLayout,
+                                 uint32_t baseMipLevel = 0,
+                                 uint32_t levelCount = VK_REMAINING_MIP_LEVELS,
+                                 uint32_t baseArrayLayer = 0,
+                                 uint32_t layerCount =
+                                   VK_REMAINING_ARRAY_LAYERS );
+
+    void copyBufferToImage ( VkCommandBuffer commandBuffer,
+                             VkBuffer buffer,
                              VkImage image,
                              uint32_t width,
                              uint32_t height );
 
     void loadModel ( );
 
-    void createVertexBuffer ( );
+    void createVertexBuffer ( UploadBatch &batch );
 
-    void createIndexBuffer ( );
+    void createIndexBuffer ( UploadBatch &batch );
 
     void createUniformBuffer ( );
 
+    void createIndirectBuffers ( );
+
+    void createCullingResources ( );
+
+    void destroyCullingResources ( );
+
+    void createHiZResources ( );
+
+    std::function < void ( ) > releaseHiZResources ( );
+
     void createDescriptorPool ( );
 
     void createDescriptorSet ( );
@@ -230,26 +560,167 @@ class vulkanApp
                         VkBuffer &buffer,
                         VkDeviceMemory &bufferMemory );
 
-    VkCommandBuffer beginSingleTimeCommands ( );
+    //API de subidas y readbackImage/readbackBuffer: desde cualquier hilo
+    //(toman _commandMutex). Un mismo UploadBatch no se comparte entre
+    //hilos. Los callbacks de lectura se ejecutan en el hilo de render
+    void beginUploadBatch ( UploadBatch &batch );
+
+    VkBuffer stageUpload ( UploadBatch &batch,
+                           const void *data,
+                           VkDeviceSize size );
+
+    void recordImageHandOff ( UploadBatch &batch,
+                              VkImage image,
+                              VkImageLayout newLayout,
+                              VkPipelineStageFlags dstStage,
+                              VkAccessFlags dstAccess );
+
+    void recordBufferHandOff ( UploadBatch &batch,
+                               VkBuffer buffer,
+                               VkPipelineStageFlags dstStage,
+                               VkAccessFlags dstAccess );
+
+    void recordHandOffs ( UploadBatch &batch );
+
+    void submitUploadBatch ( UploadBatch &batch );
 
-    void endSingleTimeCommands ( VkCommandBuffer commandBuffer );
+    void submitUploadGraphicsPart ( UploadBatch &batch );
 
-    void copyBuffer ( VkBuffer srcBuffer,
+    void streamUploadBatch ( UploadBatch &batch );
+
+    void retireUploads ( );
+
+    bool pollUploadBatch ( UploadBatch &batch );
+
+    void waitUploadBatch ( UploadBatch &batch );
+
+    void releaseUploadBatch ( UploadBatch &batch );
+
+    void copyBuffer ( VkCommandBuffer commandBuffer,
+                      VkBuffer srcBuffer,
                       VkBuffer dstBuffer,
                       VkDeviceSize size );
 
+    void createReadbackRing ( uint32_t slotCount );
+
+    void destroyReadbackRing ( );
+
+    ReadbackSlot* acquireReadbackSlot ( VkDeviceSize size );
+
+    ReadbackSlot* recordImageReadback ( VkImage image,
+                                        VkFormat format,
+                                        VkExtent2D extent,
+                                        ReadbackCallback callback );
+
+    void submitReadback ( ReadbackSlot &slot );
+
+    void markReadbackPending ( ReadbackSlot &slot, GpuTicket ticket );
+
+    bool readbackImage ( VkImage image,
+                         VkFormat format,
+                         VkExtent2D extent,
+                         ReadbackCallback callback );
+
+    bool readbackBuffer ( VkBuffer buffer,
+                          VkDeviceSize offset,
+                          VkDeviceSize size,
+                          ReadbackCallback callback );
+
+    bool readbackSwapChain ( ReadbackCallback callback );
+
+    void pollReadbacks ( );
+
+    void waitReadbacks ( );
+
+    void completeReadback ( ReadbackSlot &slot );
+
     uint32_t findMemoryType ( uint32_t typeFilter,
                               VkMemoryPropertyFlags properties );
 
     void createCommandBuffers ( );
 
+    void recordCommandBuffer ( uint32_t frameIndex,
+                               uint32_t imageIndex,
+                               const FrameSnapshot &snapshot );
+
+    const std::vector < ObjectPushConstants >& cullObjects (
+      const std::vector < ObjectPushConstants > &objects );
+
+    void buildRenderQueue ( const FrameSnapshot &snapshot,
+                            const std::vector < ObjectPushConstants > &objects,
+                            size_t first,
+                            uint32_t instanceCount );
+
+    RenderQueueStats recordQueue ( VkCommandBuffer commandBuffer,
+                                   uint32_t frameIndex,
+                                   const std::vector < ObjectPushConstants > &objects,
+                                   uint32_t instanceCount,
+                                   size_t begin,
+                                   size_t end );
+
+    uint64_t drawListFingerprint ( uint32_t imageIndex,
+                                   const std::vector < ObjectPushConstants > &objects,
+                                   uint32_t indirectCount,
+                                   uint32_t instanceCount,
+                                   bool parallel ) const;
+
+    RecordedCommandBuffer &recordedCommandBuffer ( FrameData &frame,
+                                                   uint32_t imageIndex );
+
+    void reportRecording ( const RecordedCommandBuffer &recorded, bool reused );
+
+    RenderQueueStats recordDrawsParallel ( uint32_t frameIndex,
+                                           uint32_t imageIndex,
+                                           const std::vector < ObjectPushConstants > &objects,
+                                           uint32_t instanceCount );
+
+    void bindSceneState ( VkCommandBuffer commandBuffer,
+                          uint32_t frameIndex,
+                          VkPipeline pipeline );
+
+    void setDynamicState ( VkCommandBuffer commandBuffer );
+
+    void bindMesh ( VkCommandBuffer commandBuffer );
+
+    void bindMaterial ( VkCommandBuffer commandBuffer, uint32_t frameIndex );
+
+    uint32_t writeIndirectDraws ( uint32_t frameIndex,
+                                  const std::vector < ObjectPushConstants > &objects );
+
+    void recordIndirectDraws ( VkCommandBuffer commandBuffer,
+                               uint32_t frameIndex,
+                               uint32_t drawCount );
+
+    void ensureInstanceCapacity ( size_t instanceCount );
+
+    uint32_t writeInstances ( uint32_t frameIndex,
+                              const std::vector < InstanceData > &instances );
+
+    uint32_t writeCullInput ( uint32_t frameIndex,
+                              const FrameSnapshot &snapshot );
+
+    void recordCulling ( VkCommandBuffer commandBuffer,
+                         uint32_t frameIndex,
+                         uint32_t objectCount );
+
+    void recordHiZBuild ( VkCommandBuffer commandBuffer );
+
     void createSemaphores ( );
 
-    void updateUniformBuffer ( );
+    bool collectGpuFrameTime ( uint32_t frameIndex );
+
+    void drainGpuFrameTimes ( );
 
-    void drawFrame ( );
+    void updateUniformBuffer ( const FrameSnapshot &snapshot );
 
-    VkShaderModule createShaderModule ( const std::vector < char > &code );
+    void drawFrame ( const FrameSnapshot &snapshot );
+
+    ReadbackSlot* recordFrameReadback ( uint32_t imageIndex,
+                                        ReadbackCallback callback );
+
+    VkImageLayout renderedColorLayout ( ) const;
+
+    void recordPresentTiming ( const FrameSnapshot &snapshot );
 
     VkSurfaceFormatKHR chooseSwapSurfaceFormat ( const std::vector <
       VkSurfaceFormatKHR > &availableFormats );
@@ -265,6 +736,8 @@ class vulkanApp
 
     bool isDeviceSuitable ( VkPhysicalDevice ldevice );
 
+    std::vector < const char * > getRequiredDeviceExtensions ( ) const;
+
     bool checkDeviceExtensionSupport ( VkPhysicalDevice ldevice );
 
     QueueFamilyIndices findQueueFamilies ( VkPhysicalDevice ldevice );
@@ -272,8 +745,6 @@ class vulkanApp
 
     bool checkValidationLayerSupport ( );
 
-    static std::vector < char > readFile ( const std::string &filename );
-
     static VKAPI_ATTR VkBool32
     VKAPI_CALL debugCallback ( VkDebugReportFlagsEXT flags,
                                VkDebugReportObjectTypeEXT objType,
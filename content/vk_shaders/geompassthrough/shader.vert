@@ -1,11 +1,28 @@
 #version 450
 
 layout(binding = 0) uniform UniformBufferObject {
-    mat4 _model;
     mat4 _view;
     mat4 _proj;
 } ubo;
 
+//Camino indirecto: la transformación viene del storage buffer, indexada
+//con el firstInstance de cada comando
+layout(constant_id = 0) const bool USE_OBJECT_BUFFER = false;
+
+struct ObjectData {
+    mat4 _model;
+    uint _objectIndex;
+};
+
+layout(std430, binding = 2) readonly buffer ObjectBuffer {
+    ObjectData _objects[];
+} objectBuffer;
+
+layout(push_constant) uniform ObjectPushConstants {
+    mat4 _model;
+    uint _objectIndex;
+} object;
+
 layout(location = 0) in vec3 inPosition;
 layout(location = 1) in vec3 inColor;
 layout(location = 2) in vec2 inTexCoord;
@@ -14,7 +31,10 @@ layout(location = 0) out vec3 geomColor;
 layout(location = 1) out vec2 geomTexCoord;
 
 void main() {
-    gl_Position = ubo._proj * ubo._view * ubo._model * vec4(inPosition, 1.0);
+    mat4 model = USE_OBJECT_BUFFER
+        ? objectBuffer._objects[gl_InstanceIndex]._model
+        : object._model;
+    gl_Position = ubo._proj * ubo._view * model * vec4(inPosition, 1.0);
     geomColor = inColor;
     geomTexCoord = inTexCoord;
 }
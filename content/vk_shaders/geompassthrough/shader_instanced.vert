@@ -0,0 +1,23 @@
+#version 450
+
+layout(binding = 0) uniform UniformBufferObject {
+    mat4 _view;
+    mat4 _proj;
+} ubo;
+
+layout(location = 0) in vec3 inPosition;
+layout(location = 1) in vec3 inColor;
+layout(location = 2) in vec2 inTexCoord;
+
+//Binding por instancia: transformación (una location por columna) y color
+layout(location = 3) in mat4 inModel;
+layout(location = 7) in vec4 inInstanceColor;
+
+layout(location = 0) out vec3 geomColor;
+layout(location = 1) out vec2 geomTexCoord;
+
+void main() {
+    gl_Position = ubo._proj * ubo._view * inModel * vec4(inPosition, 1.0);
+    geomColor = inColor * inInstanceColor.rgb;
+    geomTexCoord = inTexCoord;
+}
@@ -21,9 +21,32 @@
 
 #include <VKNgine/vulkanApp.h>
 
-int main ( )
+//Uso: vk_glfw [--headless] [--frames N] [--output prefijo]
+int main ( int argc, char** argv )
 {
-  vulkanApp app;
+  bool headless = false;
+  uint64_t frames = 0;
+  std::string output;
+  for ( int i = 1; i < argc; i++ )
+  {
+    std::string arg = argv[i];
+    if ( arg == "--headless" )
+    {
+      headless = true;
+    }
+    else if ( arg == "--frames" && i + 1 < argc )
+    {
+      frames = std::stoull ( argv[++i] );
+    }
+    else if ( arg == "--output" && i + 1 < argc )
+    {
+      output = argv[++i];
+    }
+  }
+
+  vulkanApp app ( headless );
+  app.setFrameLimit ( frames );
+  app.setFrameOutput ( output );
 
   try
   {
@@ -17,6 +17,7 @@
 #define GLFW_INCLUDE_VULKAN
 #include <GLFW/glfw3.h>
 #include <vulkan/vulkan.h>
+#include <VKNgine/vkPipelineCache.h>
 
 // [Win32] Our example includes a copy of glfw3.lib pre-compiled with VS2010 to maximize ease of testing and compatibility with old VS compilers.
 // To link with VS2010-era libraries, VS2015+ requires linking with legacy_stdio_definitions.lib, which we do using this pragma.
@@ -38,6 +39,7 @@ static uint32_t                 g_QueueFamily = (uint32_t)-1;
 static VkQueue                  g_Queue = VK_NULL_HANDLE;
 static VkDebugReportCallbackEXT g_DebugReport = VK_NULL_HANDLE;
 static VkPipelineCache          g_PipelineCache = VK_NULL_HANDLE;
+static PipelineCache            g_PipelineCacheFile;            // Owns g_PipelineCache, persisted to disk
 static VkDescriptorPool         g_DescriptorPool = VK_NULL_HANDLE;
 
 static ImGui_ImplVulkanH_Window g_MainWindowData;
@@ -167,6 +169,12 @@ static void SetupVulkan(const char** extensions, uint32_t extensions_count)
     vkGetDeviceQueue(g_Device, g_QueueFamily, 0, &g_Queue);
   }
 
+  // Create Pipeline Cache (loaded from disk when its header matches this device)
+  {
+    g_PipelineCacheFile.init(g_PhysicalDevice, g_Device, "./imgui_pipeline_cache.bin");
+    g_PipelineCache = g_PipelineCacheFile.handle();
+  }
+
   // Create Descriptor Pool
   {
     VkDescriptorPoolSize pool_sizes[] =
@@ -232,6 +240,10 @@ static void CleanupVulkan()
 {
   vkDestroyDescriptorPool(g_Device, g_DescriptorPool, g_Allocator);
 
+  // Saves the pipeline cache before destroying it
+  g_PipelineCacheFile.destroy();
+  g_PipelineCache = VK_NULL_HANDLE;
+
 #ifdef IMGUI_VULKAN_DEBUG_REPORT
   // Remove the debug report _callback
     auto vkDestroyDebugReportCallbackEXT = (PFN_vkDestroyDebugReportCallbackEXT)vkGetInstanceProcAddr(g_Instance, "vkDestroyDebugReportCallbackEXT");
@@ -511,6 +523,10 @@ int main(int, char**)
     FrameRender(wd);
 
     FramePresent(wd);
+
+    // Persist pipelines compiled since the last save (at most every 30 seconds)
+    if (!g_PipelineCacheFile.saveIfDue(30.0))
+      fprintf(stderr, "[vulkan] failed to save pipeline cache\n");
   }
 
   // Cleanup
@@ -0,0 +1,433 @@
+/*
+# December 27 2019,
+#
+# Juan Pedro Brito Méndez <juanpedro.brito@upm.es>
+#
+# Copyright (c) 2019, Center for Computational Simulation - Universidad Politécnica de Madrid
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+# http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+*/
+
+#include <VKNgine/vulkanApp.h>
+
+#include <cmath>
+#include <numeric>
+
+//Benchmark determinista: headless, tiempo simulado y cámara guionizada.
+//Uso: vkngine_bench [--frames N] [--warmup N] [--width W] [--height H]
+//                   [--json fichero] [--draw-path direct|indirect|culled]
+//                   [--occlusion 0|1] [--cpu-culling 0|1] [--instances N]
+//                   [--reuse 0|1] [--gpu-stats 0|1]
+//Las estadísticas de pipeline (--gpu-stats 1) añaden consultas al pase de
+//geometría y pueden mover los tiempos: desactivadas por defecto
+//Con --cull-objects N solo mide el culling de frustum en CPU (sin Vulkan):
+//N esferas y N cajas, con SIMD y en escalar, frames repeticiones
+
+struct Summary
+{
+  double _mean = 0.0;
+  double _p50 = 0.0;
+  double _p95 = 0.0;
+  double _p99 = 0.0;
+};
+
+//Percentil por rango más cercano
+static double percentile ( const std::vector < double >& sorted, double p )
+{
+  size_t rank = static_cast<size_t>(std::ceil ( p * sorted.size ( )));
+  return sorted[std::min ( std::max ( rank, size_t ( 1 )), sorted.size ( )) - 1];
+}
+
+static Summary summarize ( std::vector < double > samples )
+{
+  Summary summary;
+  if ( samples.empty ( ))
+  {
+    return summary;
+  }
+
+  std::sort ( samples.begin ( ), samples.end ( ));
+  summary._mean = std::accumulate ( samples.begin ( ), samples.end ( ), 0.0 )
+    / samples.size ( );
+  summary._p50 = percentile ( samples, 0.50 );
+  summary._p95 = percentile ( samples, 0.95 );
+  summary._p99 = percentile ( samples, 0.99 );
+  return summary;
+}
+
+static void writeSummary ( std::ostream& out,
+                           const char* name,
+                           const std::vector < double >& samples )
+{
+  out << "  \"" << name << "\": ";
+  if ( samples.empty ( ))
+  {
+    out << "null";
+    return;
+  }
+
+  Summary summary = summarize ( samples );
+  out << "{ \"samples\": " << samples.size ( )
+      << ", \"mean\": " << summary._mean
+      << ", \"p50\": " << summary._p50
+      << ", \"p95\": " << summary._p95
+      << ", \"p99\": " << summary._p99 << " }";
+}
+
+//Microbenchmark del FrustumCuller en un hilo: la misma escena con el nivel
+//SIMD detectado y forzando la versión escalar
+static int cullBenchmark ( size_t objects,
+                           uint64_t frames,
+                           uint64_t warmup,
+                           std::ostream& out )
+{
+  FrustumCuller culler;
+  culler.resize ( objects );
+
+  //Posiciones pseudoaleatorias deterministas en un cubo de 100 de lado
+  uint32_t seed = 12345;
+  auto random = [&seed] ( )
+  {
+    seed = seed * 1664525u + 1013904223u;
+    return ( seed >> 8 ) * ( 1.0f / 16777216.0f );
+  };
+  for ( size_t i = 0; i < objects; i++ )
+  {
+    float center[3] = { 100.0f * random ( ) - 50.0f,
+                        100.0f * random ( ) - 50.0f,
+                        100.0f * random ( ) - 50.0f };
+    float half = 0.5f + random ( );
+    float min[3] = { center[0] - half, center[1] - half, center[2] - half };
+    float max[3] = { center[0] + half, center[1] + half, center[2] + half };
+    culler.setSphere ( i, center[0], center[1], center[2], half );
+    culler.setBox ( i, min, max );
+  }
+
+  glm::mat4 viewProj = glm::perspective ( glm::radians ( 60.0f ),
+                                          16.0f / 9.0f,
+                                          0.1f,
+                                          100.0f )
+    * glm::lookAt ( glm::vec3 ( 0.0f, 0.0f, 0.0f ),
+                    glm::vec3 ( 1.0f, 0.0f, 0.0f ),
+                    glm::vec3 ( 0.0f, 0.0f, 1.0f ));
+  culler.setFrustum ( &viewProj[0][0] );
+
+  struct Run
+  {
+    const char* _name;
+    CullVolume _volume;
+    bool _scalar;
+    std::vector < double > _ms;
+    size_t _visible;
+  };
+  Run runs[] = { { "spheres_simd", CULL_SPHERES, false, {}, 0 },
+                 { "spheres_scalar", CULL_SPHERES, true, {}, 0 },
+                 { "boxes_simd", CULL_BOXES, false, {}, 0 },
+                 { "boxes_scalar", CULL_BOXES, true, {}, 0 } };
+
+  for ( Run& run : runs )
+  {
+    culler.setForceScalar ( run._scalar );
+    run._ms.reserve ( frames );
+    for ( uint64_t i = 0; i < warmup + frames; i++ )
+    {
+      std::chrono::steady_clock::time_point begin =
+        std::chrono::steady_clock::now ( );
+      run._visible = culler.cull ( run._volume ).size ( );
+      double ms = std::chrono::duration < double, std::milli > (
+        std::chrono::steady_clock::now ( ) - begin ).count ( );
+      if ( i >= warmup )
+      {
+        run._ms.push_back ( ms );
+      }
+    }
+  }
+
+  //Las dos versiones tienen que ver exactamente lo mismo
+  if ( runs[0]._visible != runs[1]._visible
+       || runs[2]._visible != runs[3]._visible )
+  {
+    std::cerr << "SIMD and scalar culling disagree" << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  out << "{\n"
+      << "  \"cull_objects\": " << objects << ",\n"
+      << "  \"frames\": " << frames << ",\n"
+      << "  \"simd_path\": \"" << FrustumCuller::simdPath ( ) << "\",\n"
+      << "  \"visible_spheres\": " << runs[0]._visible << ",\n"
+      << "  \"visible_boxes\": " << runs[2]._visible << ",\n";
+  for ( size_t i = 0; i < 4; i++ )
+  {
+    writeSummary ( out,
+                   ( std::string ( runs[i]._name ) + "_ms" ).c_str ( ),
+                   runs[i]._ms );
+    out << ( i < 3 ? ",\n" : "\n" );
+  }
+  out << "}\n";
+
+  return EXIT_SUCCESS;
+}
+
+int main ( int argc, char** argv )
+{
+  uint64_t frames = 600;
+  uint64_t warmup = 60;
+  uint32_t width = 1280;
+  uint32_t height = 720;
+  std::string jsonPath;
+  DrawPath drawPath = DRAW_DIRECT;
+  bool occlusion = false;
+  bool cpuCulling = false;
+  uint32_t instances = 0;
+  bool reuse = false;
+  bool gpuStats = false;
+  size_t cullObjects = 0;
+
+  for ( int i = 1; i < argc; i += 2 )
+  {
+    std::string arg = argv[i];
+    //Todas las opciones llevan valor
+    if ( i + 1 >= argc )
+    {
+      std::cerr << "missing value for " << arg << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    if ( arg == "--frames" )
+    {
+      frames = std::stoull ( argv[i + 1] );
+    }
+    else if ( arg == "--warmup" )
+    {
+      warmup = std::stoull ( argv[i + 1] );
+    }
+    else if ( arg == "--width" )
+    {
+      width = static_cast<uint32_t>(std::stoul ( argv[i + 1] ));
+    }
+    else if ( arg == "--height" )
+    {
+      height = static_cast<uint32_t>(std::stoul ( argv[i + 1] ));
+    }
+    else if ( arg == "--json" )
+    {
+      jsonPath = argv[i + 1];
+    }
+    else if ( arg == "--draw-path" )
+    {
+      std::string path = argv[i + 1];
+      drawPath = path == "indirect"
+                 ? DRAW_INDIRECT
+                 : path == "culled" ? DRAW_GPU_CULLED : DRAW_DIRECT;
+    }
+    else if ( arg == "--occlusion" )
+    {
+      occlusion = std::string ( argv[i + 1] ) == "1";
+    }
+    else if ( arg == "--cpu-culling" )
+    {
+      cpuCulling = std::string ( argv[i + 1] ) == "1";
+    }
+    else if ( arg == "--instances" )
+    {
+      instances = static_cast<uint32_t>(std::stoul ( argv[i + 1] ));
+    }
+    else if ( arg == "--reuse" )
+    {
+      reuse = std::string ( argv[i + 1] ) == "1";
+    }
+    else if ( arg == "--gpu-stats" )
+    {
+      gpuStats = std::string ( argv[i + 1] ) == "1";
+    }
+    else if ( arg == "--cull-objects" )
+    {
+      cullObjects = std::stoull ( argv[i + 1] );
+    }
+    else
+    {
+      std::cerr << "unknown option " << arg << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  std::ofstream file;
+  if ( !jsonPath.empty ( ))
+  {
+    file.open ( jsonPath );
+    if ( !file )
+    {
+      std::cerr << "failed to open " << jsonPath << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  std::ostream& out = jsonPath.empty ( ) ? std::cout : file;
+
+  if ( cullObjects > 0 )
+  {
+    return cullBenchmark ( cullObjects, frames, warmup, out );
+  }
+
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now ( );
+
+  vulkanApp app ( true, width, height );
+  app.setPresentPolicy ( PRESENT_UNCAPPED );
+  app.setFixedTimeStep ( 1.0 / 60.0 );
+  app.setFrameLimit ( warmup + frames );
+  app.setGpuStatistics ( gpuStats );
+  app.setDrawPath ( drawPath );
+  app.setOcclusionCulling ( occlusion );
+  app.setCpuCulling ( cpuCulling );
+  app.setCommandBufferReuse ( reuse );
+
+  //Rejilla de copias reducidas del modelo, cada una con su color y giro
+  if ( instances > 0 )
+  {
+    app.setInstanceUpdater ( [ instances ] ( double time,
+                                            std::vector < InstanceData >& data )
+    {
+      uint32_t side = static_cast<uint32_t>(std::ceil ( std::sqrt ( instances )));
+      float spacing = 4.0f / side;
+      float scale = 0.8f * spacing;
+
+      data.resize ( instances );
+      for ( uint32_t i = 0; i < instances; i++ )
+      {
+        float u = ( i % side + 0.5f ) / side;
+        float v = ( i / side + 0.5f ) / side;
+        glm::mat4 model = glm::translate ( glm::mat4 ( 1.0f ),
+                                           glm::vec3 ( 4.0f * u - 2.0f,
+                                                       4.0f * v - 2.0f,
+                                                       -0.5f ));
+        model = glm::rotate ( model,
+                              static_cast<float>(time) + 6.2832f * u,
+                              glm::vec3 ( 0.0f, 0.0f, 1.0f ));
+        data[i]._model = glm::scale ( model, glm::vec3 ( scale ));
+        data[i]._color = glm::vec4 ( u, v, 1.0f - u, 1.0f );
+      }
+    } );
+  }
+
+  //Órbita alrededor del modelo subiendo y bajando
+  app.setCameraPath ( [] ( double time )
+  {
+    float angle = static_cast<float>(time) * 0.5f;
+    glm::vec3 eye ( 3.0f * std::cos ( angle ),
+                    3.0f * std::sin ( angle ),
+                    1.5f + 0.5f * std::sin ( 2.0f * angle ));
+    return glm::lookAt ( eye,
+                         glm::vec3 ( 0.0f, 0.0f, 0.0f ),
+                         glm::vec3 ( 0.0f, 0.0f, 1.0f ));
+  } );
+
+  //El primer frame nunca tiene tiempo de frame: el calentamiento mínimo es 1
+  uint64_t skip = std::max ( warmup, uint64_t ( 1 ));
+  double startupMs = 0.0;
+  std::vector < double > cpuFrameMs;
+  std::vector < double > gpuFrameMs;
+  std::vector < double > stateBinds;
+  std::vector < double > elidedBinds;
+  uint64_t frameCount = 0;
+  uint64_t gpuFrameCount = 0;
+  FrameTimingStats lastStats;
+  std::vector < GpuScopeResult > gpuScopes;
+  cpuFrameMs.reserve ( frames );
+  gpuFrameMs.reserve ( frames );
+
+  app.setFrameStatsCallback ( [&] ( const FrameTimingStats& stats )
+  {
+    //Al terminar llegan los tiempos GPU de los últimos frames en vuelo sin
+    //frame nuevo: solo cuentan para gpu_frame_ms
+    bool newFrame = stats._frameCount != frameCount;
+    frameCount = stats._frameCount;
+
+    if ( newFrame && stats._frameCount == 1 )
+    {
+      startupMs = std::chrono::duration < double, std::milli > (
+        std::chrono::steady_clock::now ( ) - start ).count ( );
+    }
+    lastStats = stats;
+    if ( newFrame && stats._frameCount > skip )
+    {
+      cpuFrameMs.push_back ( stats._frameTimeMs );
+      stateBinds.push_back ( stats._stateBinds );
+      elidedBinds.push_back ( stats._elidedBinds );
+    }
+    if ( stats._gpuFrameCount != gpuFrameCount )
+    {
+      gpuFrameCount = stats._gpuFrameCount;
+      if ( gpuFrameCount > skip )
+      {
+        gpuFrameMs.push_back ( stats._gpuFrameTimeMs );
+      }
+      gpuScopes = app.gpuProfile ( );
+    }
+  } );
+
+  try
+  {
+    app.run ( );
+  }
+  catch ( const std::runtime_error& e )
+  {
+    std::cerr << e.what ( ) << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  out << "{\n"
+      << "  \"frames\": " << frames << ",\n"
+      << "  \"warmup\": " << warmup << ",\n"
+      << "  \"width\": " << width << ",\n"
+      << "  \"height\": " << height << ",\n"
+      << "  \"startup_ms\": " << startupMs << ",\n";
+  writeSummary ( out, "cpu_frame_ms", cpuFrameMs );
+  out << ",\n";
+  writeSummary ( out, "gpu_frame_ms", gpuFrameMs );
+  out << ",\n";
+  writeSummary ( out, "state_binds", stateBinds );
+  out << ",\n";
+  writeSummary ( out, "elided_binds", elidedBinds );
+  out << ",\n";
+
+  //Primarios reenviados sin regrabar durante toda la ejecución
+  uint64_t submitted = lastStats._commandBufferHits
+    + lastStats._commandBufferRecords;
+  out << "  \"command_buffer_hits\": " << lastStats._commandBufferHits << ",\n"
+      << "  \"command_buffer_hit_rate\": "
+      << ( submitted ? double ( lastStats._commandBufferHits ) / submitted : 0.0 )
+      << ",\n";
+
+  //Scopes del último frame medido
+  out << "  \"gpu_scopes\": [";
+  for ( size_t i = 0; i < gpuScopes.size ( ); i++ )
+  {
+    const GpuScopeResult& scope = gpuScopes[i];
+    out << ( i ? ",\n" : "\n" )
+        << "    { \"name\": \"" << scope._name << "\""
+        << ", \"depth\": " << scope._depth
+        << ", \"ms\": " << scope._timeMs;
+    if ( scope._hasStatistics )
+    {
+      out << ", \"vertex_invocations\": " << scope._vertexInvocations
+          << ", \"geometry_invocations\": " << scope._geometryInvocations
+          << ", \"clipping_primitives\": " << scope._clippingPrimitives;
+    }
+    out << " }";
+  }
+  out << "\n  ]\n}\n";
+
+  return EXIT_SUCCESS;
+}